@@ -20,6 +20,7 @@
 #include <linux/sched.h>
 #include <linux/init.h>
 #include <linux/hashtable.h>
+#include <linux/rcupdate.h>
 #include <linux/uaccess.h>
 #include <linux/sizes.h>
 
@@ -61,6 +62,8 @@ static void __kdbus_bus_free(struct kref *kref)
 	kdbus_bus_disconnect(bus);
 	pr_debug("clean up bus %s/%s\n", bus->ns->devpath, bus->name);
 
+	kdbus_hash_cleanup(&bus->conn_hash);
+	kfree(bus->match_bloom_heads);
 	kfree(bus->name);
 	kfree(bus);
 }
@@ -76,15 +79,42 @@ void kdbus_bus_unref(struct kdbus_bus *bus)
 	kref_put(&bus->kref, __kdbus_bus_free);
 }
 
+/**
+ * kdbus_bus_find_conn_by_id() - find and pin a connection on the bus
+ * @bus:	The bus to search
+ * @id:		The id of the connection
+ *
+ * The lookup does not take the bus lock; connections are added to and
+ * removed from conn_hash under the bus lock, and are freed only after an
+ * RCU grace period. A connection which is already on its way out is not
+ * returned.
+ *
+ * Return: the connection with an additional reference, or NULL; the
+ * reference has to be dropped with kdbus_conn_unref().
+ */
 struct kdbus_conn *kdbus_bus_find_conn_by_id(struct kdbus_bus *bus, u64 id)
 {
-	struct kdbus_conn *conn;
+	struct kdbus_conn *conn, *found = NULL;
+	struct kdbus_hash_table *t;
+	unsigned int seq;
+
+	rcu_read_lock();
+	do {
+		seq = kdbus_hash_read_begin(&bus->conn_hash, &t);
+		kdbus_hash_for_each_possible_rcu(t, conn, hentry, id) {
+			if (conn->id != id)
+				continue;
+
+			if (kref_get_unless_zero(&conn->kref))
+				found = conn;
+			goto exit_unlock;
+		}
+	} while (kdbus_hash_read_retry(&bus->conn_hash, seq));
 
-	hash_for_each_possible(bus->conn_hash, conn, hentry, id)
-		if (conn->id == id)
-			return conn;
+exit_unlock:
+	rcu_read_unlock();
 
-	return NULL;
+	return found;
 }
 
 /**
@@ -112,6 +142,29 @@ void kdbus_bus_disconnect(struct kdbus_bus *bus)
 	pr_debug("closing bus %s/%s\n", bus->ns->devpath, bus->name);
 }
 
+/**
+ * kdbus_bus_stats() - add up the counters of all connections of a bus
+ * @bus:	The bus
+ * @s:		The counters to fill in
+ *
+ * The counters include the connections which are gone already; the
+ * queue depth is the one of all connections together, the pool fields
+ * are not used.
+ */
+void kdbus_bus_stats(struct kdbus_bus *bus, struct kdbus_cmd_conn_stats *s)
+{
+	struct kdbus_conn *conn;
+	unsigned int i;
+
+	mutex_lock(&bus->lock);
+	*s = bus->stats_gone;
+	kdbus_hash_for_each(&bus->conn_hash, i, conn, hentry) {
+		kdbus_conn_stats_add(conn, s);
+		s->queue_depth += ACCESS_ONCE(conn->msg_count);
+	}
+	mutex_unlock(&bus->lock);
+}
+
 static struct kdbus_bus *kdbus_bus_find(struct kdbus_ns *ns, const char *name)
 {
 	struct kdbus_bus *bus = NULL;
@@ -174,9 +227,10 @@ int kdbus_bus_new(struct kdbus_ns *ns, struct kdbus_cmd_bus_kmake *bus_kmake,
 	b->bloom_size = bus_kmake->make.bloom_size;
 	b->conn_id_next = 1; /* connection 0 == kernel */
 	mutex_init(&b->lock);
-	hash_init(b->conn_hash);
 	INIT_LIST_HEAD(&b->eps_list);
 	INIT_LIST_HEAD(&b->monitors_list);
+	INIT_HLIST_HEAD(&b->match_any_list);
+	INIT_HLIST_HEAD(&b->match_kernel_list);
 
 	b->name = kstrdup(bus_kmake->name, GFP_KERNEL);
 	if (!b->name) {
@@ -184,6 +238,17 @@ int kdbus_bus_new(struct kdbus_ns *ns, struct kdbus_cmd_bus_kmake *bus_kmake,
 		goto ret;
 	}
 
+	ret = kdbus_hash_init(&b->conn_hash, 6);
+	if (ret < 0)
+		goto ret;
+
+	b->match_bloom_heads = kcalloc(b->bloom_size / sizeof(u64),
+				       sizeof(struct hlist_head), GFP_KERNEL);
+	if (!b->match_bloom_heads) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+
 	b->name_registry = kdbus_name_registry_new();
 	if (!b->name_registry) {
 		ret = -ENOMEM;
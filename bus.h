@@ -16,6 +16,7 @@
 #include <linux/hashtable.h>
 
 #include "internal.h"
+#include "hash.h"
 
 /*
  * kdbus bus
@@ -36,15 +37,26 @@ struct kdbus_bus {
 	struct mutex lock;		/* bus data lock */
 	u64 ep_id_next;			/* next endpoint id sequence number */
 	u64 conn_id_next;		/* next connection id sequence number */
-	u64 msg_id_next;		/* next message id sequence number */
+	atomic64_t msg_seq_last;	/* last message sequence number */
 	struct idr conn_idr;		/* map of connection ids */
-	DECLARE_HASHTABLE(conn_hash, 6);
+	struct kdbus_hash conn_hash;	/* connections, RCU for readers */
 	struct list_head eps_list;	/* endpoints on this bus */
 	u64 bus_flags;			/* simple pass-thru flags from userspace to userspace */
 	size_t bloom_size;		/* bloom filter size */
 	struct kdbus_name_registry *name_registry;
 	struct list_head bus_entry;	/* namespace's list of buses */
 	struct list_head monitors_list;	/* connections that monitor */
+
+	/* match databases of the connections, indexed to find the possible
+	 * receivers of a broadcast without looking at all connections */
+	struct hlist_head *match_bloom_heads;	/* by a bloom word they require */
+	struct hlist_head match_any_list;	/* accepting any bloom filter */
+	struct hlist_head match_kernel_list;	/* accepting kernel notifications */
+	unsigned int match_count;		/* bloom heads and any list */
+	unsigned int match_kernel_count;	/* kernel list */
+
+	/* counters of the connections which are gone, protected by lock */
+	struct kdbus_cmd_conn_stats stats_gone;
 };
 
 struct kdbus_cmd_bus_kmake {
@@ -56,6 +68,7 @@ bool kdbus_bus_uid_is_privileged(const struct kdbus_bus *bus);
 struct kdbus_bus *kdbus_bus_ref(struct kdbus_bus *bus);
 void kdbus_bus_unref(struct kdbus_bus *bus);
 void kdbus_bus_disconnect(struct kdbus_bus *bus);
+void kdbus_bus_stats(struct kdbus_bus *bus, struct kdbus_cmd_conn_stats *s);
 int kdbus_bus_new(struct kdbus_ns *ns, struct kdbus_cmd_bus_kmake *kmake,
 		  umode_t mode, kuid_t uid, kgid_t gid, struct kdbus_bus **bus);
 void kdbus_bus_scan_timeout_list(struct kdbus_bus *bus);
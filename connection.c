@@ -43,14 +43,36 @@
 #include "names.h"
 #include "policy.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/* the latencies need the clock only while their tracepoint is enabled */
+#define kdbus_trace_enabled(name) static_key_false(&__tracepoint_##name.key)
+
 struct kdbus_conn *kdbus_conn_ref(struct kdbus_conn *conn);
 void kdbus_conn_unref(struct kdbus_conn *conn);
 
+/* number of passed files which fit into the queue entry itself */
+#define KDBUS_CONN_QUEUE_INLINE_FDS	4
+
 struct kdbus_conn_queue {
 	struct list_head entry;
+	struct rb_node deadline_node;
+
+	/*
+	 * The oldest message of every priority is in msg_prio_tree, the
+	 * newer ones of the same priority are linked behind it.
+	 */
+	s64 priority;
+	struct rb_node prio_node;
+	struct list_head prio_entry;
 
 	/* offset to the message placed in the receiver's buffer */
 	size_t off;
+	size_t size;
+
+	/* when the message was queued, only while it is traced */
+	u64 queued_ns;
 
 	/* passed KDBUS_MSG_PAYLOAD_MEMFD */
 	size_t *memfds;
@@ -62,6 +84,11 @@ struct kdbus_conn_queue {
 	struct file **fds_fp;
 	unsigned int fds_count;
 
+	/* arrays for the common case of only a few passed files */
+	size_t memfds_inline[KDBUS_CONN_QUEUE_INLINE_FDS];
+	struct file *memfds_fp_inline[KDBUS_CONN_QUEUE_INLINE_FDS];
+	struct file *fds_fp_inline[KDBUS_CONN_QUEUE_INLINE_FDS];
+
 	/* timeout in the queue */
 	u64 deadline_ns;
 	u64 src_id;
@@ -69,6 +96,191 @@ struct kdbus_conn_queue {
 	bool expect_reply;
 };
 
+/*
+ * A method call which waits for its reply, linked into the connection
+ * which received the call. The reply is routed back to the caller by
+ * the cookie, without looking up the destination name or the policy.
+ * Only the id of the caller is kept; a caller which went away must not
+ * be pinned, with its pool, by a receiver which never answers.
+ */
+struct kdbus_conn_reply {
+	struct kdbus_hash_node hentry;
+	u64 id;					/* the caller */
+	u64 cookie;
+	u64 deadline_ns;
+};
+
+static struct kmem_cache *kdbus_conn_queue_cache;
+static struct kmem_cache *kdbus_conn_reply_cache;
+
+int kdbus_conn_cache_init(void)
+{
+	kdbus_conn_queue_cache = KMEM_CACHE(kdbus_conn_queue, 0);
+	if (!kdbus_conn_queue_cache)
+		return -ENOMEM;
+
+	kdbus_conn_reply_cache = KMEM_CACHE(kdbus_conn_reply, 0);
+	if (!kdbus_conn_reply_cache) {
+		kmem_cache_destroy(kdbus_conn_queue_cache);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void kdbus_conn_cache_exit(void)
+{
+	kmem_cache_destroy(kdbus_conn_reply_cache);
+	kmem_cache_destroy(kdbus_conn_queue_cache);
+}
+
+/* the caller holds reply_lock */
+static struct kdbus_conn_reply *
+kdbus_conn_reply_find(struct kdbus_conn *conn, u64 id, u64 cookie)
+{
+	struct kdbus_conn_reply *reply;
+
+	kdbus_hash_for_each_possible(&conn->reply_hash, reply, hentry, cookie)
+		if (reply->cookie == cookie && reply->id == id)
+			return reply;
+
+	return NULL;
+}
+
+/* the caller holds reply_lock */
+static void kdbus_conn_reply_free(struct kdbus_conn *conn,
+				  struct kdbus_conn_reply *reply)
+{
+	__kdbus_hash_del(&conn->reply_hash, &reply->hentry);
+	kmem_cache_free(kdbus_conn_reply_cache, reply);
+}
+
+static bool kdbus_conn_reply_expired(const struct kdbus_conn_reply *reply,
+				     u64 now_ns)
+{
+	return reply->deadline_ns && reply->deadline_ns <= now_ns;
+}
+
+/* the caller holds reply_lock */
+static void kdbus_conn_reply_purge(struct kdbus_conn *conn, u64 now_ns)
+{
+	struct kdbus_conn_reply *reply;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	kdbus_hash_for_each_safe(&conn->reply_hash, i, tmp, reply, hentry)
+		if (kdbus_conn_reply_expired(reply, now_ns))
+			kdbus_conn_reply_free(conn, reply);
+
+	kdbus_hash_shrink(&conn->reply_hash);
+}
+
+/* remember a method call until its receiver replies */
+static int kdbus_conn_reply_add(struct kdbus_conn *conn_src,
+				struct kdbus_conn *conn_dst,
+				u64 cookie, u64 deadline_ns, u64 now_ns)
+{
+	struct kdbus_conn_reply *reply;
+	int ret = 0;
+
+	reply = kmem_cache_alloc(kdbus_conn_reply_cache, GFP_KERNEL);
+	if (!reply)
+		return -ENOMEM;
+
+	mutex_lock(&conn_dst->reply_lock);
+	if (conn_dst->type != KDBUS_CONN_EP_CONNECTED) {
+		ret = -ENOTCONN;
+		goto exit_unlock;
+	}
+
+	/* expired calls are only removed when the space is needed */
+	if (conn_dst->reply_hash.count >= KDBUS_CONN_MAX_REQUESTS_PENDING) {
+		kdbus_conn_reply_purge(conn_dst, now_ns);
+		if (conn_dst->reply_hash.count >=
+		    KDBUS_CONN_MAX_REQUESTS_PENDING) {
+			ret = -EMLINK;
+			goto exit_unlock;
+		}
+	}
+
+	reply->id = conn_src->id;
+	reply->cookie = cookie;
+	reply->deadline_ns = deadline_ns;
+	kdbus_hash_add(&conn_dst->reply_hash, &reply->hentry, cookie);
+	reply = NULL;
+
+exit_unlock:
+	mutex_unlock(&conn_dst->reply_lock);
+	if (reply)
+		kmem_cache_free(kdbus_conn_reply_cache, reply);
+	return ret;
+}
+
+/* forget a method call which could not be delivered */
+static void kdbus_conn_reply_drop(struct kdbus_conn *conn_src,
+				  struct kdbus_conn *conn_dst, u64 cookie)
+{
+	struct kdbus_conn_reply *reply;
+
+	mutex_lock(&conn_dst->reply_lock);
+	reply = kdbus_conn_reply_find(conn_dst, conn_src->id, cookie);
+	if (reply)
+		kdbus_conn_reply_free(conn_dst, reply);
+	mutex_unlock(&conn_dst->reply_lock);
+}
+
+/*
+ * If the message answers a method call the sender received, return the
+ * caller, if it is still on the bus; the call is answered and forgotten.
+ */
+static struct kdbus_conn *kdbus_conn_reply_take(struct kdbus_conn *conn,
+						const struct kdbus_msg *msg,
+						u64 now_ns)
+{
+	struct kdbus_conn_reply *reply;
+	bool answered = false;
+
+	if (msg->flags & KDBUS_MSG_FLAGS_EXPECT_REPLY || msg->cookie_reply == 0)
+		return NULL;
+
+	if (msg->dst_id == KDBUS_DST_ID_WELL_KNOWN_NAME ||
+	    msg->dst_id == KDBUS_DST_ID_BROADCAST)
+		return NULL;
+
+	mutex_lock(&conn->reply_lock);
+	reply = kdbus_conn_reply_find(conn, msg->dst_id, msg->cookie_reply);
+	if (reply) {
+		answered = !kdbus_conn_reply_expired(reply, now_ns);
+		kdbus_conn_reply_free(conn, reply);
+	}
+	mutex_unlock(&conn->reply_lock);
+
+	if (!answered)
+		return NULL;
+
+	return kdbus_bus_find_conn_by_id(conn->ep->bus, msg->dst_id);
+}
+
+/* tell the callers that their calls will not be answered anymore */
+static void kdbus_conn_reply_cleanup(struct kdbus_conn *conn,
+				     struct list_head *notify_list)
+{
+	struct kdbus_conn_reply *reply;
+	struct hlist_node *tmp;
+	unsigned int i;
+	u64 now = kdbus_now_ns();
+
+	mutex_lock(&conn->reply_lock);
+	kdbus_hash_for_each_safe(&conn->reply_hash, i, tmp, reply, hentry) {
+		if (reply->id != conn->id &&
+		    !kdbus_conn_reply_expired(reply, now))
+			kdbus_notify_reply_dead(reply->id,
+						reply->cookie, notify_list);
+		kdbus_conn_reply_free(conn, reply);
+	}
+	mutex_unlock(&conn->reply_lock);
+}
+
 static void kdbus_conn_fds_unref(struct kdbus_conn_queue *queue)
 {
 	unsigned int i;
@@ -83,7 +295,8 @@ static void kdbus_conn_fds_unref(struct kdbus_conn_queue *queue)
 		fput(queue->fds_fp[i]);
 	}
 
-	kfree(queue->fds_fp);
+	if (queue->fds_fp != queue->fds_fp_inline)
+		kfree(queue->fds_fp);
 	queue->fds_fp = NULL;
 
 	queue->fds_count = 0;
@@ -95,9 +308,14 @@ static int kdbus_conn_fds_ref(struct kdbus_conn_queue *queue,
 {
 	unsigned int i;
 
-	queue->fds_fp = kmalloc(fds_count * sizeof(struct file *), GFP_KERNEL);
-	if (!queue->fds_fp)
-		return -ENOMEM;
+	if (fds_count <= KDBUS_CONN_QUEUE_INLINE_FDS) {
+		queue->fds_fp = queue->fds_fp_inline;
+	} else {
+		queue->fds_fp = kmalloc(fds_count * sizeof(struct file *),
+					GFP_KERNEL);
+		if (!queue->fds_fp)
+			return -ENOMEM;
+	}
 
 	for (i = 0; i < fds_count; i++) {
 		queue->fds_fp[i] = fget(fds[i]);
@@ -114,44 +332,49 @@ static void kdbus_conn_memfds_unref(struct kdbus_conn_queue *queue)
 {
 	unsigned int i;
 
-	if (!queue->memfds_fp)
-		return;
-
-	for (i = 0; i < queue->memfds_count; i++) {
+	for (i = 0; queue->memfds_fp && i < queue->memfds_count; i++) {
 		if (!queue->memfds_fp[i])
 			break;
 
 		fput(queue->memfds_fp[i]);
 	}
 
-	kfree(queue->memfds_fp);
+	if (queue->memfds_fp != queue->memfds_fp_inline)
+		kfree(queue->memfds_fp);
 	queue->memfds_fp = NULL;
 
-	kfree(queue->memfds);
+	if (queue->memfds != queue->memfds_inline)
+		kfree(queue->memfds);
 	queue->memfds = NULL;
 
 	queue->memfds_count = 0;
 }
 
-/* Validate the state of the incoming PAYLOAD_MEMFD, and grab a reference
- * to put it into the receiver's queue. */
+/* Validate the state of the incoming PAYLOAD_MEMFD, and open a file of
+ * it to put into the receiver's queue. As long as the queued file is
+ * open, the sender can not unseal the memfd anymore. */
 static int kdbus_conn_memfd_ref(const struct kdbus_item *item,
 				struct file **file)
 {
-	struct file *fp;
+	struct file *fp, *sfp;
 	int ret;
 
-	fp = fget(item->memfd.fd);
-	if (!fp)
+	sfp = fget(item->memfd.fd);
+	if (!sfp)
 		return -EBADF;
 
 	/* We only accept kdbus_memfd files as payload, other files need to
 	 * be passed with KDBUS_MSG_FDS. */
-	if (!kdbus_is_memfd(fp)) {
-		ret = -EMEDIUMTYPE;
-		goto exit_unref;
+	if (!kdbus_is_memfd(sfp)) {
+		fput(sfp);
+		return -EMEDIUMTYPE;
 	}
 
+	fp = kdbus_memfd_reopen(sfp);
+	fput(sfp);
+	if (IS_ERR(fp))
+		return PTR_ERR(fp);
+
 	/* We only accept a sealed memfd file whose content cannot be altered
 	 * by the sender or anybody else while it is shared or in-flight. */
 	if (!kdbus_is_memfd_sealed(fp)) {
@@ -173,15 +396,57 @@ exit_unref:
 	return ret;
 }
 
+/*
+ * Copy a large page-aligned vec from the pinned pages of the sender. The
+ * data is copied page by page without faulting in the sender's memory
+ * for every chunk; if not all pages can be pinned, the data is copied
+ * from user memory.
+ */
+static ssize_t kdbus_conn_vec_write_pinned(struct kdbus_pool *pool,
+					   size_t off, void __user *addr,
+					   size_t size)
+{
+	unsigned int n = DIV_ROUND_UP(size, PAGE_SIZE);
+	struct page **pages;
+	ssize_t ret;
+	int pinned;
+	int i;
+
+	pages = kmalloc(n * sizeof(struct page *), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	pinned = get_user_pages_fast((unsigned long)addr, n, 0, pages);
+	if (pinned < 0)
+		pinned = 0;
+
+	if (pinned == n)
+		ret = kdbus_pool_write_pages(pool, off, pages, size);
+	else
+		ret = kdbus_pool_write_user(pool, off, addr, size);
+
+	for (i = 0; i < pinned; i++)
+		put_page(pages[i]);
+
+	kfree(pages);
+	return ret;
+}
+
+/* build the PAYLOAD items in the message buffer, copy the vec data */
 static int kdbus_conn_payload_add(struct kdbus_conn *conn,
 				  struct kdbus_conn_queue *queue,
-				  const struct kdbus_kmsg *kmsg,
+				  const struct kdbus_kmsg *kmsg, u8 *buf,
 				  size_t off, size_t items, size_t vec_data)
 {
 	const struct kdbus_item *item;
+	unsigned int page = 0;
 	int ret;
 
-	if (kmsg->memfds_count > 0) {
+	if (kmsg->memfds_count > 0 &&
+	    kmsg->memfds_count <= KDBUS_CONN_QUEUE_INLINE_FDS) {
+		queue->memfds = queue->memfds_inline;
+		queue->memfds_fp = queue->memfds_fp_inline;
+	} else if (kmsg->memfds_count > 0) {
 		size_t size;
 
 		size = kmsg->memfds_count * sizeof(size_t);
@@ -200,8 +465,7 @@ static int kdbus_conn_payload_add(struct kdbus_conn *conn,
 		case KDBUS_MSG_PAYLOAD_VEC: {
 			const size_t size = KDBUS_PART_HEADER_SIZE +
 					    sizeof(struct kdbus_vec);
-			char tmp[size];
-			struct kdbus_item *it = (struct kdbus_item *)tmp;
+			struct kdbus_item *it = (struct kdbus_item *)(buf + items);
 
 			/* add item */
 			it->type = KDBUS_MSG_PAYLOAD_OFF;
@@ -213,9 +477,6 @@ static int kdbus_conn_payload_add(struct kdbus_conn *conn,
 			else
 				it->vec.offset = ~0ULL;
 			it->vec.size = item->vec.size;
-			ret = kdbus_pool_write(conn->pool, off + items, it, size);
-			if (ret < 0)
-				return ret;
 
 			items += KDBUS_ALIGN8((it)->size);
 
@@ -223,8 +484,23 @@ static int kdbus_conn_payload_add(struct kdbus_conn *conn,
 				break;
 
 			/* copy kdbus_vec data from sender to receiver */
-			ret = kdbus_pool_write_user(conn->pool, off + vec_data,
-				KDBUS_PTR(item->vec.address), item->vec.size);
+			if (kmsg->vec_pages) {
+				ret = kdbus_pool_write_pages(conn->pool,
+						off + vec_data,
+						kmsg->vec_pages + page,
+						item->vec.size);
+				page += DIV_ROUND_UP(item->vec.size, PAGE_SIZE);
+			} else if (item->vec.size >= KDBUS_MSG_PIN_VEC_SIZE &&
+				   PAGE_ALIGNED(item->vec.address))
+				ret = kdbus_conn_vec_write_pinned(conn->pool,
+						off + vec_data,
+						KDBUS_PTR(item->vec.address),
+						item->vec.size);
+			else
+				ret = kdbus_pool_write_user(conn->pool,
+						off + vec_data,
+						KDBUS_PTR(item->vec.address),
+						item->vec.size);
 			if (ret < 0)
 				return ret;
 
@@ -235,8 +511,7 @@ static int kdbus_conn_payload_add(struct kdbus_conn *conn,
 		case KDBUS_MSG_PAYLOAD_MEMFD: {
 			const size_t size = KDBUS_PART_HEADER_SIZE +
 					    sizeof(struct kdbus_memfd);
-			char tmp[size];
-			struct kdbus_item *it = (struct kdbus_item *)tmp;
+			struct kdbus_item *it = (struct kdbus_item *)(buf + items);
 			struct file *fp;
 			size_t memfd;
 
@@ -245,9 +520,6 @@ static int kdbus_conn_payload_add(struct kdbus_conn *conn,
 			it->size = size;
 			it->memfd.size = item->memfd.size;
 			it->memfd.fd = -1;
-			ret = kdbus_pool_write(conn->pool, off + items, it, size);
-			if (ret < 0)
-				return ret;
 
 			/* grab reference of incoming file */
 			ret = kdbus_conn_memfd_ref(item, &fp);
@@ -277,7 +549,201 @@ void kdbus_conn_queue_cleanup(struct kdbus_conn_queue *queue)
 {
 	kdbus_conn_memfds_unref(queue);
 	kdbus_conn_fds_unref(queue);
-	kfree(queue);
+	kmem_cache_free(kdbus_conn_queue_cache, queue);
+}
+
+/*
+ * Space was released in the pool, the caller holds pool_lock. Free pages
+ * are returned when the pool was not used for a while; the pending work
+ * holds a reference to the connection.
+ */
+static void kdbus_conn_pool_trim_schedule(struct kdbus_conn *conn)
+{
+	if (conn->type != KDBUS_CONN_EP_CONNECTED ||
+	    !kdbus_pool_trim_pending(conn->pool))
+		return;
+
+	if (queue_delayed_work(system_wq, &conn->pool_trim_work,
+			       conn->pool_trim_delay))
+		kdbus_conn_ref(conn);
+}
+
+static void kdbus_conn_pool_trim_work(struct work_struct *work)
+{
+	struct kdbus_conn *conn = container_of(to_delayed_work(work),
+					       struct kdbus_conn,
+					       pool_trim_work);
+	unsigned long remain = 0;
+
+	mutex_lock(&conn->pool_lock);
+	if (conn->type == KDBUS_CONN_EP_CONNECTED)
+		remain = kdbus_pool_trim(conn->pool, conn->pool_trim_delay);
+
+	/* the pool was used in the meantime, the reference stays with
+	 * the work queued again */
+	if (remain > 0 &&
+	    queue_delayed_work(system_wq, &conn->pool_trim_work, remain)) {
+		mutex_unlock(&conn->pool_lock);
+		return;
+	}
+	mutex_unlock(&conn->pool_lock);
+
+	kdbus_conn_unref(conn);
+}
+
+/* wake the senders waiting for room in the queue of the connection */
+static void kdbus_conn_wake_blocked(struct kdbus_conn *conn)
+{
+	struct kdbus_conn *c;
+
+	wake_up_interruptible(&conn->drain_wait);
+
+	/* poll() of a sender waits on its own queue, the receiver it is
+	 * blocked on might be gone before the poll table is freed */
+	spin_lock(&conn->blocked_lock);
+	list_for_each_entry(c, &conn->blocked_list, blocked_entry)
+		wake_up_interruptible(&c->wait);
+	spin_unlock(&conn->blocked_lock);
+}
+
+/*
+ * A sender which found the queue full is told about every message
+ * which leaves it again; the flag keeps the receive path from touching
+ * the wait queues of the senders as long as nobody ran into the limits.
+ *
+ * The flag is set by kdbus_conn_queue_insert() under pool_lock. The
+ * wakeup after a message was received is only a hint which might race
+ * with it; the one when the message is freed in the pool is done under
+ * pool_lock too, and can not be missed.
+ */
+static void kdbus_conn_drained(struct kdbus_conn *conn)
+{
+	if (!ACCESS_ONCE(conn->queue_full))
+		return;
+
+	conn->queue_full = false;
+	kdbus_conn_wake_blocked(conn);
+}
+
+static bool kdbus_conn_has_room(struct kdbus_conn *conn)
+{
+	return !ACCESS_ONCE(conn->queue_full) ||
+	       conn->type != KDBUS_CONN_EP_CONNECTED;
+}
+
+/*
+ * Queued messages with a timeout are sorted by their deadline; returns
+ * true if the message has the earliest deadline of the connection.
+ */
+static bool kdbus_conn_deadline_add(struct kdbus_conn *conn,
+				    struct kdbus_conn_queue *queue)
+{
+	struct rb_node **n = &conn->deadline_tree.rb_node;
+	struct rb_node *parent = NULL;
+	bool first = true;
+
+	while (*n) {
+		struct kdbus_conn_queue *q;
+
+		parent = *n;
+		q = rb_entry(parent, struct kdbus_conn_queue, deadline_node);
+		if (queue->deadline_ns < q->deadline_ns) {
+			n = &parent->rb_left;
+		} else {
+			n = &parent->rb_right;
+			first = false;
+		}
+	}
+
+	rb_link_node(&queue->deadline_node, parent, n);
+	rb_insert_color(&queue->deadline_node, &conn->deadline_tree);
+	return first;
+}
+
+/* sort a message into the receive order, behind or in front of the
+ * messages of the same priority */
+static void kdbus_conn_prio_add(struct kdbus_conn *conn,
+				struct kdbus_conn_queue *queue, bool front)
+{
+	struct rb_node **n = &conn->msg_prio_tree.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*n) {
+		struct kdbus_conn_queue *q;
+
+		parent = *n;
+		q = rb_entry(parent, struct kdbus_conn_queue, prio_node);
+		if (queue->priority < q->priority) {
+			n = &parent->rb_left;
+		} else if (queue->priority > q->priority) {
+			n = &parent->rb_right;
+		} else {
+			list_add_tail(&queue->prio_entry, &q->prio_entry);
+			if (front) {
+				rb_replace_node(&q->prio_node,
+						&queue->prio_node,
+						&conn->msg_prio_tree);
+				RB_CLEAR_NODE(&q->prio_node);
+			}
+			return;
+		}
+	}
+
+	rb_link_node(&queue->prio_node, parent, n);
+	rb_insert_color(&queue->prio_node, &conn->msg_prio_tree);
+}
+
+static void kdbus_conn_prio_del(struct kdbus_conn *conn,
+				struct kdbus_conn_queue *queue)
+{
+	if (!RB_EMPTY_NODE(&queue->prio_node)) {
+		/* the next message of the same priority moves up */
+		if (list_empty(&queue->prio_entry)) {
+			rb_erase(&queue->prio_node, &conn->msg_prio_tree);
+		} else {
+			struct kdbus_conn_queue *next;
+
+			next = list_first_entry(&queue->prio_entry,
+						struct kdbus_conn_queue,
+						prio_entry);
+			rb_replace_node(&queue->prio_node, &next->prio_node,
+					&conn->msg_prio_tree);
+		}
+		RB_CLEAR_NODE(&queue->prio_node);
+	}
+
+	list_del_init(&queue->prio_entry);
+}
+
+/* the next message to receive, optionally only up to a priority */
+static struct kdbus_conn_queue *
+kdbus_conn_queue_first(struct kdbus_conn *conn, bool use_prio, s64 priority)
+{
+	struct kdbus_conn_queue *queue;
+	struct rb_node *node;
+
+	node = rb_first(&conn->msg_prio_tree);
+	if (!node)
+		return NULL;
+
+	queue = rb_entry(node, struct kdbus_conn_queue, prio_node);
+	if (use_prio && queue->priority > priority)
+		return NULL;
+
+	return queue;
+}
+
+/* remove a message from the queue of the connection */
+static void kdbus_conn_queue_unlink(struct kdbus_conn *conn,
+				    struct kdbus_conn_queue *queue)
+{
+	list_del(&queue->entry);
+	kdbus_conn_prio_del(conn, queue);
+
+	if (!RB_EMPTY_NODE(&queue->deadline_node)) {
+		rb_erase(&queue->deadline_node, &conn->deadline_tree);
+		RB_CLEAR_NODE(&queue->deadline_node);
+	}
 }
 
 /* enqueue a message into the receiver's pool */
@@ -285,29 +751,33 @@ int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
 			    u64 deadline_ns)
 {
 	struct kdbus_conn_queue *queue;
+	struct kdbus_msg *msg = NULL;
 	u64 msg_size;
 	size_t size;
 	size_t payloads = 0;
 	size_t fds = 0;
 	size_t meta = 0;
+	size_t meta_size;
 	size_t vec_data;
 	size_t want, have;
 	size_t off;
+	bool owner, full;
 	int ret = 0;
 
-	if (!conn->type == KDBUS_CONN_EP_CONNECTED)
-		return -ENOTCONN;
-
 	if (kmsg->fds && !(conn->flags & KDBUS_HELLO_ACCEPT_FD))
 		return -ECOMM;
 
-	queue = kzalloc(sizeof(struct kdbus_conn_queue), GFP_KERNEL);
+	queue = kmem_cache_zalloc(kdbus_conn_queue_cache, GFP_KERNEL);
 	if (!queue)
 		return -ENOMEM;
 
 	INIT_LIST_HEAD(&queue->entry);
+	RB_CLEAR_NODE(&queue->deadline_node);
+	INIT_LIST_HEAD(&queue->prio_entry);
+	RB_CLEAR_NODE(&queue->prio_node);
 
 	/* copy message properties we need for the queue management */
+	queue->priority = kmsg->msg.priority;
 	queue->deadline_ns = deadline_ns;
 	queue->src_id = kmsg->msg.src_id;
 	queue->cookie = kmsg->msg.cookie;
@@ -338,19 +808,38 @@ int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
 		msg_size += KDBUS_ITEM_SIZE(kmsg->fds_count * sizeof(int));
 	}
 
-	/* space for metadata/credential items */
-	if (kmsg->meta_size > 0) {
+	/* space for metadata/credential items the receiver asked for */
+	meta_size = kdbus_kmsg_meta_size(kmsg, conn->flags);
+	if (meta_size > 0) {
 		meta = msg_size;
-		msg_size += kmsg->meta_size;
+		msg_size += meta_size;
 	}
 
 	/* data starts after the message */
 	vec_data = KDBUS_ALIGN8(msg_size);
 
 	/* allocate the needed space in the pool of the receiver */
-	mutex_lock(&conn->lock);
-	if (!capable(CAP_IPC_OWNER) &&
-	    conn->msg_count > KDBUS_CONN_MAX_MSGS) {
+	mutex_lock(&conn->pool_lock);
+
+	/* the receiver might be pinned while it disconnects */
+	if (conn->type != KDBUS_CONN_EP_CONNECTED) {
+		ret = -ENOTCONN;
+		goto exit_unlock;
+	}
+
+	/* the slot in the queue is reserved now, the message is linked in
+	 * only after it is copied; concurrent senders count it already */
+	owner = capable(CAP_IPC_OWNER);
+	spin_lock(&conn->queue_lock);
+	full = !owner &&
+	       conn->msg_count + conn->msg_reserved >= conn->max_msgs;
+	if (!full)
+		conn->msg_reserved++;
+	spin_unlock(&conn->queue_lock);
+
+	if (full) {
+		conn->queue_full = true;
+		atomic64_inc(&conn->stats.msgs_dropped);
 		ret = -ENOBUFS;
 		goto exit_unlock;
 	}
@@ -359,28 +848,35 @@ int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
 	want = vec_data + kmsg->vecs_size;
 	have = kdbus_pool_remain(conn->pool);
 	if (want < have && want > have / 2) {
+		conn->queue_full = true;
+		atomic64_inc(&conn->stats.msgs_dropped);
 		ret = -EXFULL;
-		goto exit_unlock;
+		goto exit_unreserve;
 	}
 
 	ret = kdbus_pool_alloc(conn->pool, want, &off);
 	if (ret < 0)
-		goto exit_unlock;
-	mutex_unlock(&conn->lock);
-
-	/* copy the message header */
-	ret = kdbus_pool_write(conn->pool, off, &kmsg->msg, size);
-	if (ret < 0)
+		goto exit_unreserve;
+	mutex_unlock(&conn->pool_lock);
+
+	/*
+	 * The header and all items are assembled in one buffer and written
+	 * to the pool at once; only the vec data is copied separately. The
+	 * buffer is zeroed, the padding is visible to the receiver.
+	 */
+	msg = kzalloc(msg_size, GFP_KERNEL);
+	if (!msg) {
+		ret = -ENOMEM;
 		goto exit;
+	}
 
-	/* update the size */
-	ret = kdbus_pool_write(conn->pool, off, &msg_size, sizeof(kmsg->msg.size));
-	if (ret < 0)
-		goto exit;
+	/* copy the message header and update the size */
+	memcpy(msg, &kmsg->msg, size);
+	msg->size = msg_size;
 
 	/* add PAYLOAD items */
 	if (kmsg->vecs_count + kmsg->memfds_count > 0) {
-		ret = kdbus_conn_payload_add(conn, queue, kmsg,
+		ret = kdbus_conn_payload_add(conn, queue, kmsg, (u8 *)msg,
 					     off, payloads, vec_data);
 		if (ret < 0)
 			goto exit;
@@ -388,15 +884,11 @@ int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
 
 	/* add a FDS item; the array content will be updated at RECV time */
 	if (kmsg->fds_count > 0) {
-		const size_t size = KDBUS_PART_HEADER_SIZE;
-		char tmp[size];
-		struct kdbus_item *it = (struct kdbus_item *)tmp;
+		struct kdbus_item *it = (struct kdbus_item *)((u8 *)msg + fds);
 
 		it->type = KDBUS_MSG_FDS;
-		it->size = size + (kmsg->fds_count * sizeof(int));
-		ret = kdbus_pool_write(conn->pool, off + fds, it, size);
-		if (ret < 0)
-			goto exit;
+		it->size = KDBUS_PART_HEADER_SIZE +
+			   (kmsg->fds_count * sizeof(int));
 
 		ret = kdbus_conn_fds_ref(queue, kmsg->fds, kmsg->fds_count);
 		if (ret < 0)
@@ -408,67 +900,105 @@ int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
 	}
 
 	/* append message metadata/credential items */
-	if (kmsg->meta_size > 0) {
-		ret = kdbus_pool_write(conn->pool, off + meta,
-				       kmsg->meta, kmsg->meta_size);
-		if (ret < 0)
-			goto exit;
-	}
+	if (meta_size > 0)
+		kdbus_kmsg_meta_write(kmsg, conn->flags, (u8 *)msg + meta);
+
+	ret = kdbus_pool_write(conn->pool, off, msg, msg_size);
+	if (ret < 0)
+		goto exit;
+
+	kfree(msg);
+	msg = NULL;
 
 	/* remember the offset to the message */
 	queue->off = off;
+	queue->size = want;
+	if (kdbus_trace_enabled(kdbus_msg_recv))
+		queue->queued_ns = kdbus_now_ns();
+
+	/* link the message into the receiver's queue; this is the only
+	 * step which serializes the senders against each other and
+	 * against the receiver */
+	spin_lock(&conn->queue_lock);
+	if (conn->type != KDBUS_CONN_EP_CONNECTED) {
+		spin_unlock(&conn->queue_lock);
+		ret = -ENOTCONN;
+		goto exit;
+	}
 
-	/* link the message into the receiver's queue */
-	mutex_lock(&conn->lock);
 	list_add_tail(&queue->entry, &conn->msg_list);
+	kdbus_conn_prio_add(conn, queue, false);
+	conn->msg_reserved--;
 	conn->msg_count++;
-	mutex_unlock(&conn->lock);
+	if (conn->msg_count > conn->stats.queue_depth_max)
+		conn->stats.queue_depth_max = conn->msg_count;
+
+	/* the timer only needs to move if this is the earliest deadline */
+	if (queue->deadline_ns && kdbus_conn_deadline_add(conn, queue))
+		kdbus_timer_arm(&conn->timer, queue->deadline_ns);
+	spin_unlock(&conn->queue_lock);
 
-	/* wake up poll() */
-	wake_up_interruptible(&conn->ep->wait);
+	trace_kdbus_queue_insert(conn->id, kmsg, ACCESS_ONCE(conn->msg_count),
+				 0);
+
+	/* wake up poll() of this connection only */
+	wake_up_interruptible(&conn->wait);
 	return 0;
 
-exit_unlock:
-	mutex_unlock(&conn->lock);
 exit:
-	kdbus_conn_queue_cleanup(queue);
+	kfree(msg);
+	mutex_lock(&conn->pool_lock);
 	kdbus_pool_free(conn->pool, off);
+exit_unreserve:
+	spin_lock(&conn->queue_lock);
+	conn->msg_reserved--;
+	spin_unlock(&conn->queue_lock);
+exit_unlock:
+	mutex_unlock(&conn->pool_lock);
+	kdbus_conn_queue_cleanup(queue);
+	trace_kdbus_queue_insert(conn->id, kmsg, ACCESS_ONCE(conn->msg_count),
+				 ret);
 	return ret;
 }
 
+/* only the expired messages are visited, starting with the earliest */
 static void kdbus_conn_scan_timeout(struct kdbus_conn *conn)
 {
 	struct kdbus_conn_queue *queue, *tmp;
-	u64 deadline = -1;
-	struct timespec ts;
-	u64 now;
+	struct rb_node *node;
+	LIST_HEAD(notify_list);
+	LIST_HEAD(expired);
+	u64 now = kdbus_now_ns();
+
+	spin_lock(&conn->queue_lock);
+	while ((node = rb_first(&conn->deadline_tree))) {
+		queue = rb_entry(node, struct kdbus_conn_queue, deadline_node);
+		if (queue->deadline_ns > now) {
+			kdbus_timer_arm(&conn->timer, queue->deadline_ns);
+			break;
+		}
 
-	ktime_get_ts(&ts);
-	now = timespec_to_ns(&ts);
+		kdbus_conn_queue_unlink(conn, queue);
+		conn->msg_count--;
+		list_add_tail(&queue->entry, &expired);
+	}
+	spin_unlock(&conn->queue_lock);
 
-	mutex_lock(&conn->lock);
-	list_for_each_entry_safe(queue, tmp, &conn->msg_list, entry) {
-		if (queue->deadline_ns == 0)
-			continue;
+	list_for_each_entry_safe(queue, tmp, &expired, entry) {
+		if (queue->expect_reply)
+			kdbus_notify_reply_timeout(queue->src_id,
+						   queue->cookie,
+						   &notify_list);
 
-		if (queue->deadline_ns <= now) {
-			if (queue->expect_reply)
-				kdbus_notify_reply_timeout(conn->ep,
-					queue->src_id, queue->cookie);
-			kdbus_pool_free(conn->pool, queue->off);
-			list_del(&queue->entry);
-			kdbus_conn_queue_cleanup(queue);
-		} else if (queue->deadline_ns < deadline) {
-			deadline = queue->deadline_ns;
-		}
+		mutex_lock(&conn->pool_lock);
+		kdbus_pool_free(conn->pool, queue->off);
+		kdbus_conn_pool_trim_schedule(conn);
+		kdbus_conn_drained(conn);
+		mutex_unlock(&conn->pool_lock);
+		kdbus_conn_queue_cleanup(queue);
 	}
-	mutex_unlock(&conn->lock);
 
-	if (deadline != -1) {
-		u64 usecs = deadline - now;
-		do_div(usecs, 1000ULL);
-		mod_timer(&conn->timer, jiffies + usecs_to_jiffies(usecs));
-	}
+	kdbus_notify_flush(conn->ep, &notify_list);
 }
 
 static void kdbus_conn_work(struct work_struct *work)
@@ -495,57 +1025,45 @@ static int kdbus_conn_get_conn_dst(struct kdbus_bus *bus,
 {
 	const struct kdbus_msg *msg = &kmsg->msg;
 	struct kdbus_conn *c;
-	int ret = 0;
-
-	mutex_lock(&bus->lock);
 
+	/* both lookups are lockless and return a pinned connection */
 	if (msg->dst_id == KDBUS_DST_ID_WELL_KNOWN_NAME) {
-		const struct kdbus_name_entry *name_entry;
-
-		name_entry = kdbus_name_lookup(bus->name_registry,
-					       kmsg->dst_name);
-		if (!name_entry) {
-			ret = -ESRCH;
-			goto exit_unlock;
-		}
+		c = kdbus_name_lookup_conn(bus->name_registry, kmsg->dst_name);
+		if (!c)
+			return -ESRCH;
 
-		c = name_entry->conn;
 		if ((msg->flags & KDBUS_MSG_FLAGS_NO_AUTO_START) &&
 		    (c->flags & KDBUS_HELLO_STARTER)) {
-			ret = -EADDRNOTAVAIL;
-			goto exit_unlock;
+			kdbus_conn_unref(c);
+			return -EADDRNOTAVAIL;
 		}
 	} else {
 		c = kdbus_bus_find_conn_by_id(bus, msg->dst_id);
-		if (!c) {
-			ret = -ENXIO;
-			goto exit_unlock;
-		}
+		if (!c)
+			return -ENXIO;
 	}
 
-	kdbus_conn_ref(c);
 	*conn = c;
-
-exit_unlock:
-	mutex_unlock(&bus->lock);
-	return ret;
+	return 0;
 }
 
-int kdbus_conn_kmsg_send(struct kdbus_ep *ep,
-			 struct kdbus_conn *conn_src,
-			 struct kdbus_kmsg *kmsg)
+/*
+ * Number the message and add the sender's names and credentials. The
+ * clock is only read for method calls and replies, which need it for
+ * their deadlines; the timestamp is added for the receivers asking for
+ * it with KDBUS_HELLO_ATTACH_TIMESTAMP.
+ */
+static int kdbus_conn_kmsg_augment(struct kdbus_bus *bus,
+				   struct kdbus_conn *conn_src,
+				   struct kdbus_kmsg *kmsg, u64 *now_ns)
 {
-	const struct kdbus_msg *msg = &kmsg->msg;
-	struct kdbus_conn *conn_dst = NULL;
-	struct kdbus_conn *conn;
-	u64 now_ns = 0;
-	u64 deadline_ns = 0;
 	int ret;
 
-	/* augment incoming message */
-	ret = kdbus_kmsg_append_timestamp(kmsg, &now_ns);
-	if (ret < 0)
-		return ret;
+	kmsg->msg.seqnum = atomic64_inc_return(&bus->msg_seq_last);
+
+	/* the timeout of a call, or the cookie_reply of a reply */
+	if (now_ns && kmsg->msg.timeout_ns)
+		*now_ns = kdbus_now_ns();
 
 	if (conn_src) {
 		ret = kdbus_kmsg_append_src_names(kmsg, conn_src);
@@ -557,78 +1075,544 @@ int kdbus_conn_kmsg_send(struct kdbus_ep *ep,
 			return ret;
 	}
 
-	/* broadcast message */
-	if (msg->dst_id == KDBUS_DST_ID_BROADCAST) {
-		unsigned int i;
-
-		mutex_lock(&ep->bus->lock);
-		hash_for_each(ep->bus->conn_hash, i, conn_dst, hentry) {
-			if (conn_dst->type != KDBUS_CONN_EP_CONNECTED)
-				continue;
+	return 0;
+}
 
-			if (conn_dst->id == msg->src_id)
-				continue;
+/*
+ * Broadcasts are delivered in two steps: the possible receivers are
+ * looked up in the match index of the bus and pinned while holding the
+ * bus lock, the matching and copying into the receivers' pools happens
+ * after the lock is released, so a large fan-out does not block the
+ * entire bus. Connections without a suitable match are never visited.
+ */
+static int kdbus_conn_kmsg_broadcast(struct kdbus_ep *ep,
+				     struct kdbus_conn *conn_src,
+				     struct kdbus_kmsg *kmsg)
+{
+	const struct kdbus_msg *msg = &kmsg->msg;
+	struct kdbus_bus *bus = ep->bus;
+	struct kdbus_conn **conns;
+	struct kdbus_conn *conn_dst;
+	unsigned int count;
+	unsigned int queued = 0;
+	unsigned int i, n, k;
 
-			if (!kdbus_match_db_match_kmsg(conn_dst->match_db,
-						       conn_src, conn_dst,
-						       kmsg))
-				continue;
+	mutex_lock(&bus->lock);
+	count = conn_src ? bus->match_count : bus->match_kernel_count;
+	if (count == 0) {
+		mutex_unlock(&bus->lock);
+		return 0;
+	}
+
+	conns = kmalloc_array(count, sizeof(*conns), GFP_KERNEL);
+	if (!conns) {
+		mutex_unlock(&bus->lock);
+		return -ENOMEM;
+	}
+
+	k = kdbus_match_bus_collect(bus, kmsg, !conn_src, conns);
+	for (i = 0, n = 0; i < k; i++) {
+		conn_dst = conns[i];
+
+		if (conn_dst->type != KDBUS_CONN_EP_CONNECTED)
+			continue;
+
+		if (conn_dst->id == msg->src_id)
+			continue;
+
+		conns[n++] = kdbus_conn_ref(conn_dst);
+	}
+	mutex_unlock(&bus->lock);
+
+	for (i = 0; i < n; i++) {
+		conn_dst = conns[i];
+
+		if (kdbus_match_db_match_kmsg(conn_dst->match_db,
+					      conn_src, conn_dst, kmsg)) {
+			/* Copy the payload from the sender only once if
+			 * there might be more than one receiver; without
+			 * the staged copy, every receiver reads it from
+			 * the sender's memory. */
+			if (i + 1 < n)
+				kdbus_kmsg_stage_vecs(kmsg);
 
 			/* The first receiver which requests additional
-			 * metadata causes the message to carry it; all
-			 * receivers after that will see all of the added
-			 * data, even when they did not ask for it. */
+			 * metadata causes the message to carry it; every
+			 * receiver gets only the items it asked for. */
 			kdbus_kmsg_append_meta(kmsg, conn_src, conn_dst);
 
-			kdbus_conn_queue_insert(conn_dst, kmsg, 0);
+			if (kdbus_conn_queue_insert(conn_dst, kmsg, 0) == 0)
+				queued++;
 		}
-		mutex_unlock(&ep->bus->lock);
 
-		return ret;
+		kdbus_conn_unref(conn_dst);
 	}
 
-	/* direct message */
-	ret = kdbus_conn_get_conn_dst(ep->bus, kmsg, &conn_dst);
-	if (ret < 0)
+	kfree(conns);
+
+	if (conn_src) {
+		atomic64_inc(&conn_src->stats.broadcasts_sent);
+		atomic64_add(queued, &conn_src->stats.broadcast_receivers);
+		atomic64_add(n, &conn_src->stats.match_evals);
+	}
+
+	return 0;
+}
+
+/* monitor connections get all messages; pin them and copy unlocked */
+static void kdbus_conn_kmsg_monitors(struct kdbus_ep *ep,
+				     struct kdbus_conn *conn_dst,
+				     struct kdbus_kmsg *kmsg)
+{
+	struct kdbus_bus *bus = ep->bus;
+	struct kdbus_conn **conns;
+	struct kdbus_conn *conn;
+	unsigned int count = 0;
+	unsigned int i, n = 0;
+
+	mutex_lock(&bus->lock);
+	list_for_each_entry(conn, &bus->monitors_list, monitor_entry)
+		count++;
+
+	if (count == 0) {
+		mutex_unlock(&bus->lock);
+		return;
+	}
+
+	conns = kmalloc_array(count, sizeof(*conns), GFP_KERNEL);
+	if (!conns) {
+		mutex_unlock(&bus->lock);
+		return;
+	}
+
+	list_for_each_entry(conn, &bus->monitors_list, monitor_entry) {
+		/* the monitor connection is addressed, deliver it below */
+		if (conn->id == conn_dst->id)
+			continue;
+
+		conns[n++] = kdbus_conn_ref(conn);
+	}
+	mutex_unlock(&bus->lock);
+
+	for (i = 0; i < n; i++) {
+		/* ignore errors of misbehaving monitor connections */
+		kdbus_conn_queue_insert(conns[i], kmsg, 0);
+		kdbus_conn_unref(conns[i]);
+	}
+
+	kfree(conns);
+}
+
+/*
+ * Remember the receiver a send failed on, poll() reports POLLOUT again
+ * as soon as it has room. The sender is on the list of the receiver for
+ * as long as it holds the reference.
+ */
+static void kdbus_conn_set_blocked(struct kdbus_conn *conn,
+				   struct kdbus_conn *conn_dst)
+{
+	struct kdbus_conn *old;
+
+	if (conn_dst)
+		kdbus_conn_ref(conn_dst);
+
+	spin_lock(&conn->queue_lock);
+	old = conn->blocked_dst;
+	if (old) {
+		spin_lock(&old->blocked_lock);
+		list_del_init(&conn->blocked_entry);
+		spin_unlock(&old->blocked_lock);
+	}
+
+	conn->blocked_dst = conn_dst;
+	if (conn_dst) {
+		spin_lock(&conn_dst->blocked_lock);
+		list_add_tail(&conn->blocked_entry, &conn_dst->blocked_list);
+		spin_unlock(&conn_dst->blocked_lock);
+	}
+	spin_unlock(&conn->queue_lock);
+
+	if (old)
+		kdbus_conn_unref(old);
+}
+
+/*
+ * The receiver had no room for the message; wait for it to drain its
+ * queue if the sender asked for it in HELLO, and try again.
+ */
+static int kdbus_conn_queue_insert_wait(struct kdbus_conn *conn_src,
+					struct kdbus_conn *conn_dst,
+					struct kdbus_kmsg *kmsg,
+					u64 deadline_ns, int ret)
+{
+	u64 usecs = conn_src->send_timeout_ns;
+	long timeout;
+
+	/* nobody would drain our own queue while we wait */
+	if (usecs == 0 || conn_src == conn_dst)
+		goto exit_blocked;
+
+	do_div(usecs, 1000ULL);
+	timeout = usecs_to_jiffies(min_t(u64, usecs, UINT_MAX));
+
+	do {
+		timeout = wait_event_interruptible_timeout(conn_dst->drain_wait,
+						kdbus_conn_has_room(conn_dst),
+						timeout);
+		if (timeout < 0)
+			return timeout;
+
+		ret = kdbus_conn_queue_insert(conn_dst, kmsg, deadline_ns);
+	} while ((ret == -ENOBUFS || ret == -EXFULL) && timeout > 0);
+
+	if (ret == 0)
+		return 0;
+
+	if (ret != -ENOBUFS && ret != -EXFULL)
 		return ret;
 
-	if (msg->timeout_ns)
+exit_blocked:
+	kdbus_conn_set_blocked(conn_src, conn_dst);
+	return ret;
+}
+
+/*
+ * Deliver a message to an already pinned destination connection; a reply
+ * to a tracked method call is already authorized.
+ */
+static int kdbus_conn_kmsg_unicast(struct kdbus_ep *ep,
+				   struct kdbus_conn *conn_src,
+				   struct kdbus_conn *conn_dst,
+				   struct kdbus_kmsg *kmsg, u64 now_ns,
+				   bool reply)
+{
+	const struct kdbus_msg *msg = &kmsg->msg;
+	bool expect_reply = msg->flags & KDBUS_MSG_FLAGS_EXPECT_REPLY;
+	u64 deadline_ns = 0;
+	int ret;
+
+	/* for all other messages, the field is the cookie_reply */
+	if (expect_reply)
 		deadline_ns = now_ns + msg->timeout_ns;
 
-	if (ep->policy_db && conn_src) {
+	if (ep->policy_db && conn_src && !reply) {
 		ret = kdbus_policy_db_check_send_access(ep->policy_db,
 							conn_src,
-							conn_dst,
-							deadline_ns);
+							conn_dst);
 		if (ret < 0)
-			goto exit;
+			return ret;
 	}
 
 	ret = kdbus_kmsg_append_meta(kmsg, conn_src, conn_dst);
 	if (ret < 0)
-		goto exit;
+		return ret;
 
-	/* monitor connections get all messages */
-	mutex_lock(&ep->bus->lock);
-	list_for_each_entry(conn, &ep->bus->monitors_list, monitor_entry) {
-		/* the monitor connection is addressed, deliver it below */
-		if (conn->id == conn_dst->id)
-			continue;
+	kdbus_conn_kmsg_monitors(ep, conn_dst, kmsg);
 
-		/* ignore errors of misbehaving monitor connections */
-		kdbus_conn_queue_insert(conn_dst, kmsg, 0);
+	if (!conn_src)
+		return kdbus_conn_queue_insert(conn_dst, kmsg, deadline_ns);
+
+	/* the receiver might reply before the insert returns */
+	if (expect_reply) {
+		ret = kdbus_conn_reply_add(conn_src, conn_dst, msg->cookie,
+					   deadline_ns, now_ns);
+		if (ret < 0)
+			return ret;
 	}
-	mutex_unlock(&ep->bus->lock);
 
 	ret = kdbus_conn_queue_insert(conn_dst, kmsg, deadline_ns);
+	if (ret == -ENOBUFS || ret == -EXFULL)
+		ret = kdbus_conn_queue_insert_wait(conn_src, conn_dst,
+						   kmsg, deadline_ns, ret);
+	else if (ret == 0 && ACCESS_ONCE(conn_src->blocked_dst) == conn_dst)
+		kdbus_conn_set_blocked(conn_src, NULL);
+
+	if (ret < 0 && expect_reply)
+		kdbus_conn_reply_drop(conn_src, conn_dst, msg->cookie);
+
+	return ret;
+}
+
+/* account a message the connection sent, and trace it */
+static void kdbus_conn_kmsg_sent(struct kdbus_conn *conn_src,
+				 const struct kdbus_kmsg *kmsg,
+				 int ret, u64 start_ns)
+{
+	trace_kdbus_msg_send(kmsg, ret, start_ns);
+
+	if (!conn_src || ret < 0)
+		return;
+
+	atomic64_inc(&conn_src->stats.msgs_sent);
+	atomic64_add(kmsg->msg.size + kmsg->vecs_size,
+		     &conn_src->stats.bytes_sent);
+}
+
+int kdbus_conn_kmsg_send(struct kdbus_ep *ep,
+			 struct kdbus_conn *conn_src,
+			 struct kdbus_kmsg *kmsg)
+{
+	struct kdbus_conn *conn_dst = NULL;
+	u64 start_ns = 0;
+	u64 now_ns = 0;
+	int ret;
+
+	if (kdbus_trace_enabled(kdbus_msg_send))
+		start_ns = kdbus_now_ns();
+
+	/* augment incoming message */
+	ret = kdbus_conn_kmsg_augment(ep->bus, conn_src, kmsg, &now_ns);
 	if (ret < 0)
 		goto exit;
 
-	if (msg->timeout_ns)
-		kdbus_conn_timeout_schedule_scan(conn_dst);
+	/* broadcast message */
+	if (kmsg->msg.dst_id == KDBUS_DST_ID_BROADCAST) {
+		ret = kdbus_conn_kmsg_broadcast(ep, conn_src, kmsg);
+		goto exit;
+	}
 
-exit:
+	/* a reply goes straight back to the caller */
+	if (conn_src) {
+		conn_dst = kdbus_conn_reply_take(conn_src, &kmsg->msg, now_ns);
+		if (conn_dst) {
+			ret = kdbus_conn_kmsg_unicast(ep, conn_src, conn_dst,
+						      kmsg, now_ns, true);
+			goto exit_unref;
+		}
+	}
+
+	/* direct message */
+	ret = kdbus_conn_get_conn_dst(ep->bus, kmsg, &conn_dst);
+	if (ret < 0)
+		goto exit;
+
+	ret = kdbus_conn_kmsg_unicast(ep, conn_src, conn_dst, kmsg, now_ns,
+				      false);
+
+exit_unref:
 	kdbus_conn_unref(conn_dst);
+exit:
+	kdbus_conn_kmsg_sent(conn_src, kmsg, ret, start_ns);
+	return ret;
+}
+
+/**
+ * kdbus_conn_kmsg_send_notify() - deliver a batch of kernel notifications
+ * @ep:		The endpoint to send on
+ * @kmsgs:	The notifications, linked by their notify_entry
+ *
+ * The notifications to a single connection are sent one by one. The
+ * receivers of the broadcasts are collected only once, and every
+ * receiver gets all the broadcasts of the batch it matches in one go;
+ * one operation like the disconnect of a connection owning many names
+ * does not cause a pass over the receivers for every notification.
+ */
+void kdbus_conn_kmsg_send_notify(struct kdbus_ep *ep, struct list_head *kmsgs)
+{
+	struct kdbus_bus *bus = ep->bus;
+	struct kdbus_kmsg *kmsg;
+	struct kdbus_conn **conns;
+	struct kdbus_conn *conn_dst;
+	unsigned int count;
+	unsigned int i, n, k;
+	bool broadcast = false;
+
+	list_for_each_entry(kmsg, kmsgs, notify_entry) {
+		if (kmsg->msg.dst_id != KDBUS_DST_ID_BROADCAST) {
+			kdbus_conn_kmsg_send(ep, NULL, kmsg);
+			continue;
+		}
+
+		/* without a sender, there is nothing to fail */
+		kdbus_conn_kmsg_augment(bus, NULL, kmsg, NULL);
+		broadcast = true;
+	}
+
+	if (!broadcast)
+		return;
+
+	mutex_lock(&bus->lock);
+	count = bus->match_kernel_count;
+	if (count == 0) {
+		mutex_unlock(&bus->lock);
+		return;
+	}
+
+	conns = kmalloc_array(count, sizeof(*conns), GFP_KERNEL);
+	if (!conns) {
+		mutex_unlock(&bus->lock);
+		return;
+	}
+
+	k = kdbus_match_bus_collect(bus, NULL, true, conns);
+	for (i = 0, n = 0; i < k; i++) {
+		conn_dst = conns[i];
+
+		if (conn_dst->type != KDBUS_CONN_EP_CONNECTED)
+			continue;
+
+		conns[n++] = kdbus_conn_ref(conn_dst);
+	}
+	mutex_unlock(&bus->lock);
+
+	for (i = 0; i < n; i++) {
+		conn_dst = conns[i];
+
+		list_for_each_entry(kmsg, kmsgs, notify_entry) {
+			if (kmsg->msg.dst_id != KDBUS_DST_ID_BROADCAST)
+				continue;
+
+			if (!kdbus_match_db_match_kmsg(conn_dst->match_db,
+						       NULL, conn_dst, kmsg))
+				continue;
+
+			kdbus_kmsg_append_meta(kmsg, NULL, conn_dst);
+			kdbus_conn_queue_insert(conn_dst, kmsg, 0);
+		}
+
+		kdbus_conn_unref(conn_dst);
+	}
+
+	kfree(conns);
+}
+
+/* is the destination of the message the one looked up before? */
+static bool kdbus_conn_kmsg_same_dst(const struct kdbus_kmsg *kmsg,
+				     const struct kdbus_kmsg *prev)
+{
+	if (kmsg->msg.dst_id != prev->msg.dst_id)
+		return false;
+
+	if (kmsg->msg.dst_id != KDBUS_DST_ID_WELL_KNOWN_NAME)
+		return true;
+
+	/* the starter check depends on the flag */
+	if ((kmsg->msg.flags ^ prev->msg.flags) & KDBUS_MSG_FLAGS_NO_AUTO_START)
+		return false;
+
+	return strcmp(kmsg->dst_name, prev->dst_name) == 0;
+}
+
+/*
+ * Send a vector of messages, the status of every message is stored in the
+ * caller-supplied array. The destination of a message is looked up only
+ * if it differs from the one of the previous message, and the metadata which
+ * was gathered for the previous message is copied over.
+ *
+ * The metadata describes the sending task, and all messages of the batch
+ * are sent by it within this one call. Only the task itself can change its
+ * credentials, which it can not do while it is inside the ioctl; the copy
+ * is as current as metadata which is gathered again.
+ */
+static int kdbus_conn_send_batch(struct kdbus_conn *conn,
+				 struct kdbus_cmd_send __user *buf)
+{
+	struct kdbus_kmsg *prev = NULL;
+	struct kdbus_conn *conn_dst = NULL;
+	size_t prev_meta_off = 0;
+	struct kdbus_cmd_send cmd;
+	__u64 __user *msgs;
+	__s32 __user *status;
+	unsigned int i;
+	int ret = 0;
+
+	if (copy_from_user(&cmd, buf, sizeof(cmd)))
+		return -EFAULT;
+
+	if (cmd.count == 0 || cmd.count > KDBUS_MSG_MAX_BATCH)
+		return -EINVAL;
+
+	msgs = KDBUS_PTR(cmd.msgs);
+	status = KDBUS_PTR(cmd.status);
+
+	for (i = 0; i < cmd.count; i++) {
+		struct kdbus_conn *reply_dst;
+		struct kdbus_kmsg *kmsg;
+		size_t meta_off;
+		u64 start_ns = 0;
+		u64 now_ns = 0;
+		u64 addr;
+		int r;
+
+		if (get_user(addr, msgs + i)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (kdbus_trace_enabled(kdbus_msg_send))
+			start_ns = kdbus_now_ns();
+
+		r = kdbus_kmsg_new_from_user(conn, KDBUS_PTR(addr), &kmsg);
+		if (r < 0)
+			goto exit_status;
+
+		r = kdbus_conn_kmsg_augment(conn->ep->bus, conn, kmsg,
+					    &now_ns);
+		if (r < 0)
+			goto exit_free;
+
+		meta_off = kmsg->meta_size;
+
+		if (kmsg->msg.dst_id == KDBUS_DST_ID_BROADCAST) {
+			r = kdbus_conn_kmsg_broadcast(conn->ep, conn, kmsg);
+			goto exit_free;
+		}
+
+		reply_dst = kdbus_conn_reply_take(conn, &kmsg->msg, now_ns);
+		if (reply_dst) {
+			r = kdbus_conn_kmsg_unicast(conn->ep, conn, reply_dst,
+						    kmsg, now_ns, true);
+			kdbus_conn_unref(reply_dst);
+			goto exit_free;
+		}
+
+		if (!conn_dst || !kdbus_conn_kmsg_same_dst(kmsg, prev)) {
+			if (conn_dst) {
+				kdbus_conn_unref(conn_dst);
+				conn_dst = NULL;
+			}
+
+			r = kdbus_conn_get_conn_dst(conn->ep->bus, kmsg,
+						    &conn_dst);
+			if (r < 0)
+				goto exit_free;
+		}
+
+		/* reuse the metadata of the previous message */
+		if (prev)
+			r = kdbus_kmsg_copy_meta(kmsg, prev, prev_meta_off,
+						 conn_dst);
+
+		if (r == 0)
+			r = kdbus_conn_kmsg_unicast(conn->ep, conn, conn_dst,
+						    kmsg, now_ns, false);
+		kdbus_conn_kmsg_sent(conn, kmsg, r, start_ns);
+
+		/* remember this message for the lookup of the next one */
+		if (prev)
+			kdbus_kmsg_free(prev);
+		prev = kmsg;
+		prev_meta_off = meta_off;
+		kmsg = NULL;
+
+exit_free:
+		if (kmsg) {
+			kdbus_conn_kmsg_sent(conn, kmsg, r, start_ns);
+			kdbus_kmsg_free(kmsg);
+		}
+
+exit_status:
+		if (put_user(r, status + i)) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+
+	if (conn_dst)
+		kdbus_conn_unref(conn_dst);
+	if (prev)
+		kdbus_kmsg_free(prev);
+
 	return ret;
 }
 
@@ -679,57 +1663,185 @@ remove_unused:
 	return ret;
 }
 
-static int kdbus_conn_memfds_install(struct kdbus_conn *conn,
-				     struct kdbus_conn_queue *queue,
-				     int **memfds)
+static int kdbus_conn_memfds_install(struct kdbus_conn *conn,
+				     struct kdbus_conn_queue *queue,
+				     int **memfds)
+{
+	struct file **files;
+	size_t size;
+	int *fds;
+	unsigned int i;
+	int ret = 0;
+
+	size = queue->memfds_count * sizeof(int);
+	fds = kmalloc(size, GFP_KERNEL);
+	if (!fds)
+		return -ENOMEM;
+
+	files = kcalloc(queue->memfds_count, sizeof(struct file *),
+			GFP_KERNEL);
+	if (!files) {
+		kfree(fds);
+		return -ENOMEM;
+	}
+
+	/* allocate new file descriptors in the receiver's process */
+	for (i = 0; i < queue->memfds_count; i++) {
+		fds[i] = get_unused_fd();
+		if (fds[i] < 0) {
+			ret = fds[i];
+			goto remove_unused;
+		}
+	}
+
+	/* the receiver gets its own open files, with its own positions */
+	for (i = 0; i < queue->memfds_count; i++) {
+		files[i] = kdbus_memfd_reopen(queue->memfds_fp[i]);
+		if (IS_ERR(files[i])) {
+			ret = PTR_ERR(files[i]);
+			files[i] = NULL;
+			goto remove_unused;
+		}
+	}
+
+	/* Update the file descriptor number in the items. We remembered
+	 * the locations of the values in the buffer. */
+	for (i = 0; i < queue->memfds_count; i++) {
+		ret = kdbus_pool_write(conn->pool,
+				       queue->off + queue->memfds[i],
+				       &fds[i], sizeof(int));
+		if (ret < 0)
+			goto remove_unused;
+	}
+
+	/* install files in the receiver's process */
+	for (i = 0; i < queue->memfds_count; i++)
+		fd_install(fds[i], files[i]);
+
+	kfree(files);
+	*memfds = fds;
+	return 0;
+
+remove_unused:
+	for (i = 0; i < queue->memfds_count; i++) {
+		if (files[i])
+			fput(files[i]);
+	}
+
+	for (i = 0; i < queue->memfds_count; i++) {
+		if (fds[i] < 0)
+			break;
+
+		put_unused_fd(fds[i]);
+	}
+
+	kfree(files);
+	kfree(fds);
+	*memfds = NULL;
+	return ret;
+}
+
+/* install the file descriptors of a message which was taken off the
+ * queue with kdbus_conn_queue_pop() */
+static int kdbus_conn_queue_receive(struct kdbus_conn *conn,
+				    struct kdbus_conn_queue *queue)
+{
+	int *memfds = NULL;
+	unsigned int i;
+	int ret;
+
+	/* Install KDBUS_MSG_PAYLOAD_MEMFDs file descriptors, we return
+	 * the list of file descriptors to be able to cleanup on error. */
+	if (queue->memfds_count > 0) {
+		ret = kdbus_conn_memfds_install(conn, queue, &memfds);
+		if (ret < 0)
+			return ret;
+	}
+
+	/* install KDBUS_MSG_FDS file descriptors */
+	if (queue->fds_count > 0) {
+		ret = kdbus_conn_fds_install(conn, queue);
+		if (ret < 0)
+			goto exit_rewind;
+	}
+
+	kfree(memfds);
+	return 0;
+
+exit_rewind:
+	for (i = 0; i < queue->memfds_count; i++)
+		sys_close(memfds[i]);
+	kfree(memfds);
+	return ret;
+}
+
+/* account a message which was received, and trace it */
+static void kdbus_conn_queue_received(struct kdbus_conn *conn,
+				      const struct kdbus_conn_queue *queue)
+{
+	atomic64_inc(&conn->stats.msgs_received);
+	atomic64_add(queue->size, &conn->stats.bytes_received);
+
+	trace_kdbus_msg_recv(conn->id, queue->src_id, queue->cookie,
+			     queue->size, ACCESS_ONCE(conn->msg_count),
+			     queue->queued_ns);
+}
+
+/*
+ * Take the message with the lowest priority value off the queue, the
+ * oldest one if there are several. The receivers are serialized by
+ * conn->lock, a message which can not be received is put back in front
+ * of the queue with kdbus_conn_queue_push_front().
+ */
+static struct kdbus_conn_queue *
+kdbus_conn_queue_pop(struct kdbus_conn *conn, bool use_prio, s64 priority)
 {
-	size_t size;
-	int *fds;
-	unsigned int i;
-	int ret = 0;
-
-	size = queue->memfds_count * sizeof(int);
-	fds = kmalloc(size, GFP_KERNEL);
-	if (!fds)
-		return -ENOMEM;
+	struct kdbus_conn_queue *queue;
 
-	/* allocate new file descriptors in the receiver's process */
-	for (i = 0; i < queue->memfds_count; i++) {
-		fds[i] = get_unused_fd();
-		if (fds[i] < 0) {
-			ret = fds[i];
-			goto remove_unused;
-		}
+	spin_lock(&conn->queue_lock);
+	queue = kdbus_conn_queue_first(conn, use_prio, priority);
+	if (queue) {
+		kdbus_conn_queue_unlink(conn, queue);
+		conn->msg_count--;
 	}
+	spin_unlock(&conn->queue_lock);
 
-	/* Update the file descriptor number in the items. We remembered
-	 * the locations of the values in the buffer. */
-	for (i = 0; i < queue->memfds_count; i++) {
-		ret = kdbus_pool_write(conn->pool,
-				       queue->off + queue->memfds[i],
-				       &fds[i], sizeof(int));
-		if (ret < 0)
-			goto remove_unused;
-	}
+	return queue;
+}
 
-	/* install files in the receiver's process */
-	for (i = 0; i < queue->memfds_count; i++)
-		fd_install(fds[i], get_file(queue->memfds_fp[i]));
+static bool kdbus_conn_queue_ready(struct kdbus_conn *conn,
+				   bool use_prio, s64 priority)
+{
+	bool ready;
 
-	*memfds = fds;
-	return 0;
+	spin_lock(&conn->queue_lock);
+	ready = kdbus_conn_queue_first(conn, use_prio, priority) != NULL;
+	spin_unlock(&conn->queue_lock);
 
-remove_unused:
-	for (i = 0; i < queue->memfds_count; i++) {
-		if (fds[i] < 0)
-			break;
+	return ready;
+}
 
-		put_unused_fd(fds[i]);
+static void kdbus_conn_queue_push_front(struct kdbus_conn *conn,
+					struct kdbus_conn_queue *queue)
+{
+	spin_lock(&conn->queue_lock);
+	if (conn->type == KDBUS_CONN_EP_CONNECTED) {
+		list_add(&queue->entry, &conn->msg_list);
+		kdbus_conn_prio_add(conn, queue, true);
+		conn->msg_count++;
+		if (queue->deadline_ns && kdbus_conn_deadline_add(conn, queue))
+			kdbus_timer_arm(&conn->timer, queue->deadline_ns);
+		spin_unlock(&conn->queue_lock);
+		return;
 	}
+	spin_unlock(&conn->queue_lock);
 
-	kfree(fds);
-	*memfds = NULL;
-	return ret;
+	/* the connection was disconnected in the meantime, the callers
+	 * were already told by kdbus_conn_reply_cleanup() */
+	mutex_lock(&conn->pool_lock);
+	kdbus_pool_free(conn->pool, queue->off);
+	mutex_unlock(&conn->pool_lock);
+	kdbus_conn_queue_cleanup(queue);
 }
 
 static int
@@ -737,56 +1849,205 @@ kdbus_conn_recv_msg(struct kdbus_conn *conn, __u64 __user *buf)
 {
 	struct kdbus_conn_queue *queue;
 	u64 off;
-	int *memfds = NULL;
-	unsigned int i;
 	int ret;
 
 	mutex_lock(&conn->lock);
-	if (conn->msg_count == 0) {
+	queue = kdbus_conn_queue_pop(conn, false, 0);
+	if (!queue) {
 		ret = -EAGAIN;
 		goto exit_unlock;
 	}
 
 	/* return the address of the next message in the pool */
-	queue = list_first_entry(&conn->msg_list,
-				 struct kdbus_conn_queue, entry);
 	off = queue->off;
 	if (copy_to_user(buf, &off, sizeof(__u64))) {
 		ret = -EFAULT;
-		goto exit_unlock;
+		goto exit_push;
 	}
 
-	/* Install KDBUS_MSG_PAYLOAD_MEMFDs file descriptors, we return
-	 * the list of file descriptors to be able to cleanup on error. */
-	if (queue->memfds_count > 0) {
-		ret = kdbus_conn_memfds_install(conn, queue, &memfds);
-		if (ret < 0)
-			goto exit_unlock;
+	ret = kdbus_conn_queue_receive(conn, queue);
+	if (ret < 0)
+		goto exit_push;
+
+	kdbus_conn_queue_received(conn, queue);
+	mutex_unlock(&conn->lock);
+
+	kdbus_conn_queue_cleanup(queue);
+	kdbus_conn_drained(conn);
+	return 0;
+
+exit_push:
+	kdbus_conn_queue_push_front(conn, queue);
+exit_unlock:
+	mutex_unlock(&conn->lock);
+	return ret;
+}
+
+/* sleep until a message which can be received is queued, the endpoint
+ * goes away or the timeout expires; like poll(), the receiver waits on
+ * its own queue and on the one kdbus_ep_disconnect() wakes up */
+static int kdbus_conn_wait_msg(struct kdbus_conn *conn, u64 timeout_ns,
+			       bool use_prio, s64 priority)
+{
+	long timeout = MAX_SCHEDULE_TIMEOUT;
+	DEFINE_WAIT(wait);
+	DEFINE_WAIT(ep_wait);
+	int ret = 0;
+
+	if (timeout_ns > 0) {
+		u64 usecs = timeout_ns;
+
+		do_div(usecs, 1000ULL);
+		timeout = usecs_to_jiffies(min_t(u64, usecs, UINT_MAX));
 	}
 
-	/* install KDBUS_MSG_FDS file descriptors */
-	if (queue->fds_count > 0) {
-		ret = kdbus_conn_fds_install(conn, queue);
+	for (;;) {
+		prepare_to_wait(&conn->wait, &wait, TASK_INTERRUPTIBLE);
+		prepare_to_wait(&conn->ep->wait, &ep_wait, TASK_INTERRUPTIBLE);
+
+		if (conn->ep->disconnected) {
+			ret = -ESHUTDOWN;
+			break;
+		}
+
+		if (kdbus_conn_queue_ready(conn, use_prio, priority))
+			break;
+
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		if (timeout == 0) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+
+		timeout = schedule_timeout(timeout);
+	}
+
+	finish_wait(&conn->ep->wait, &ep_wait);
+	finish_wait(&conn->wait, &wait);
+	return ret;
+}
+
+static int kdbus_conn_recv_batch(struct kdbus_conn *conn,
+				 struct kdbus_cmd_recv __user *buf)
+{
+	struct kdbus_conn_queue *queue, *tmp;
+	struct kdbus_cmd_recv cmd;
+	__u64 __user *offsets;
+	LIST_HEAD(received);
+	u64 count = 0;
+	bool use_prio;
+	int ret = 0;
+
+	if (copy_from_user(&cmd, buf, sizeof(cmd)))
+		return -EFAULT;
+
+	if (cmd.flags & ~(KDBUS_RECV_BLOCK | KDBUS_RECV_USE_PRIORITY))
+		return -EINVAL;
+
+	use_prio = cmd.flags & KDBUS_RECV_USE_PRIORITY;
+
+	if (cmd.count == 0 || cmd.count > KDBUS_MSG_MAX_BATCH)
+		return -EINVAL;
+
+	offsets = KDBUS_PTR(cmd.offsets);
+	if (!KDBUS_IS_ALIGNED8((uintptr_t)offsets))
+		return -EFAULT;
+
+	if (cmd.flags & KDBUS_RECV_BLOCK) {
+		ret = kdbus_conn_wait_msg(conn, cmd.timeout_ns,
+					  use_prio, cmd.priority);
 		if (ret < 0)
-			goto exit_rewind;
+			return ret;
 	}
 
-	kfree(memfds);
+	/* the count is written back last, when the messages are already
+	 * gone from the queue; make sure it can be written at all */
+	if (put_user(cmd.count, &buf->count))
+		return -EFAULT;
 
-	conn->msg_count--;
-	list_del(&queue->entry);
+	mutex_lock(&conn->lock);
+	while (count < cmd.count) {
+		queue = kdbus_conn_queue_pop(conn, use_prio, cmd.priority);
+		if (!queue)
+			break;
+
+		if (put_user(queue->off, offsets + count)) {
+			kdbus_conn_queue_push_front(conn, queue);
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = kdbus_conn_queue_receive(conn, queue);
+		if (ret < 0) {
+			kdbus_conn_queue_push_front(conn, queue);
+			break;
+		}
+
+		kdbus_conn_queue_received(conn, queue);
+		list_add_tail(&queue->entry, &received);
+		count++;
+	}
 	mutex_unlock(&conn->lock);
 
-	kdbus_conn_queue_cleanup(queue);
+	list_for_each_entry_safe(queue, tmp, &received, entry)
+		kdbus_conn_queue_cleanup(queue);
+
+	if (count > 0)
+		kdbus_conn_drained(conn);
+
+	/* The message which failed stays queued; report it only
+	 * if nothing could be received. */
+	if (count == 0)
+		return ret < 0 ? ret : -EAGAIN;
+
+	if (put_user(count, &buf->count))
+		return -EFAULT;
+
 	return 0;
+}
 
-exit_rewind:
-	for (i = 0; i < queue->memfds_count; i++)
-		sys_close(memfds[i]);
-	kfree(memfds);
+static int kdbus_conn_release_batch(struct kdbus_conn *conn,
+				    struct kdbus_cmd_release __user *buf)
+{
+	struct kdbus_cmd_release *cmd;
+	unsigned int count, freed;
+	u64 size;
+	u64 released;
+	int ret;
 
-exit_unlock:
-	mutex_unlock(&conn->lock);
+	if (kdbus_size_get_user(&size, buf, struct kdbus_cmd_release))
+		return -EFAULT;
+
+	if (size < sizeof(struct kdbus_cmd_release) ||
+	    size > sizeof(struct kdbus_cmd_release) +
+		   KDBUS_MSG_MAX_BATCH * sizeof(__u64) ||
+	    !KDBUS_IS_ALIGNED8(size))
+		return -EMSGSIZE;
+
+	cmd = memdup_user(buf, size);
+	if (IS_ERR(cmd))
+		return PTR_ERR(cmd);
+
+	count = (size - sizeof(struct kdbus_cmd_release)) / sizeof(__u64);
+
+	/* free the memory used in the receiver's pool */
+	mutex_lock(&conn->pool_lock);
+	ret = kdbus_pool_free_batch(conn->pool, cmd->offsets, count, &freed);
+	if (freed > 0) {
+		kdbus_conn_pool_trim_schedule(conn);
+		kdbus_conn_drained(conn);
+	}
+	mutex_unlock(&conn->pool_lock);
+
+	released = freed;
+	if (copy_to_user(&buf->released, &released, sizeof(__u64)))
+		ret = -EFAULT;
+
+	kfree(cmd);
 	return ret;
 }
 
@@ -860,6 +2121,7 @@ static int kdbus_conn_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	kref_init(&conn->kref);
+	kdbus_meta_cache_init(&conn->meta_cache);
 
 	/* find and reference namespace */
 	ns = kdbus_ns_find_by_major(MAJOR(inode->i_rdev));
@@ -898,7 +2160,10 @@ exit_unlock:
 	return ret;
 }
 
-static void kdbus_conn_cleanup(struct kdbus_conn *conn)
+/* the notifications about the disconnect are sent with the ones in
+ * notify_list */
+static void kdbus_conn_cleanup(struct kdbus_conn *conn,
+			       struct list_head *notify_list)
 {
 	struct kdbus_conn_queue *queue, *tmp;
 	struct list_head list;
@@ -907,56 +2172,67 @@ static void kdbus_conn_cleanup(struct kdbus_conn *conn)
 
 	/* remove from bus */
 	mutex_lock(&conn->ep->bus->lock);
-	hash_del(&conn->hentry);
+	kdbus_hash_del(&conn->ep->bus->conn_hash, &conn->hentry);
+	kdbus_conn_stats_add(conn, &conn->ep->bus->stats_gone);
 	list_del(&conn->monitor_entry);
+	kdbus_match_db_bus_unlink(conn->ep->bus, conn->match_db);
 	conn->type = KDBUS_CONN_EP_DISCONNECTED;
 	mutex_unlock(&conn->ep->bus->lock);
 
-	/* clean up any messages still left on this endpoint */
-	mutex_lock(&conn->lock);
-	list_for_each_entry_safe(queue, tmp, &conn->msg_list, entry) {
-		list_del(&queue->entry);
-
-		/* we cannot hold "lock" and enqueue new messages with
-		 * kdbus_notify_reply_dead(); move these messages
-		 * into a temporary list and handle them below */
-		if (queue->src_id != conn->id && queue->expect_reply) {
-			list_add_tail(&queue->entry, &list);
-		} else {
-			kdbus_pool_free(conn->pool, queue->off);
-			kdbus_conn_queue_cleanup(queue);
-		}
-	}
-	mutex_unlock(&conn->lock);
+	/* clean up any messages still left on this endpoint; new
+	 * messages can not be queued anymore */
+	spin_lock(&conn->queue_lock);
+	list_splice_init(&conn->msg_list, &list);
+	conn->msg_prio_tree = RB_ROOT;
+	conn->deadline_tree = RB_ROOT;
+	conn->msg_count = 0;
+	spin_unlock(&conn->queue_lock);
 
 	list_for_each_entry_safe(queue, tmp, &list, entry) {
-		kdbus_notify_reply_dead(conn->ep, queue->src_id,
-					queue->cookie);
-		mutex_lock(&conn->lock);
+		mutex_lock(&conn->pool_lock);
 		kdbus_pool_free(conn->pool, queue->off);
-		mutex_unlock(&conn->lock);
+		mutex_unlock(&conn->pool_lock);
 		kdbus_conn_queue_cleanup(queue);
 	}
 
+	/* including the calls in the queue we just dropped */
+	kdbus_conn_reply_cleanup(conn, notify_list);
+
+	/* senders waiting for room get -ENOTCONN now */
+	kdbus_conn_wake_blocked(conn);
+	kdbus_conn_set_blocked(conn, NULL);
+
 	del_timer(&conn->timer);
 	cancel_work_sync(&conn->work);
+	if (cancel_delayed_work_sync(&conn->pool_trim_work))
+		kdbus_conn_unref(conn);
 #ifdef CONFIG_SECURITY
 	security_release_secctx(conn->sec_label, conn->sec_label_len);
 #endif
-	kdbus_name_remove_by_conn(conn->ep->bus->name_registry, conn);
-	if (conn->ep->policy_db)
-		kdbus_policy_db_remove_conn(conn->ep->policy_db, conn);
-	kdbus_match_db_unref(conn->match_db);
+	kdbus_name_remove_by_conn(conn->ep->bus->name_registry, conn,
+				  notify_list);
+	kdbus_notify_flush(conn->ep, notify_list);
+	kdbus_memfd_cache_disconnect(conn->memfd_cache);
 	kdbus_ep_unref(conn->ep);
-
-	kdbus_pool_cleanup(conn->pool);
 }
 
 static void __kdbus_conn_free(struct kref *kref)
 {
 	struct kdbus_conn *conn = container_of(kref, struct kdbus_conn, kref);
 
-	kfree(conn);
+	/* senders might still have pinned the connection after it was
+	 * disconnected, the pool and the match db live until then */
+	if (conn->match_db)
+		kdbus_match_db_unref(conn->match_db);
+	kdbus_pool_cleanup(conn->pool);
+	kdbus_meta_cache_free(&conn->meta_cache);
+	kdbus_hash_cleanup(&conn->reply_hash);
+	if (conn->memfd_cache)
+		kdbus_memfd_cache_unref(conn->memfd_cache);
+	kdbus_conn_set_blocked(conn, NULL);
+
+	/* lockless lookups might still look at the connection */
+	kfree_rcu(conn, rcu);
 }
 
 struct kdbus_conn *kdbus_conn_ref(struct kdbus_conn *conn)
@@ -988,11 +2264,14 @@ static int kdbus_conn_release(struct inode *inode, struct file *file)
 		//FIXME:
 		break;
 
-	case KDBUS_CONN_EP_CONNECTED:
-		kdbus_notify_id_change(conn->ep, KDBUS_MSG_ID_REMOVE,
-				       conn->id, conn->flags);
-		kdbus_conn_cleanup(conn);
+	case KDBUS_CONN_EP_CONNECTED: {
+		LIST_HEAD(notify_list);
+
+		kdbus_notify_id_change(KDBUS_MSG_ID_REMOVE, conn->id,
+				       conn->flags, &notify_list);
+		kdbus_conn_cleanup(conn, &notify_list);
 		break;
+	}
 
 	default:
 		break;
@@ -1003,6 +2282,128 @@ static int kdbus_conn_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/**
+ * kdbus_conn_stats_add() - add up the counters of a connection
+ * @conn:	The connection
+ * @s:		The counters to add to
+ *
+ * The high-water marks are the maximum of all connections added, the
+ * current queue depth and the pool usage are left alone.
+ */
+void kdbus_conn_stats_add(struct kdbus_conn *conn,
+			  struct kdbus_cmd_conn_stats *s)
+{
+	struct kdbus_conn_stats *st = &conn->stats;
+
+	s->msgs_sent += atomic64_read(&st->msgs_sent);
+	s->bytes_sent += atomic64_read(&st->bytes_sent);
+	s->msgs_received += atomic64_read(&st->msgs_received);
+	s->bytes_received += atomic64_read(&st->bytes_received);
+	s->msgs_dropped += atomic64_read(&st->msgs_dropped);
+	s->broadcasts_sent += atomic64_read(&st->broadcasts_sent);
+	s->broadcast_receivers += atomic64_read(&st->broadcast_receivers);
+	s->match_evals += atomic64_read(&st->match_evals);
+	s->queue_depth_max = max_t(u64, s->queue_depth_max,
+				   ACCESS_ONCE(st->queue_depth_max));
+}
+
+/* privileged users can look at the counters of someone else */
+static int kdbus_conn_stats_query(struct kdbus_conn *conn,
+				  struct kdbus_cmd_conn_stats __user *buf)
+{
+	struct kdbus_bus *bus = conn->ep->bus;
+	struct kdbus_cmd_conn_stats cmd;
+	struct kdbus_pool_stats ps;
+	struct kdbus_conn *sconn;
+	u64 id;
+
+	if (!KDBUS_IS_ALIGNED8((uintptr_t)buf))
+		return -EFAULT;
+
+	if (get_user(id, &buf->id))
+		return -EFAULT;
+
+	if (id == 0 || id == conn->id) {
+		sconn = kdbus_conn_ref(conn);
+	} else {
+		if (!kdbus_bus_uid_is_privileged(bus))
+			return -EPERM;
+
+		sconn = kdbus_bus_find_conn_by_id(bus, id);
+		if (!sconn)
+			return -ENXIO;
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.id = sconn->id;
+	kdbus_conn_stats_add(sconn, &cmd);
+	cmd.queue_depth = ACCESS_ONCE(sconn->msg_count);
+
+	mutex_lock(&sconn->pool_lock);
+	kdbus_pool_stats(sconn->pool, &ps);
+	mutex_unlock(&sconn->pool_lock);
+
+	cmd.pool_size = ps.size;
+	cmd.pool_used = ps.used;
+	cmd.pool_used_max = ps.used_max;
+	cmd.pool_fragmentation = ps.fragmentation;
+	cmd.pool_resident = ps.resident;
+
+	kdbus_conn_unref(sconn);
+
+	if (copy_to_user(buf, &cmd, sizeof(cmd)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* released memfds of a connection are recycled, the control file has
+ * no cache */
+static int kdbus_conn_memfd_new(struct kdbus_memfd_cache *cache,
+				void __user *buf)
+{
+	int __user *addr = buf;
+	int fd;
+	int ret;
+
+	ret = kdbus_memfd_new(cache, 0, 0, &fd);
+	if (ret < 0)
+		return ret;
+
+	if (put_user(fd, addr))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* KDBUS_CMD_MEMFD_NEW with an initial size and flags */
+static int kdbus_conn_memfd_make(struct kdbus_memfd_cache *cache,
+				 void __user *buf)
+{
+	struct kdbus_cmd_memfd_make __user *m = buf;
+	struct kdbus_cmd_memfd_make cmd;
+	int fd;
+	int ret;
+
+	if (!KDBUS_IS_ALIGNED8((uintptr_t)buf))
+		return -EFAULT;
+
+	if (copy_from_user(&cmd, buf, sizeof(cmd)))
+		return -EFAULT;
+
+	if (cmd.flags & ~KDBUS_MEMFD_PREFAULT)
+		return -EINVAL;
+
+	ret = kdbus_memfd_new(cache, cmd.size, cmd.flags, &fd);
+	if (ret < 0)
+		return ret;
+
+	if (put_user(fd, &m->fd))
+		return -EFAULT;
+
+	return 0;
+}
+
 static bool kdbus_check_flags(u64 kernel_flags)
 {
 	/* The higher 32bit are considered 'incompatible
@@ -1085,18 +2486,13 @@ static long kdbus_conn_ioctl_control(struct file *file, unsigned int cmd,
 		conn->ns_owner = ns;
 		break;
 
-	case KDBUS_CMD_MEMFD_NEW: {
-		int fd;
-		int __user *addr = buf;
-
-		ret = kdbus_memfd_new(&fd);
-		if (ret < 0)
-			break;
+	case KDBUS_CMD_MEMFD_NEW:
+		ret = kdbus_conn_memfd_new(NULL, buf);
+		break;
 
-		if (put_user(fd, addr))
-			ret = -EFAULT;
+	case KDBUS_CMD_MEMFD_MAKE:
+		ret = kdbus_conn_memfd_make(NULL, buf);
 		break;
-	}
 
 	default:
 		ret = -ENOTTY;
@@ -1154,6 +2550,7 @@ static long kdbus_conn_ioctl_ep(struct file *file, unsigned int cmd,
 
 	case KDBUS_CMD_HELLO: {
 		/* turn this fd into a connection. */
+		LIST_HEAD(notify_list);
 		size_t size;
 		void *v;
 
@@ -1191,19 +2588,63 @@ static long kdbus_conn_ioctl_ep(struct file *file, unsigned int cmd,
 			break;
 		}
 
-		ret = kdbus_pool_init(&conn->pool, hello->pool_size);
+		ret = kdbus_pool_init(&conn->pool, hello->pool_size,
+				      hello->conn_flags & KDBUS_HELLO_POOL_RING);
+		if (ret < 0)
+			break;
+
+		conn->match_db = kdbus_match_db_new(conn);
+		if (!conn->match_db) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		ret = kdbus_hash_init(&conn->reply_hash, KDBUS_HASH_MIN_BITS);
 		if (ret < 0)
 			break;
 
+		conn->memfd_cache = kdbus_memfd_cache_new();
+		if (!conn->memfd_cache) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (hello->max_msgs == 0)
+			conn->max_msgs = KDBUS_CONN_MAX_MSGS;
+		else
+			conn->max_msgs = min_t(u64, hello->max_msgs,
+					       KDBUS_CONN_MAX_MSGS_LIMIT);
+		conn->send_timeout_ns = hello->send_timeout_ns;
+
+		if (hello->pool_trim_ns == 0)
+			hello->pool_trim_ns = KDBUS_CONN_POOL_TRIM_NS;
+		conn->pool_trim_delay =
+			usecs_to_jiffies(min_t(u64,
+					       div_u64(hello->pool_trim_ns,
+						       NSEC_PER_USEC),
+					       UINT_MAX));
+
 		mutex_init(&conn->lock);
+		spin_lock_init(&conn->queue_lock);
+		mutex_init(&conn->pool_lock);
 		mutex_init(&conn->names_lock);
 		mutex_init(&conn->accounting_lock);
+		mutex_init(&conn->reply_lock);
 		INIT_LIST_HEAD(&conn->msg_list);
+		conn->msg_prio_tree = RB_ROOT;
+		conn->deadline_tree = RB_ROOT;
 		INIT_LIST_HEAD(&conn->names_list);
 		INIT_LIST_HEAD(&conn->names_queue_list);
 		INIT_LIST_HEAD(&conn->monitor_entry);
+		init_waitqueue_head(&conn->wait);
+		INIT_LIST_HEAD(&conn->blocked_entry);
+		INIT_LIST_HEAD(&conn->blocked_list);
+		spin_lock_init(&conn->blocked_lock);
+		init_waitqueue_head(&conn->drain_wait);
 
 		INIT_WORK(&conn->work, kdbus_conn_work);
+		INIT_DELAYED_WORK(&conn->pool_trim_work,
+				  kdbus_conn_pool_trim_work);
 
 		init_timer(&conn->timer);
 		conn->timer.expires = 0;
@@ -1211,8 +2652,6 @@ static long kdbus_conn_ioctl_ep(struct file *file, unsigned int cmd,
 		conn->timer.data = (unsigned long) conn;
 		add_timer(&conn->timer);
 
-		conn->match_db = kdbus_match_db_new();
-
 		conn->creds.uid = from_kuid_munged(current_user_ns(),
 						   current_uid());
 		conn->creds.gid = from_kgid_munged(current_user_ns(),
@@ -1227,25 +2666,29 @@ static long kdbus_conn_ioctl_ep(struct file *file, unsigned int cmd,
 		/* link into bus; get new id for this connection */
 		mutex_lock(&conn->ep->bus->lock);
 		conn->id = conn->ep->bus->conn_id_next++;
-		hash_add(conn->ep->bus->conn_hash, &conn->hentry, conn->id);
+		kdbus_hash_add(&conn->ep->bus->conn_hash, &conn->hentry, conn->id);
 		mutex_unlock(&conn->ep->bus->lock);
 
 		/* return properties of this connection to the caller */
 		hello->bus_flags = bus->bus_flags;
 		hello->bloom_size = bus->bloom_size;
+		hello->vec_pin_size = KDBUS_MSG_PIN_VEC_SIZE;
+		hello->max_msgs = conn->max_msgs;
 		hello->id = conn->id;
 		if (copy_to_user(buf, hello, sizeof(struct kdbus_cmd_hello))) {
-			kdbus_conn_cleanup(conn);
+			kdbus_conn_cleanup(conn, &notify_list);
 			ret = -EFAULT;
 			break;
 		}
 
 		/* notify about the new active connection */
-		ret = kdbus_notify_id_change(conn->ep, KDBUS_MSG_ID_ADD, conn->id, conn->flags);
+		ret = kdbus_notify_id_change(KDBUS_MSG_ID_ADD, conn->id,
+					     conn->flags, &notify_list);
 		if (ret < 0) {
-			kdbus_conn_cleanup(conn);
+			kdbus_conn_cleanup(conn, &notify_list);
 			break;
 		}
+		kdbus_notify_flush(conn->ep, &notify_list);
 
 		conn->flags = hello->conn_flags;
 		conn->type = KDBUS_CONN_EP_CONNECTED;
@@ -1311,13 +2754,15 @@ static long kdbus_conn_ioctl_ep_connected(struct file *file, unsigned int cmd,
 		break;
 
 	case KDBUS_CMD_NAME_LIST:
+	case KDBUS_CMD_NAME_LIST_CURSOR:
 		/* return all current well-known names */
 		if (!KDBUS_IS_ALIGNED8((uintptr_t)buf)) {
 			ret = -EFAULT;
 			break;
 		}
 
-		ret = kdbus_cmd_name_list(bus->name_registry, conn, buf);
+		ret = kdbus_cmd_name_list(bus->name_registry, conn, buf,
+					  cmd == KDBUS_CMD_NAME_LIST_CURSOR);
 		break;
 
 	case KDBUS_CMD_NAME_QUERY:
@@ -1366,9 +2811,9 @@ static long kdbus_conn_ioctl_ep_connected(struct file *file, unsigned int cmd,
 		}
 
 		/* privileged users can act on behalf of someone else */
-		if (cmd_monitor.id == 0) {
-			mconn = conn;
-		} else if (cmd_monitor.id != conn->id) {
+		if (cmd_monitor.id == 0 || cmd_monitor.id == conn->id) {
+			kdbus_conn_ref(mconn);
+		} else {
 			if (!kdbus_bus_uid_is_privileged(bus)) {
 				ret = -EPERM;
 				break;
@@ -1381,15 +2826,24 @@ static long kdbus_conn_ioctl_ep_connected(struct file *file, unsigned int cmd,
 			}
 		}
 
+		/* the pinned connection might have been disconnected meanwhile */
 		mutex_lock(&bus->lock);
-		if (cmd_monitor.enable)
+		if (mconn->type != KDBUS_CONN_EP_CONNECTED)
+			ret = -ENOTCONN;
+		else if (cmd_monitor.enable)
 			list_add_tail(&mconn->monitor_entry, &bus->monitors_list);
 		else
 			list_del(&mconn->monitor_entry);
 		mutex_unlock(&bus->lock);
+
+		kdbus_conn_unref(mconn);
 		break;
 	}
 
+	case KDBUS_CMD_CONN_STATS:
+		ret = kdbus_conn_stats_query(conn, buf);
+		break;
+
 	case KDBUS_CMD_MSG_SEND: {
 		/* submit a message which will be queued in the receiver */
 		struct kdbus_kmsg *kmsg;
@@ -1408,6 +2862,17 @@ static long kdbus_conn_ioctl_ep_connected(struct file *file, unsigned int cmd,
 		break;
 	}
 
+	case KDBUS_CMD_MSG_SEND_BATCH: {
+		/* submit a vector of messages */
+		if (!KDBUS_IS_ALIGNED8((uintptr_t)buf)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = kdbus_conn_send_batch(conn, buf);
+		break;
+	}
+
 	case KDBUS_CMD_MSG_RECV: {
 		/* receive a pointer to a queued message */
 		if (!KDBUS_IS_ALIGNED8((uintptr_t)buf)) {
@@ -1419,6 +2884,17 @@ static long kdbus_conn_ioctl_ep_connected(struct file *file, unsigned int cmd,
 		break;
 	}
 
+	case KDBUS_CMD_MSG_RECV_BATCH: {
+		/* receive pointers to several queued messages at once */
+		if (!KDBUS_IS_ALIGNED8((uintptr_t)buf)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = kdbus_conn_recv_batch(conn, buf);
+		break;
+	}
+
 	case KDBUS_CMD_MSG_RELEASE: {
 		u64 off;
 
@@ -1433,25 +2909,35 @@ static long kdbus_conn_ioctl_ep_connected(struct file *file, unsigned int cmd,
 			break;
 		}
 
-		mutex_lock(&conn->lock);
+		mutex_lock(&conn->pool_lock);
 		ret = kdbus_pool_free(conn->pool, off);
-		mutex_unlock(&conn->lock);
+		if (ret == 0) {
+			kdbus_conn_pool_trim_schedule(conn);
+			kdbus_conn_drained(conn);
+		}
+		mutex_unlock(&conn->pool_lock);
 		break;
 	}
 
-	case KDBUS_CMD_MEMFD_NEW: {
-		int fd;
-		int __user *addr = buf;
-
-		ret = kdbus_memfd_new(&fd);
-		if (ret < 0)
+	case KDBUS_CMD_MSG_RELEASE_BATCH: {
+		/* free the memory of several messages at once */
+		if (!KDBUS_IS_ALIGNED8((uintptr_t)buf)) {
+			ret = -EFAULT;
 			break;
+		}
 
-		if (put_user(fd, addr))
-			ret = -EFAULT;
+		ret = kdbus_conn_release_batch(conn, buf);
 		break;
 	}
 
+	case KDBUS_CMD_MEMFD_NEW:
+		ret = kdbus_conn_memfd_new(conn->memfd_cache, buf);
+		break;
+
+	case KDBUS_CMD_MEMFD_MAKE:
+		ret = kdbus_conn_memfd_make(conn->memfd_cache, buf);
+		break;
+
 	default:
 		ret = -ENOTTY;
 		break;
@@ -1485,18 +2971,34 @@ static unsigned int kdbus_conn_poll(struct file *file,
 				    struct poll_table_struct *wait)
 {
 	struct kdbus_conn *conn = file->private_data;
+	struct kdbus_conn *conn_dst;
 	unsigned int mask = 0;
 
 	/* Only an endpoint can read/write data */
 	if (conn->type != KDBUS_CONN_EP_CONNECTED)
 		return POLLERR | POLLHUP;
 
+	/* messages for this connection, and endpoint-wide events */
+	poll_wait(file, &conn->wait, wait);
 	poll_wait(file, &conn->ep->wait, wait);
 
-	mutex_lock(&conn->lock);
+	if (conn->ep->disconnected)
+		return POLLERR | POLLHUP;
+
+	/* writable unless the receiver of the last failed send is full;
+	 * the receiver wakes conn->wait once it drained */
+	spin_lock(&conn->queue_lock);
 	if (!list_empty(&conn->msg_list))
 		mask |= POLLIN | POLLRDNORM;
-	mutex_unlock(&conn->lock);
+	conn_dst = conn->blocked_dst;
+	if (conn_dst)
+		kdbus_conn_ref(conn_dst);
+	spin_unlock(&conn->queue_lock);
+
+	if (!conn_dst || kdbus_conn_has_room(conn_dst))
+		mask |= POLLOUT | POLLWRNORM;
+	if (conn_dst)
+		kdbus_conn_unref(conn_dst);
 
 	return mask;
 }
@@ -13,7 +13,11 @@
 #ifndef __KDBUS_CONNECTION_H
 #define __KDBUS_CONNECTION_H
 
+#include <linux/rbtree.h>
+
 #include "internal.h"
+#include "hash.h"
+#include "message.h"
 #include "pool.h"
 
 /*
@@ -31,8 +35,22 @@ enum kdbus_conn_type {
 	KDBUS_CONN_EP_OWNER,		/* fd to hold an endpoint */
 };
 
+/* counters of a connection, see struct kdbus_cmd_conn_stats */
+struct kdbus_conn_stats {
+	atomic64_t msgs_sent;
+	atomic64_t bytes_sent;
+	atomic64_t msgs_received;
+	atomic64_t bytes_received;
+	atomic64_t msgs_dropped;
+	atomic64_t broadcasts_sent;
+	atomic64_t broadcast_receivers;
+	atomic64_t match_evals;
+	unsigned int queue_depth_max;		/* protected by queue_lock */
+};
+
 struct kdbus_conn {
 	struct kref kref;
+	struct rcu_head rcu;			/* deferred free for lookups */
 	enum kdbus_conn_type type;
 	struct kdbus_ns *ns;
 	union {
@@ -43,20 +61,38 @@ struct kdbus_conn {
 	u64 id;		/* id of the connection on the bus */
 	u64 flags;
 
-	struct mutex lock;
+	struct mutex lock;			/* serializes the receivers */
+	spinlock_t queue_lock;			/* msg_list and the trees */
+	struct mutex pool_lock;			/* allocations in the pool */
 	struct mutex names_lock;
 	struct mutex accounting_lock;
 
-	struct list_head msg_list;
-	struct hlist_node hentry;
+	struct list_head msg_list;		/* all queued messages */
+	struct rb_root msg_prio_tree;		/* receive order, by priority */
+	struct rb_root deadline_tree;		/* queued messages with timeout */
+	struct kdbus_hash_node hentry;
 	struct list_head monitor_entry;		/* bus' monitor connections */
 	struct list_head names_list;		/* names on this connection */
 	struct list_head names_queue_list;
 
+	/* method calls this connection has to answer, by cookie */
+	struct mutex reply_lock;
+	struct kdbus_hash reply_hash;
+
 	struct work_struct work;
 	struct timer_list timer;
 
+	/* returns the free pages of the pool once it is idle */
+	struct delayed_work pool_trim_work;
+	unsigned long pool_trim_delay;		/* jiffies, from HELLO */
+
+	wait_queue_head_t wait;			/* wake up this connection */
+
 	struct kdbus_creds creds;
+
+	/* changed with names_list under names_lock; unique across all
+	 * connections, 0 as long as the connection owns no name */
+	unsigned int names_generation;
 	struct kdbus_match_db *match_db;
 
 #ifdef CONFIG_AUDITSYSCALL
@@ -70,22 +106,47 @@ struct kdbus_conn {
 
 	/* connection accounting */
 	unsigned int msg_count;
+	unsigned int msg_reserved;		/* senders on their way, queue_lock */
+	unsigned int max_msgs;			/* limit negotiated in HELLO */
 	size_t allocated_size;
 
+	/* backpressure */
+	u64 send_timeout_ns;			/* blocking send, from HELLO */
+	bool queue_full;			/* a sender found no room */
+	struct kdbus_conn *blocked_dst;		/* full receiver of our last send */
+	struct list_head blocked_entry;		/* in blocked_list of blocked_dst */
+	struct list_head blocked_list;		/* senders we blocked, polling */
+	spinlock_t blocked_lock;		/* protects blocked_list */
+	wait_queue_head_t drain_wait;		/* senders waiting for room */
+
 	/* buffer to fill with message data */
 	struct kdbus_pool *pool;
+
+	/* metadata of the sending task, reused across messages */
+	struct kdbus_meta_cache meta_cache;
+
+	/* released memfds created by this connection, for reuse */
+	struct kdbus_memfd_cache *memfd_cache;
+
+	struct kdbus_conn_stats stats;
 };
 
 struct kdbus_kmsg;
 struct kdbus_conn_queue;
 
+int kdbus_conn_cache_init(void);
+void kdbus_conn_cache_exit(void);
+
 int kdbus_conn_kmsg_send(struct kdbus_ep *ep,
 			 struct kdbus_conn *conn_src,
 			 struct kdbus_kmsg *kmsg);
+void kdbus_conn_kmsg_send_notify(struct kdbus_ep *ep, struct list_head *kmsgs);
 void kdbus_conn_queue_cleanup(struct kdbus_conn_queue *queue);
 int kdbus_conn_queue_insert(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg,
 			    u64 deadline_ns);
 
 int kdbus_conn_accounting_add_size(struct kdbus_conn *conn, size_t size);
 void kdbus_conn_accounting_sub_size(struct kdbus_conn *conn, size_t size);
+void kdbus_conn_stats_add(struct kdbus_conn *conn,
+			  struct kdbus_cmd_conn_stats *s);
 #endif
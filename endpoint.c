@@ -19,12 +19,12 @@
 #include <linux/sched.h>
 #include <linux/init.h>
 #include <linux/uaccess.h>
-#include <linux/hashtable.h>
 #include <linux/sizes.h>
 
 #include "endpoint.h"
 #include "bus.h"
 #include "policy.h"
+#include "names.h"
 #include "namespace.h"
 
 /* endpoints are by default owned by the bus owner */
@@ -43,10 +43,126 @@ static char *kdbus_devnode_ep(struct device *dev, umode_t *mode,
 	return NULL;
 }
 
+static ssize_t kdbus_hash_stats_show(struct kdbus_hash *h, struct mutex *lock,
+				     char *buf)
+{
+	struct kdbus_hash_stats s;
+
+	mutex_lock(lock);
+	kdbus_hash_stats(h, &s);
+	mutex_unlock(lock);
+
+	return sprintf(buf, "entries %u buckets %u used %u max_chain %u resizes %u\n",
+		       s.entries, s.buckets, s.used, s.max_chain, s.resizes);
+}
+
+/* bucket occupancy of the hash tables of the bus and the endpoint */
+static ssize_t conn_hash_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct kdbus_ep *ep = dev_get_drvdata(dev);
+
+	if (!ep->bus)
+		return -ENODEV;
+
+	return kdbus_hash_stats_show(&ep->bus->conn_hash, &ep->bus->lock, buf);
+}
+
+static ssize_t name_hash_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct kdbus_ep *ep = dev_get_drvdata(dev);
+	struct kdbus_name_registry *reg;
+
+	if (!ep->bus)
+		return -ENODEV;
+
+	reg = ep->bus->name_registry;
+	return kdbus_hash_stats_show(&reg->entries_hash, &reg->entries_lock,
+				     buf);
+}
+
+static ssize_t policy_hash_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct kdbus_ep *ep = dev_get_drvdata(dev);
+	struct kdbus_policy_db *db = ep->policy_db;
+
+	if (!db)
+		return -ENODEV;
+
+	return kdbus_hash_stats_show(&db->entries_hash, &db->entries_lock, buf);
+}
+
+/* message counters of all connections of the bus */
+static ssize_t msg_stats_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct kdbus_ep *ep = dev_get_drvdata(dev);
+	struct kdbus_cmd_conn_stats s;
+
+	if (!ep->bus)
+		return -ENODEV;
+
+	kdbus_bus_stats(ep->bus, &s);
+
+	return sprintf(buf, "sent %llu bytes_sent %llu received %llu bytes_received %llu "
+		       "dropped %llu broadcasts %llu broadcast_receivers %llu "
+		       "match_evals %llu queued %llu queue_max %llu\n",
+		       s.msgs_sent, s.bytes_sent, s.msgs_received,
+		       s.bytes_received, s.msgs_dropped, s.broadcasts_sent,
+		       s.broadcast_receivers, s.match_evals, s.queue_depth,
+		       s.queue_depth_max);
+}
+
+/* how often the policy of the endpoint was checked from the cached bits */
+static ssize_t policy_cache_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct kdbus_ep *ep = dev_get_drvdata(dev);
+	struct kdbus_policy_db *db = ep->policy_db;
+	unsigned long hits, misses;
+
+	if (!db)
+		return -ENODEV;
+
+	mutex_lock(&db->entries_lock);
+	hits = db->access_hits;
+	misses = db->access_misses;
+	mutex_unlock(&db->entries_lock);
+
+	return sprintf(buf, "hits %lu misses %lu\n", hits, misses);
+}
+
+static DEVICE_ATTR(conn_hash, S_IRUGO, conn_hash_show, NULL);
+static DEVICE_ATTR(name_hash, S_IRUGO, name_hash_show, NULL);
+static DEVICE_ATTR(policy_hash, S_IRUGO, policy_hash_show, NULL);
+static DEVICE_ATTR(msg_stats, S_IRUGO, msg_stats_show, NULL);
+static DEVICE_ATTR(policy_cache, S_IRUGO, policy_cache_show, NULL);
+
+static struct attribute *kdbus_ep_attrs[] = {
+	&dev_attr_conn_hash.attr,
+	&dev_attr_name_hash.attr,
+	&dev_attr_policy_hash.attr,
+	&dev_attr_msg_stats.attr,
+	&dev_attr_policy_cache.attr,
+	NULL,
+};
+
+static const struct attribute_group kdbus_ep_attr_group = {
+	.attrs = kdbus_ep_attrs,
+};
+
+static const struct attribute_group *kdbus_ep_attr_groups[] = {
+	&kdbus_ep_attr_group,
+	NULL,
+};
+
 static struct device_type kdbus_devtype_ep = {
 	.name		= "ep",
 	.release	= kdbus_dev_release,
 	.devnode	= kdbus_devnode_ep,
+	.groups		= kdbus_ep_attr_groups,
 };
 
 struct kdbus_ep *kdbus_ep_ref(struct kdbus_ep *ep)
@@ -61,6 +177,9 @@ void kdbus_ep_disconnect(struct kdbus_ep *ep)
 		return;
 	ep->disconnected = true;
 
+	/* wake up all pollers of the connections on this endpoint */
+	wake_up_interruptible_all(&ep->wait);
+
 	if (ep->dev) {
 		device_unregister(ep->dev);
 		ep->dev = NULL;
@@ -132,6 +251,7 @@ int kdbus_ep_new(struct kdbus_bus *bus, const char *name, umode_t mode,
 
 	mutex_lock(&bus->ns->lock);
 	kref_init(&e->kref);
+	init_waitqueue_head(&e->wait);
 	e->uid = uid;
 	e->gid = gid;
 
@@ -186,8 +306,6 @@ int kdbus_ep_new(struct kdbus_bus *bus, const char *name, umode_t mode,
 		}
 	}
 
-	init_waitqueue_head(&e->wait);
-
 	mutex_unlock(&bus->ns->lock);
 
 	pr_debug("created endpoint %llu for bus '%s/%s/%s'\n",
@@ -31,7 +31,7 @@ struct kdbus_ep {
 	kuid_t uid;			/* uid owning this endpoint */
 	kgid_t gid;			/* gid owning this endpoint */
 	struct list_head bus_entry;	/* bus' endpoints */
-	wait_queue_head_t wait;		/* wake up this endpoint */
+	wait_queue_head_t wait;		/* wake up on endpoint-wide events */
 	struct kdbus_policy_db *policy_db;
 	bool policy_open:1;
 };
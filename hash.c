@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2013 Kay Sievers
+ * Copyright (C) 2013 Greg Kroah-Hartman <gregkh@linuxfoundation.org>
+ * Copyright (C) 2013 Linux Foundation
+ *
+ * kdbus is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+
+#include "hash.h"
+
+static struct kdbus_hash_table *kdbus_hash_table_new(unsigned int bits)
+{
+	struct kdbus_hash_table *t;
+	unsigned int i;
+
+	t = kmalloc(sizeof(*t) + (sizeof(struct hlist_head) << bits),
+		    GFP_KERNEL | __GFP_NOWARN);
+	if (!t)
+		return NULL;
+
+	t->bits = bits;
+	for (i = 0; i < (1U << bits); i++)
+		INIT_HLIST_HEAD(&t->heads[i]);
+
+	return t;
+}
+
+/**
+ * kdbus_hash_init() - initialize a hash
+ * @h:		The hash to initialize
+ * @bits:	The initial and minimal size of the table, as a power of two
+ *
+ * Return: 0 on success, -ENOMEM if the table could not be allocated
+ */
+int kdbus_hash_init(struct kdbus_hash *h, unsigned int bits)
+{
+	struct kdbus_hash_table *t;
+
+	bits = clamp_t(unsigned int, bits,
+		       KDBUS_HASH_MIN_BITS, KDBUS_HASH_MAX_BITS);
+
+	t = kdbus_hash_table_new(bits);
+	if (!t)
+		return -ENOMEM;
+
+	RCU_INIT_POINTER(h->table, t);
+	seqcount_init(&h->seq);
+	h->count = 0;
+	h->min_bits = bits;
+	h->resizes = 0;
+
+	return 0;
+}
+
+/**
+ * kdbus_hash_cleanup() - free the table of a hash
+ * @h:		The hash, which must not contain any entries anymore
+ */
+void kdbus_hash_cleanup(struct kdbus_hash *h)
+{
+	struct kdbus_hash_table *t = kdbus_hash_table(h);
+
+	if (!t)
+		return;
+
+	WARN_ON(h->count > 0);
+	RCU_INIT_POINTER(h->table, NULL);
+	kfree_rcu(t, rcu);
+}
+
+/*
+ * Move all entries to a new table of the given size. The entries are
+ * not copied, lockless readers walking the old table might end up in a
+ * chain of the new one and miss their entry; the sequence count tells
+ * them to look again. If no memory is available, the table just keeps
+ * its current size.
+ */
+static void kdbus_hash_resize(struct kdbus_hash *h, unsigned int bits)
+{
+	struct kdbus_hash_table *old = kdbus_hash_table(h);
+	struct kdbus_hash_table *t;
+	unsigned int i;
+
+	t = kdbus_hash_table_new(bits);
+	if (!t)
+		return;
+
+	preempt_disable();
+	write_seqcount_begin(&h->seq);
+
+	for (i = 0; i < (1U << old->bits); i++) {
+		struct hlist_head *head = &old->heads[i];
+
+		while (!hlist_empty(head)) {
+			struct kdbus_hash_node *n;
+
+			n = hlist_entry(head->first,
+					struct kdbus_hash_node, node);
+			hlist_del_rcu(&n->node);
+			hlist_add_head_rcu(&n->node, kdbus_hash_head(t, n->key));
+		}
+	}
+
+	rcu_assign_pointer(h->table, t);
+
+	write_seqcount_end(&h->seq);
+	preempt_enable();
+
+	h->resizes++;
+	kfree_rcu(old, rcu);
+}
+
+/**
+ * kdbus_hash_add() - add an entry, grow the table if needed
+ * @h:		The hash
+ * @n:		The node of the entry
+ * @key:	The key of the entry
+ *
+ * The table grows when it holds more entries than buckets. The entry
+ * becomes visible to lockless readers immediately.
+ */
+void kdbus_hash_add(struct kdbus_hash *h, struct kdbus_hash_node *n, u64 key)
+{
+	struct kdbus_hash_table *t = kdbus_hash_table(h);
+
+	n->key = key;
+	hlist_add_head_rcu(&n->node, kdbus_hash_head(t, key));
+	h->count++;
+
+	if (h->count > (1U << t->bits) && t->bits < KDBUS_HASH_MAX_BITS)
+		kdbus_hash_resize(h, t->bits + 1);
+}
+
+/**
+ * __kdbus_hash_del() - remove an entry, never resize the table
+ * @h:		The hash
+ * @n:		The node of the entry
+ *
+ * This may be used while iterating over the hash; the entry itself must
+ * only be freed after a grace period if the hash has lockless readers.
+ * Removing an entry which is not hashed is a no-op.
+ */
+void __kdbus_hash_del(struct kdbus_hash *h, struct kdbus_hash_node *n)
+{
+	if (hlist_unhashed(&n->node))
+		return;
+
+	hlist_del_init_rcu(&n->node);
+	h->count--;
+}
+
+/**
+ * kdbus_hash_shrink() - shrink the table if it is mostly empty
+ * @h:		The hash
+ */
+void kdbus_hash_shrink(struct kdbus_hash *h)
+{
+	struct kdbus_hash_table *t = kdbus_hash_table(h);
+	unsigned int bits = t->bits;
+
+	while (bits > h->min_bits && h->count < (1U << bits) / 4)
+		bits--;
+
+	if (bits != t->bits)
+		kdbus_hash_resize(h, bits);
+}
+
+/**
+ * kdbus_hash_del() - remove an entry, shrink the table if needed
+ * @h:		The hash
+ * @n:		The node of the entry
+ */
+void kdbus_hash_del(struct kdbus_hash *h, struct kdbus_hash_node *n)
+{
+	__kdbus_hash_del(h, n);
+	kdbus_hash_shrink(h);
+}
+
+/**
+ * kdbus_hash_stats() - collect the bucket occupancy of a hash
+ * @h:		The hash
+ * @s:		The statistics to fill in
+ */
+void kdbus_hash_stats(struct kdbus_hash *h, struct kdbus_hash_stats *s)
+{
+	struct kdbus_hash_table *t = kdbus_hash_table(h);
+	unsigned int i;
+
+	memset(s, 0, sizeof(*s));
+	s->entries = h->count;
+	s->buckets = 1U << t->bits;
+	s->resizes = h->resizes;
+
+	for (i = 0; i < s->buckets; i++) {
+		struct hlist_node *node;
+		unsigned int len = 0;
+
+		hlist_for_each(node, &t->heads[i])
+			len++;
+
+		if (len > 0)
+			s->used++;
+		if (len > s->max_chain)
+			s->max_chain = len;
+	}
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2013 Kay Sievers
+ * Copyright (C) 2013 Greg Kroah-Hartman <gregkh@linuxfoundation.org>
+ * Copyright (C) 2013 Linux Foundation
+ *
+ * kdbus is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ */
+
+#ifndef __KDBUS_HASH_H
+#define __KDBUS_HASH_H
+
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/rculist.h>
+#include <linux/seqlock.h>
+
+/*
+ * A hash table which grows and shrinks with the number of its entries.
+ *
+ * Writers serialize on a lock of the owner of the table, which is held
+ * across every call below, except for the _rcu lookup helpers. Lookups
+ * may be done under RCU only; while a resize moves the entries to the
+ * new table, a lookup might miss an entry, so a lockless reader which
+ * did not find anything has to retry if kdbus_hash_read_retry() says so.
+ */
+#define KDBUS_HASH_MIN_BITS	4
+#define KDBUS_HASH_MAX_BITS	14
+
+struct kdbus_hash_node {
+	struct hlist_node	node;
+	u64			key;
+};
+
+struct kdbus_hash_table {
+	struct rcu_head		rcu;
+	unsigned int		bits;
+	struct hlist_head	heads[0];
+};
+
+struct kdbus_hash {
+	struct kdbus_hash_table __rcu *table;
+	seqcount_t		seq;		/* bumped while entries move */
+	unsigned int		count;		/* number of entries */
+	unsigned int		min_bits;	/* never shrink below */
+	unsigned int		resizes;	/* number of resizes */
+};
+
+struct kdbus_hash_stats {
+	unsigned int		entries;
+	unsigned int		buckets;
+	unsigned int		used;		/* buckets with entries */
+	unsigned int		max_chain;	/* longest bucket */
+	unsigned int		resizes;
+};
+
+int kdbus_hash_init(struct kdbus_hash *h, unsigned int bits);
+void kdbus_hash_cleanup(struct kdbus_hash *h);
+void kdbus_hash_add(struct kdbus_hash *h, struct kdbus_hash_node *n, u64 key);
+void kdbus_hash_del(struct kdbus_hash *h, struct kdbus_hash_node *n);
+void __kdbus_hash_del(struct kdbus_hash *h, struct kdbus_hash_node *n);
+void kdbus_hash_shrink(struct kdbus_hash *h);
+void kdbus_hash_stats(struct kdbus_hash *h, struct kdbus_hash_stats *s);
+
+/* the table of a hash, the caller holds the writer lock */
+static inline struct kdbus_hash_table *kdbus_hash_table(struct kdbus_hash *h)
+{
+	return rcu_dereference_protected(h->table, 1);
+}
+
+static inline struct hlist_head *
+kdbus_hash_head(struct kdbus_hash_table *t, u64 key)
+{
+	return &t->heads[hash_64(key, t->bits)];
+}
+
+/* start a lockless lookup, the caller holds rcu_read_lock() */
+static inline unsigned int kdbus_hash_read_begin(struct kdbus_hash *h,
+						 struct kdbus_hash_table **t)
+{
+	unsigned int seq;
+
+	seq = read_seqcount_begin(&h->seq);
+	*t = rcu_dereference(h->table);
+	return seq;
+}
+
+/* a lockless lookup which did not find anything has to be repeated */
+static inline bool kdbus_hash_read_retry(struct kdbus_hash *h,
+					 unsigned int seq)
+{
+	return read_seqcount_retry(&h->seq, seq);
+}
+
+#define kdbus_hash_for_each_possible(h, obj, member, key)		\
+	hlist_for_each_entry(obj,					\
+			     kdbus_hash_head(kdbus_hash_table(h), key),	\
+			     member.node)
+
+#define kdbus_hash_for_each_possible_rcu(t, obj, member, key)		\
+	hlist_for_each_entry_rcu(obj, kdbus_hash_head(t, key), member.node)
+
+/* entries may only be removed with __kdbus_hash_del() while iterating */
+#define kdbus_hash_for_each(h, bkt, obj, member)			\
+	for ((bkt) = 0;							\
+	     (bkt) < (1U << kdbus_hash_table(h)->bits); (bkt)++)	\
+		hlist_for_each_entry(obj,				\
+				     &kdbus_hash_table(h)->heads[bkt],	\
+				     member.node)
+
+#define kdbus_hash_for_each_safe(h, bkt, tmp, obj, member)		\
+	for ((bkt) = 0;							\
+	     (bkt) < (1U << kdbus_hash_table(h)->bits); (bkt)++)	\
+		hlist_for_each_entry_safe(obj, tmp,			\
+					  &kdbus_hash_table(h)->heads[bkt], \
+					  member.node)
+#endif
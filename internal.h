@@ -19,6 +19,8 @@
 #define KDBUS_MSG_MAX_ITEMS		128		/* maximum number of message items */
 #define KDBUS_MSG_MAX_FDS		256		/* maximum number of passed file descriptors */
 #define KDBUS_MSG_MAX_PAYLOAD_VEC_SIZE	SZ_8M		/* maximum message payload size */
+#define KDBUS_MSG_PIN_VEC_SIZE		SZ_64K		/* page-aligned vecs of this size are copied from pinned pages */
+#define KDBUS_MSG_MAX_BATCH		256		/* maximum number of messages received at once */
 
 #define KDBUS_NAME_MAX_LEN		255		/* maximum length of well-known bus name */
 
@@ -28,9 +30,15 @@
 #define KDBUS_HELLO_MAX_SIZE		SZ_32K		/* maximum size of hello data */
 #define KDBUS_MATCH_MAX_SIZE		SZ_32K		/* maximum size of match data */
 #define KDBUS_POLICY_MAX_SIZE		SZ_32K		/* maximum size of policy data */
+#define KDBUS_POLICY_CACHE_MAX		256		/* maximum number of cached access lookups of a policy */
 
 #define KDBUS_CONN_MAX_MSGS		64		/* maximum number of queued messages on the bus */
+#define KDBUS_CONN_MAX_MSGS_LIMIT	4096		/* maximum a connection can ask for */
+#define KDBUS_CONN_MAX_REQUESTS_PENDING	1024		/* maximum number of method calls to answer */
 #define KDBUS_CONN_MAX_ALLOCATED_BYTES	SZ_64K		/* maximum number of allocated bytes on the bus */
+#define KDBUS_CONN_MEMFD_CACHE_MAX	8		/* maximum number of released memfds kept for reuse */
+#define KDBUS_CONN_MEMFD_CACHE_SIZE	SZ_4M		/* maximum size of a memfd kept for reuse */
+#define KDBUS_CONN_POOL_TRIM_NS		(1000ULL * NSEC_PER_MSEC) /* idle time before free pool pages are returned */
 
 #define KDBUS_CHAR_MAJOR		222		/* FIXME: move to uapi/linux/major.h */
 
@@ -83,6 +91,29 @@ static inline unsigned int kdbus_str_hash(const char *str)
 	return full_name_hash(str, strlen(str));
 }
 
+/* the current CLOCK_MONOTONIC time */
+static inline u64 kdbus_now_ns(void)
+{
+	struct timespec ts;
+
+	ktime_get_ts(&ts);
+	return timespec_to_ns(&ts);
+}
+
+/* arm a timer to fire at a CLOCK_MONOTONIC deadline */
+static inline void kdbus_timer_arm(struct timer_list *timer, u64 deadline_ns)
+{
+	u64 now = kdbus_now_ns();
+	u64 usecs = 0;
+
+	if (deadline_ns > now) {
+		usecs = deadline_ns - now;
+		do_div(usecs, 1000ULL);
+	}
+
+	mod_timer(timer, jiffies + usecs_to_jiffies(usecs));
+}
+
 extern const struct file_operations kdbus_device_ops;
 extern struct bus_type kdbus_subsys;
 void kdbus_dev_release(struct device *dev);
@@ -189,6 +189,8 @@ struct kdbus_msg {
 		__u64 cookie_reply;	/* cookie we reply to */
 		__u64 timeout_ns;	/* timespan to wait for reply */
 	};
+	__s64 priority;			/* lower values are received first */
+	__u64 seqnum;			/* set by the kernel, increasing on the bus */
 	struct kdbus_item items[0];
 };
 
@@ -236,6 +238,7 @@ struct kdbus_cmd_policy {
 enum {
 	KDBUS_HELLO_STARTER		=  1 <<  0,
 	KDBUS_HELLO_ACCEPT_FD		=  1 <<  1,
+	KDBUS_HELLO_POOL_RING		=  1 <<  2,
 
 	/* The following have an effect on directed messages only --
 	 * not for broadcasts */
@@ -246,6 +249,7 @@ enum {
 	KDBUS_HELLO_ATTACH_CAPS		=  1 << 14,
 	KDBUS_HELLO_ATTACH_SECLABEL	=  1 << 15,
 	KDBUS_HELLO_ATTACH_AUDIT	=  1 << 16,
+	KDBUS_HELLO_ATTACH_TIMESTAMP	=  1 << 17,
 };
 
 struct kdbus_cmd_hello {
@@ -269,6 +273,19 @@ struct kdbus_cmd_hello {
 	__u64 bloom_size;	/* The bloom filter size chosen by the
 				 * bus owner */
 	__u64 pool_size;	/* maximum size of pool buffer */
+	__u64 vec_pin_size;	/* page-aligned vecs of at least this
+				 * size are copied directly from the
+				 * sender's pinned pages */
+	__u64 max_msgs;		/* maximum number of queued messages,
+				 * 0 for the default; the kernel returns
+				 * the value in effect */
+	__u64 send_timeout_ns;	/* time a send waits for room in the
+				 * queue of a full receiver, 0 to fail
+				 * immediately */
+	__u64 pool_trim_ns;	/* time the pool has to be unused before
+				 * its free pages are returned, 0 for the
+				 * default; the kernel returns the value
+				 * in effect */
 	struct kdbus_item items[0];
 };
 
@@ -345,11 +362,32 @@ struct kdbus_cmd_name {
 	char name[0];
 };
 
+enum {
+	/* userspace → kernel */
+	KDBUS_NAME_LIST_IF_CHANGED		= 1 <<  0,
+};
+
+/* KDBUS_CMD_NAME_LIST, the complete list or -ENOBUFS */
 struct kdbus_cmd_names {
 	__u64 size;
 	struct kdbus_cmd_name names[0];
 };
 
+/* KDBUS_CMD_NAME_LIST_CURSOR, the list in pieces */
+struct kdbus_cmd_name_list {
+	__u64 size;		/* userspace → kernel: size of the buffer
+				 * kernel → userspace: size of the list */
+	__u64 flags;		/* KDBUS_NAME_LIST_* */
+	__u64 generation;	/* kernel → userspace: generation of the
+				 * registry; userspace → kernel: checked
+				 * against with KDBUS_NAME_LIST_IF_CHANGED */
+	__u64 cursor;		/* where to continue an earlier listing,
+				 * returned as 0 when the list is complete */
+	__u64 prefix;		/* only names starting with this string,
+				 * address of a NUL-terminated string or 0 */
+	struct kdbus_cmd_name names[0];
+};
+
 enum {
 	_KDBUS_NAME_INFO_ITEM_NULL,
 	KDBUS_NAME_INFO_ITEM_NAME,	/* userspace → kernel */
@@ -390,6 +428,67 @@ struct kdbus_cmd_monitor {
 	__u32 __pad;
 };
 
+enum {
+	KDBUS_RECV_BLOCK		= 1 <<  0,	/* wait for a message to arrive */
+	KDBUS_RECV_USE_PRIORITY		= 1 <<  1,	/* only messages up to priority */
+};
+
+/* Receive a batch of queued messages; the pool offsets of the messages
+ * are stored in the array at the address 'offsets' */
+struct kdbus_cmd_recv {
+	__u64 flags;		/* KDBUS_RECV_* */
+	__u64 timeout_ns;	/* relative timeout of KDBUS_RECV_BLOCK, 0: infinite */
+	__u64 offsets;		/* address of a __u64 array */
+	__u64 count;		/* in: size of the array, out: received messages */
+	__s64 priority;		/* highest priority value of KDBUS_RECV_USE_PRIORITY */
+};
+
+/* Counters of a connection, returned by KDBUS_CMD_CONN_STATS */
+struct kdbus_cmd_conn_stats {
+	__u64 id;			/* in: the connection, 0: the caller */
+	__u64 msgs_sent;		/* messages sent, a broadcast counts once */
+	__u64 bytes_sent;		/* size of the sent messages and their payload */
+	__u64 msgs_received;		/* messages taken off the queue with RECV */
+	__u64 bytes_received;		/* pool space of the received messages */
+	__u64 msgs_dropped;		/* messages refused with -ENOBUFS or -EXFULL */
+	__u64 broadcasts_sent;		/* broadcasts sent */
+	__u64 broadcast_receivers;	/* receivers the broadcasts were queued for */
+	__u64 match_evals;		/* match databases evaluated for the broadcasts */
+	__u64 queue_depth;		/* messages currently queued */
+	__u64 queue_depth_max;		/* high-water mark of queue_depth */
+	__u64 pool_size;		/* size of the pool */
+	__u64 pool_used;		/* bytes currently allocated in the pool */
+	__u64 pool_used_max;		/* high-water mark of pool_used */
+	__u64 pool_fragmentation;	/* percentage of free space not in the largest free slice */
+	__u64 pool_resident;		/* bytes of the pool backed by memory */
+};
+
+enum {
+	KDBUS_MEMFD_PREFAULT		= 1 <<  0,	/* allocate all pages of the file */
+};
+
+/* Create a new memfd of the given size */
+struct kdbus_cmd_memfd_make {
+	__u64 size;		/* initial size of the file, 0: empty */
+	__u64 flags;		/* KDBUS_MEMFD_* */
+	int fd;			/* out: the new file descriptor */
+	__u32 __pad;
+};
+
+/* Send a vector of messages */
+struct kdbus_cmd_send {
+	__u64 count;		/* number of messages */
+	__u64 msgs;		/* address of a __u64 array of struct kdbus_msg addresses */
+	__u64 status;		/* address of a __s32 array, out: 0 or -errno per message */
+};
+
+/* Release a vector of received messages */
+struct kdbus_cmd_release {
+	__u64 size;		/* overall size of the struct */
+	__u64 released;		/* out: number of released messages */
+	__u64 offsets[0];	/* pool offsets of the messages */
+};
+
 /* FD states:
  * control nodes: unset
  *   bus owner  (via KDBUS_CMD_BUS_MAKE)
@@ -413,15 +512,20 @@ enum {
 	KDBUS_CMD_MSG_SEND =		_IOW(KDBUS_IOC_MAGIC, 0x40, struct kdbus_msg),
 	KDBUS_CMD_MSG_RECV =		_IOR(KDBUS_IOC_MAGIC, 0x41, __u64 *),
 	KDBUS_CMD_MSG_RELEASE =		_IOW(KDBUS_IOC_MAGIC, 0x42, __u64 *),
+	KDBUS_CMD_MSG_RECV_BATCH =	_IOWR(KDBUS_IOC_MAGIC, 0x43, struct kdbus_cmd_recv),
+	KDBUS_CMD_MSG_RELEASE_BATCH =	_IOWR(KDBUS_IOC_MAGIC, 0x44, struct kdbus_cmd_release),
+	KDBUS_CMD_MSG_SEND_BATCH =	_IOW(KDBUS_IOC_MAGIC, 0x45, struct kdbus_cmd_send),
 
 	KDBUS_CMD_NAME_ACQUIRE =	_IOWR(KDBUS_IOC_MAGIC, 0x50, struct kdbus_cmd_name),
 	KDBUS_CMD_NAME_RELEASE =	_IOW(KDBUS_IOC_MAGIC, 0x51, struct kdbus_cmd_name),
 	KDBUS_CMD_NAME_LIST =		_IOWR(KDBUS_IOC_MAGIC, 0x52, struct kdbus_cmd_names),
 	KDBUS_CMD_NAME_QUERY =		_IOWR(KDBUS_IOC_MAGIC, 0x53, struct kdbus_cmd_name_info),
+	KDBUS_CMD_NAME_LIST_CURSOR =	_IOWR(KDBUS_IOC_MAGIC, 0x54, struct kdbus_cmd_name_list),
 
 	KDBUS_CMD_MATCH_ADD =		_IOW(KDBUS_IOC_MAGIC, 0x60, struct kdbus_cmd_match),
 	KDBUS_CMD_MATCH_REMOVE =	_IOW(KDBUS_IOC_MAGIC, 0x61, struct kdbus_cmd_match),
 	KDBUS_CMD_MONITOR =		_IOW(KDBUS_IOC_MAGIC, 0x62, struct kdbus_cmd_monitor),
+	KDBUS_CMD_CONN_STATS =		_IOWR(KDBUS_IOC_MAGIC, 0x63, struct kdbus_cmd_conn_stats),
 
 	/* kdbus ep node commands: require ep owner state */
 	KDBUS_CMD_EP_POLICY_SET =	_IOW(KDBUS_IOC_MAGIC, 0x70, struct kdbus_cmd_policy),
@@ -432,5 +536,6 @@ enum {
 	KDBUS_CMD_MEMFD_SIZE_SET =	_IOW(KDBUS_IOC_MAGIC, 0x82, __u64 *),
 	KDBUS_CMD_MEMFD_SEAL_GET =	_IOR(KDBUS_IOC_MAGIC, 0x83, int *),
 	KDBUS_CMD_MEMFD_SEAL_SET =	_IO(KDBUS_IOC_MAGIC, 0x84),
+	KDBUS_CMD_MEMFD_MAKE =		_IOWR(KDBUS_IOC_MAGIC, 0x85, struct kdbus_cmd_memfd_make),
 };
 #endif
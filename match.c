@@ -43,10 +43,43 @@ struct kdbus_match_db_entry {
 	u64			id;
 	u64			cookie;
 	u64			src_id;
+	u64			*bloom;		/* OR of all bloom items or NULL */
+	bool			src_names;	/* has KDBUS_MATCH_SRC_NAME items */
+	unsigned int		notify_mask;	/* kernel notification items */
 	struct list_head	list_entry;
+	struct hlist_node	bucket_entry;
 	struct list_head	items_list;
 };
 
+/* index of a kernel notification type, KDBUS_MSG_NAME_ADD and following */
+static int kdbus_match_notify_index(u64 type)
+{
+	if (type < KDBUS_MSG_NAME_ADD ||
+	    type >= KDBUS_MSG_NAME_ADD + KDBUS_MATCH_NOTIFY_TYPES)
+		return -1;
+
+	return type - KDBUS_MSG_NAME_ADD;
+}
+
+/* the kernel notification a match item applies to */
+static u64 kdbus_match_item_notify_type(u64 type)
+{
+	switch (type) {
+	case KDBUS_MATCH_NAME_ADD:
+		return KDBUS_MSG_NAME_ADD;
+	case KDBUS_MATCH_NAME_REMOVE:
+		return KDBUS_MSG_NAME_REMOVE;
+	case KDBUS_MATCH_NAME_CHANGE:
+		return KDBUS_MSG_NAME_CHANGE;
+	case KDBUS_MATCH_ID_ADD:
+		return KDBUS_MSG_ID_ADD;
+	case KDBUS_MATCH_ID_REMOVE:
+		return KDBUS_MSG_ID_REMOVE;
+	}
+
+	return 0;
+}
+
 static void
 kdbus_match_db_entry_item_free(struct kdbus_match_db_entry_item *item)
 {
@@ -78,7 +111,9 @@ static void kdbus_match_db_entry_free(struct kdbus_match_db_entry *e)
 	list_for_each_entry_safe(ei, ei_tmp, &e->items_list, list_entry)
 		kdbus_match_db_entry_item_free(ei);
 
+	hlist_del_init(&e->bucket_entry);
 	list_del(&e->list_entry);
+	kfree(e->bloom);
 	kfree(e);
 }
 
@@ -93,6 +128,9 @@ static void __kdbus_match_db_free(struct kref *kref)
 		kdbus_match_db_entry_free(e);
 	mutex_unlock(&db->entries_lock);
 
+	kfree(db->any_masks);
+	kfree(db->any_entries);
+	kfree(db->bloom_common);
 	kfree(db);
 }
 
@@ -101,45 +139,188 @@ void kdbus_match_db_unref(struct kdbus_match_db *db)
 	kref_put(&db->kref, __kdbus_match_db_free);
 }
 
-struct kdbus_match_db *kdbus_match_db_new(void)
+struct kdbus_match_db *kdbus_match_db_new(struct kdbus_conn *conn)
 {
+	unsigned int bloom_size = conn->ep->bus->bloom_size;
 	struct kdbus_match_db *db;
+	unsigned int i;
 
 	db = kzalloc(sizeof(*db), GFP_KERNEL);
 	if (!db)
 		return NULL;
 
+	db->bloom_common = kzalloc(bloom_size, GFP_KERNEL);
+	if (!db->bloom_common) {
+		kfree(db);
+		return NULL;
+	}
+
 	kref_init(&db->kref);
 	mutex_init(&db->entries_lock);
 	INIT_LIST_HEAD(&db->entries);
+	hash_init(db->entries_src_hash);
+	INIT_HLIST_HEAD(&db->entries_any);
+	INIT_HLIST_HEAD(&db->entries_kernel);
+	for (i = 0; i < KDBUS_MATCH_NOTIFY_TYPES; i++)
+		INIT_HLIST_HEAD(&db->entries_notify[i]);
+	INIT_HLIST_NODE(&db->bus_entry);
+	INIT_HLIST_NODE(&db->bus_kernel_entry);
+	db->bloom_size = bloom_size;
+	db->conn = conn;
 
 	return db;
 }
 
-static inline
+/*
+ * Test if all bits of the mask are set in the filter. Blocks of 8 words
+ * are combined without a branch, which lets the compiler unroll the loop
+ * and keep the words in registers; with the word count known at compile
+ * time, the tail loop disappears.
+ */
+static __always_inline
+bool __kdbus_match_db_test_bloom(const u64 *filter,
+				 const u64 *mask,
+				 unsigned int n)
+{
+	unsigned int i;
+	u64 miss = 0;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		miss = (mask[i + 0] & ~filter[i + 0]) |
+		       (mask[i + 1] & ~filter[i + 1]) |
+		       (mask[i + 2] & ~filter[i + 2]) |
+		       (mask[i + 3] & ~filter[i + 3]) |
+		       (mask[i + 4] & ~filter[i + 4]) |
+		       (mask[i + 5] & ~filter[i + 5]) |
+		       (mask[i + 6] & ~filter[i + 6]) |
+		       (mask[i + 7] & ~filter[i + 7]);
+		if (miss)
+			return false;
+	}
+
+	for (; i < n; i++)
+		miss |= mask[i] & ~filter[i];
+
+	return miss == 0;
+}
+
+/* specialized for the common bloom sizes of 64, 128, 256 and 512 bytes */
+static
 bool kdbus_match_db_test_bloom(const u64 *filter,
 			       const u64 *mask,
 			       unsigned int n)
 {
-	size_t i;
+	switch (n) {
+	case 8:
+		return __kdbus_match_db_test_bloom(filter, mask, 8);
+	case 16:
+		return __kdbus_match_db_test_bloom(filter, mask, 16);
+	case 32:
+		return __kdbus_match_db_test_bloom(filter, mask, 32);
+	case 64:
+		return __kdbus_match_db_test_bloom(filter, mask, 64);
+	}
+
+	return __kdbus_match_db_test_bloom(filter, mask, n);
+}
+
+static __always_inline
+unsigned int __kdbus_match_db_test_bloom_many(const u64 *filter,
+					      const u64 *masks,
+					      unsigned int count,
+					      unsigned int start,
+					      unsigned int n)
+{
+	unsigned int i;
+
+	for (i = start; i < count; i++)
+		if (__kdbus_match_db_test_bloom(filter, masks + i * n, n))
+			return i;
+
+	return count;
+}
+
+/* Test the filter against an array of masks stored back to back, starting
+ * at index 'start'; returns the index of the first mask contained in the
+ * filter, or 'count' if there is none. */
+static
+unsigned int kdbus_match_db_test_bloom_many(const u64 *filter,
+					    const u64 *masks,
+					    unsigned int count,
+					    unsigned int start,
+					    unsigned int n)
+{
+	switch (n) {
+	case 8:
+		return __kdbus_match_db_test_bloom_many(filter, masks,
+							count, start, 8);
+	case 16:
+		return __kdbus_match_db_test_bloom_many(filter, masks,
+							count, start, 16);
+	case 32:
+		return __kdbus_match_db_test_bloom_many(filter, masks,
+							count, start, 32);
+	case 64:
+		return __kdbus_match_db_test_bloom_many(filter, masks,
+							count, start, 64);
+	}
+
+	return __kdbus_match_db_test_bloom_many(filter, masks,
+						count, start, n);
+}
 
-	for (i = 0; i < n; i++)
-		if ((filter[i] & mask[i]) != mask[i])
+/* do the source names of the message match the ones of the entry */
+static bool kdbus_match_db_test_names(const struct kdbus_match_db_entry *e,
+				      const struct kdbus_kmsg *kmsg)
+{
+	struct kdbus_match_db_entry_item *ei;
+
+	if (!e->src_names)
+		return true;
+
+	list_for_each_entry(ei, &e->items_list, list_entry) {
+		if (ei->type != KDBUS_MATCH_SRC_NAME)
+			continue;
+
+		if (!kmsg->src_names ||
+		    !kdbus_match_db_test_src_names(kmsg->src_names,
+						   kmsg->src_names_len,
+						   ei->name))
 			return false;
+	}
 
 	return true;
 }
 
-static inline
-bool kdbus_match_db_test_src_names(const char *haystack,
-				   size_t haystack_size,
-				   const char *needle)
+/* does the entry, which is known to accept the sender, match the message */
+static bool kdbus_match_db_test_entry(const struct kdbus_match_db *db,
+				      const struct kdbus_match_db_entry *e,
+				      const struct kdbus_kmsg *kmsg)
+{
+	if (e->bloom && kmsg->bloom &&
+	    !kdbus_match_db_test_bloom(kmsg->bloom, e->bloom,
+				       db->bloom_size / sizeof(u64)))
+		return false;
+
+	return kdbus_match_db_test_names(e, kmsg);
+}
+
+/* test the entries of the any list in one pass over their packed masks */
+static bool kdbus_match_db_match_any(const struct kdbus_match_db *db,
+				     const struct kdbus_kmsg *kmsg)
 {
-	size_t i;
+	unsigned int n = db->bloom_size / sizeof(u64);
+	unsigned int i;
 
-	for (i = 0; i < haystack_size; i += strlen(haystack) + 1)
-		if (strcmp(haystack + i, needle) == 0)
+	for (i = 0; i < db->any_count; i++) {
+		i = kdbus_match_db_test_bloom_many(kmsg->bloom, db->any_masks,
+						   db->any_count, i, n);
+		if (i == db->any_count)
+			break;
+
+		if (kdbus_match_db_test_names(db->any_entries[i], kmsg))
 			return true;
+	}
 
 	return false;
 }
@@ -153,114 +334,304 @@ bool kdbus_match_db_match_with_src(struct kdbus_match_db *db,
 	bool matched = false;
 
 	mutex_lock(&db->entries_lock);
-	list_for_each_entry(e, &db->entries, list_entry) {
-		struct kdbus_match_db_entry_item *ei;
-
-		if (e->src_id != KDBUS_MATCH_SRC_ID_ANY &&
-		    e->src_id != conn_src->id)
-			continue;
 
-		matched = true;
+	/* no entry for messages from senders at all */
+	if (db->user_entries_count == 0)
+		goto exit_unlock;
 
-		list_for_each_entry(ei, &e->items_list, list_entry) {
-			if (kmsg->bloom) {
-				size_t bloom_num =
-					conn_src->ep->bus->bloom_size / sizeof(u64);
+	/* the bloom filter lacks bits which every entry requires */
+	if (kmsg->bloom &&
+	    !kdbus_match_db_test_bloom(kmsg->bloom, db->bloom_common,
+				       db->bloom_size / sizeof(u64)))
+		goto exit_unlock;
 
-				if (!kdbus_match_db_test_bloom(kmsg->bloom,
-							       ei->bloom,
-							       bloom_num)) {
-					matched = false;
-					break;
-				}
-			}
+	hash_for_each_possible(db->entries_src_hash, e, bucket_entry,
+			       conn_src->id) {
+		if (e->src_id != conn_src->id)
+			continue;
 
-			if (kmsg->src_names) {
-				if (!kdbus_match_db_test_src_names(kmsg->src_names,
-								   kmsg->src_names_len,
-								   ei->name)) {
-					matched = false;
-					break;
-				}
-			}
+		if (kdbus_match_db_test_entry(db, e, kmsg)) {
+			matched = true;
+			goto exit_unlock;
 		}
+	}
 
-		if (matched)
-			break;
+	if (db->any_masks && kmsg->bloom) {
+		matched = kdbus_match_db_match_any(db, kmsg);
+		goto exit_unlock;
+	}
+
+	hlist_for_each_entry(e, &db->entries_any, bucket_entry) {
+		if (kdbus_match_db_test_entry(db, e, kmsg)) {
+			matched = true;
+			goto exit_unlock;
+		}
 	}
-	mutex_unlock(&db->entries_lock);
 
+exit_unlock:
+	mutex_unlock(&db->entries_lock);
 	return matched;
 }
 
+/* Kernel notifications are matched by their type only, every entry in
+ * the buckets of the notification type accepts it. */
 static
 bool kdbus_match_db_match_from_kernel(struct kdbus_match_db *db,
 				      struct kdbus_conn *conn_dst,
 				      struct kdbus_kmsg *kmsg)
 {
-	u64 type = kmsg->notification_type;
-	struct kdbus_match_db_entry *e;
-	bool matched = false;
+	int idx = kdbus_match_notify_index(kmsg->notification_type);
+	bool matched;
 
 	mutex_lock(&db->entries_lock);
+	matched = !hlist_empty(&db->entries_any) ||
+		  !hlist_empty(&db->entries_kernel) ||
+		  (idx >= 0 && !hlist_empty(&db->entries_notify[idx]));
+	mutex_unlock(&db->entries_lock);
+
+	return matched;
+}
+
+bool kdbus_match_db_match_kmsg(struct kdbus_match_db *db,
+			       struct kdbus_conn *conn_src,
+			       struct kdbus_conn *conn_dst,
+			       struct kdbus_kmsg *kmsg)
+{
+	if (conn_src)
+		return kdbus_match_db_match_with_src(db, conn_src, kmsg);
+	else
+		return kdbus_match_db_match_from_kernel(db, conn_dst, kmsg);
+}
+
+/* entries, which can match messages from senders, are put into the
+ * per-sender hash or the any-sender list */
+static bool kdbus_match_db_entry_is_user(const struct kdbus_match_db_entry *e)
+{
+	return e->notify_mask == 0 && e->src_id != KDBUS_SRC_ID_KERNEL;
+}
+
+/* recalculate the bloom bits all entries for user messages require */
+static void kdbus_match_db_update_bloom(struct kdbus_match_db *db)
+{
+	unsigned int n = db->bloom_size / sizeof(u64);
+	struct kdbus_match_db_entry *e;
+	bool first = true;
+	unsigned int i;
+
+	memset(db->bloom_common, 0, db->bloom_size);
+
 	list_for_each_entry(e, &db->entries, list_entry) {
-		struct kdbus_match_db_entry_item *ei;
+		if (!kdbus_match_db_entry_is_user(e))
+			continue;
+
+		/* an entry without a mask accepts any bloom filter */
+		if (!e->bloom) {
+			memset(db->bloom_common, 0, db->bloom_size);
+			return;
+		}
 
-		if (e->src_id != KDBUS_MATCH_SRC_ID_ANY &&
-		    e->src_id != 0)
+		if (first) {
+			memcpy(db->bloom_common, e->bloom, db->bloom_size);
+			first = false;
 			continue;
+		}
+
+		for (i = 0; i < n; i++)
+			db->bloom_common[i] &= e->bloom[i];
+	}
+}
 
-		matched = true;
+/* pack the masks of the any list into one array; if that fails, the
+ * list is walked entry by entry */
+static void kdbus_match_db_pack_any(struct kdbus_match_db *db)
+{
+	unsigned int n = db->bloom_size / sizeof(u64);
+	struct kdbus_match_db_entry *e;
+	unsigned int count = 0, i = 0;
+
+	kfree(db->any_masks);
+	kfree(db->any_entries);
+	db->any_masks = NULL;
+	db->any_entries = NULL;
+	db->any_count = 0;
+
+	hlist_for_each_entry(e, &db->entries_any, bucket_entry)
+		count++;
+
+	if (count == 0)
+		return;
+
+	db->any_masks = kcalloc(count, db->bloom_size, GFP_KERNEL);
+	db->any_entries = kcalloc(count, sizeof(*db->any_entries), GFP_KERNEL);
+	if (!db->any_masks || !db->any_entries) {
+		kfree(db->any_masks);
+		kfree(db->any_entries);
+		db->any_masks = NULL;
+		db->any_entries = NULL;
+		return;
+	}
 
-		list_for_each_entry(ei, &e->items_list, list_entry) {
-			if (ei->type == KDBUS_MATCH_ID_ADD &&
-			    type != KDBUS_MSG_ID_ADD) {
-				matched = false;
-				break;
-			}
+	/* an entry without a mask accepts any filter, it stays zero */
+	hlist_for_each_entry(e, &db->entries_any, bucket_entry) {
+		if (e->bloom)
+			memcpy(db->any_masks + i * n, e->bloom, db->bloom_size);
+		db->any_entries[i++] = e;
+	}
 
-			if (ei->type == KDBUS_MATCH_ID_REMOVE &&
-			    type != KDBUS_MSG_ID_REMOVE) {
-				matched = false;
-				break;
-			}
+	db->any_count = count;
+}
 
-			if (ei->type == KDBUS_MATCH_NAME_ADD &&
-			    type != KDBUS_MSG_NAME_ADD) {
-				matched = false;
-				break;
-			}
+/* link the entry into the bucket of the messages it can match */
+static void kdbus_match_db_entry_link(struct kdbus_match_db *db,
+				      struct kdbus_match_db_entry *e)
+{
+	list_add_tail(&e->list_entry, &db->entries);
+
+	if (kdbus_match_db_entry_is_user(e)) {
+		if (e->src_id == KDBUS_MATCH_SRC_ID_ANY)
+			hlist_add_head(&e->bucket_entry, &db->entries_any);
+		else
+			hash_add(db->entries_src_hash, &e->bucket_entry,
+				 e->src_id);
+
+		db->user_entries_count++;
+		kdbus_match_db_update_bloom(db);
+		kdbus_match_db_pack_any(db);
+		return;
+	}
 
-			if (ei->type == KDBUS_MATCH_NAME_CHANGE &&
-			    type != KDBUS_MSG_NAME_CHANGE) {
-				matched = false;
-				break;
-			}
+	/* a kernel notification is never sent on behalf of a peer */
+	if (e->src_id != KDBUS_MATCH_SRC_ID_ANY &&
+	    e->src_id != KDBUS_SRC_ID_KERNEL)
+		return;
 
-			if (ei->type == KDBUS_MATCH_NAME_REMOVE &&
-			    type != KDBUS_MSG_NAME_REMOVE) {
-				matched = false;
-				break;
+	if (e->notify_mask == 0) {
+		hlist_add_head(&e->bucket_entry, &db->entries_kernel);
+		return;
+	}
+
+	/* a notification has one type, more than one never matches */
+	if (hweight32(e->notify_mask) == 1)
+		hlist_add_head(&e->bucket_entry,
+			       &db->entries_notify[__ffs(e->notify_mask)]);
+}
+
+/* remove the database from the index of the bus; called with bus->lock */
+void kdbus_match_db_bus_unlink(struct kdbus_bus *bus,
+			       struct kdbus_match_db *db)
+{
+	if (!hlist_unhashed(&db->bus_entry)) {
+		hlist_del_init(&db->bus_entry);
+		bus->match_count--;
+	}
+
+	if (!hlist_unhashed(&db->bus_kernel_entry)) {
+		hlist_del_init(&db->bus_kernel_entry);
+		bus->match_kernel_count--;
+	}
+}
+
+/*
+ * Re-file the database in the index of the bus after its entries changed;
+ * called with bus->lock and db->entries_lock held.
+ *
+ * A database for messages from senders is linked to the bloom word with
+ * the most bits every one of its entries requires; a broadcast only looks
+ * at the lists of its non-zero bloom words then. Databases which accept
+ * any bloom filter are on the any list.
+ */
+static void kdbus_match_db_bus_update(struct kdbus_bus *bus,
+				      struct kdbus_match_db *db)
+{
+	unsigned int n = db->bloom_size / sizeof(u64);
+	unsigned int i, word = 0, weight = 0;
+
+	kdbus_match_db_bus_unlink(bus, db);
+
+	if (db->user_entries_count > 0) {
+		for (i = 0; i < n; i++) {
+			if (hweight64(db->bloom_common[i]) > weight) {
+				weight = hweight64(db->bloom_common[i]);
+				word = i;
 			}
 		}
 
-		if (matched)
-			break;
+		if (weight > 0) {
+			db->bloom_word_mask = db->bloom_common[word];
+			hlist_add_head(&db->bus_entry,
+				       &bus->match_bloom_heads[word]);
+		} else {
+			hlist_add_head(&db->bus_entry, &bus->match_any_list);
+		}
+
+		bus->match_count++;
 	}
-	mutex_unlock(&db->entries_lock);
 
-	return matched;
+	if (!hlist_empty(&db->entries_any) ||
+	    !hlist_empty(&db->entries_kernel)) {
+		hlist_add_head(&db->bus_kernel_entry, &bus->match_kernel_list);
+		bus->match_kernel_count++;
+	} else {
+		for (i = 0; i < KDBUS_MATCH_NOTIFY_TYPES; i++) {
+			if (hlist_empty(&db->entries_notify[i]))
+				continue;
+
+			hlist_add_head(&db->bus_kernel_entry,
+				       &bus->match_kernel_list);
+			bus->match_kernel_count++;
+			break;
+		}
+	}
 }
 
-bool kdbus_match_db_match_kmsg(struct kdbus_match_db *db,
-			       struct kdbus_conn *conn_src,
-			       struct kdbus_conn *conn_dst,
-			       struct kdbus_kmsg *kmsg)
+/**
+ * kdbus_match_bus_collect() - find the possible receivers of a broadcast
+ * @bus:		The bus the message is sent on
+ * @kmsg:		The message, unused for kernel notifications
+ * @from_kernel:	Whether the message is a kernel notification
+ * @conns:		Array of at least bus->match_count or
+ *			bus->match_kernel_count entries
+ *
+ * Called with bus->lock held. The returned connections are not pinned,
+ * and the message still needs to be matched against their databases.
+ *
+ * Return: the number of connections stored in @conns
+ */
+unsigned int kdbus_match_bus_collect(struct kdbus_bus *bus,
+				     const struct kdbus_kmsg *kmsg,
+				     bool from_kernel,
+				     struct kdbus_conn **conns)
 {
-	if (conn_src)
-		return kdbus_match_db_match_with_src(db, conn_src, kmsg);
-	else
-		return kdbus_match_db_match_from_kernel(db, conn_dst, kmsg);
+	struct kdbus_match_db *db;
+	unsigned int n = 0;
+	unsigned int i;
+
+	if (from_kernel) {
+		hlist_for_each_entry(db, &bus->match_kernel_list,
+				     bus_kernel_entry)
+			conns[n++] = db->conn;
+
+		return n;
+	}
+
+	hlist_for_each_entry(db, &bus->match_any_list, bus_entry)
+		conns[n++] = db->conn;
+
+	if (!kmsg->bloom)
+		return n;
+
+	for (i = 0; i < bus->bloom_size / sizeof(u64); i++) {
+		u64 word = kmsg->bloom[i];
+
+		if (word == 0)
+			continue;
+
+		hlist_for_each_entry(db, &bus->match_bloom_heads[i], bus_entry)
+			if ((word & db->bloom_word_mask) == db->bloom_word_mask)
+				conns[n++] = db->conn;
+	}
+
+	return n;
 }
 
 static struct kdbus_cmd_match *
@@ -280,15 +651,17 @@ cmd_match_from_user(const struct kdbus_conn *conn, void __user *buf, bool items)
 		return ERR_PTR(-EMSGSIZE);
 
 	cmd_match = memdup_user(buf, size);
-	if (!cmd_match)
-		return NULL;
+	if (IS_ERR(cmd_match))
+		return cmd_match;
 
 	/* privileged users can act on behalf of someone else */
 	if (cmd_match->id == 0)
 		cmd_match->id = conn->id;
 	else if (cmd_match->id != conn->id &&
-		 !kdbus_bus_uid_is_privileged(conn->ep->bus))
-			return ERR_PTR(-EPERM);
+		 !kdbus_bus_uid_is_privileged(conn->ep->bus)) {
+		kfree(cmd_match);
+		return ERR_PTR(-EPERM);
+	}
 
 	return cmd_match;
 }
@@ -296,6 +669,7 @@ cmd_match_from_user(const struct kdbus_conn *conn, void __user *buf, bool items)
 int kdbus_match_db_add(struct kdbus_conn *conn, void __user *buf)
 {
 	struct kdbus_match_db *db = conn->match_db;
+	struct kdbus_bus *bus = conn->ep->bus;
 	struct kdbus_cmd_match *cmd_match;
 	struct kdbus_item *item;
 	struct kdbus_match_db_entry *e;
@@ -306,11 +680,13 @@ int kdbus_match_db_add(struct kdbus_conn *conn, void __user *buf)
 		return PTR_ERR(cmd_match);
 
 	e = kzalloc(sizeof(*e), GFP_KERNEL);
-	if (!e)
+	if (!e) {
+		kfree(cmd_match);
 		return -ENOMEM;
+	}
 
-	mutex_lock(&db->entries_lock);
 	INIT_LIST_HEAD(&e->list_entry);
+	INIT_HLIST_NODE(&e->bucket_entry);
 	INIT_LIST_HEAD(&e->items_list);
 	e->id = cmd_match->id;
 	e->src_id = cmd_match->src_id;
@@ -319,6 +695,7 @@ int kdbus_match_db_add(struct kdbus_conn *conn, void __user *buf)
 	KDBUS_PART_FOREACH(item, cmd_match, items) {
 		struct kdbus_match_db_entry_item *ei;
 		size_t size;
+		u64 notify;
 
 		if (!KDBUS_PART_VALID(item, cmd_match)) {
 			ret = -EINVAL;
@@ -333,18 +710,37 @@ int kdbus_match_db_add(struct kdbus_conn *conn, void __user *buf)
 
 		ei->type = item->type;
 		INIT_LIST_HEAD(&ei->list_entry);
+		list_add_tail(&ei->list_entry, &e->items_list);
 
 		switch (item->type) {
-		case KDBUS_MATCH_BLOOM:
+		case KDBUS_MATCH_BLOOM: {
+			unsigned int i;
+
 			size = item->size - offsetof(struct kdbus_item, data);
-			if (size != conn->ep->bus->bloom_size) {
+			if (size != db->bloom_size) {
 				ret = -EBADMSG;
 				break;
 			}
 
-			ei->bloom = kmemdup(item->data, item->size - offsetof(struct kdbus_item, data),
-					GFP_KERNEL);
+			ei->bloom = kmemdup(item->data, size, GFP_KERNEL);
+			if (!ei->bloom) {
+				ret = -ENOMEM;
+				break;
+			}
+
+			/* all masks of an entry must match, combine them */
+			if (!e->bloom) {
+				e->bloom = kzalloc(size, GFP_KERNEL);
+				if (!e->bloom) {
+					ret = -ENOMEM;
+					break;
+				}
+			}
+
+			for (i = 0; i < size / sizeof(u64); i++)
+				e->bloom[i] |= ei->bloom[i];
 			break;
+		}
 
 		case KDBUS_MATCH_SRC_NAME:
 		case KDBUS_MATCH_NAME_ADD:
@@ -353,49 +749,83 @@ int kdbus_match_db_add(struct kdbus_conn *conn, void __user *buf)
 			ei->name = kstrdup(item->str, GFP_KERNEL);
 			if (!ei->name)
 				ret = -ENOMEM;
+
+			if (item->type == KDBUS_MATCH_SRC_NAME)
+				e->src_names = true;
 			break;
 
 		case KDBUS_MATCH_ID_ADD:
 		case KDBUS_MATCH_ID_REMOVE:
 			ei->id = item->id;
 			break;
+
+		default:
+			ret = -EINVAL;
+			break;
 		}
 
-		list_add_tail(&ei->list_entry, &e->items_list);
+		if (ret < 0)
+			break;
+
+		notify = kdbus_match_item_notify_type(item->type);
+		if (notify)
+			e->notify_mask |= 1U << kdbus_match_notify_index(notify);
 	}
 
-	if (!KDBUS_PART_END(item, cmd_match))
+	if (ret == 0 && !KDBUS_PART_END(item, cmd_match))
 		ret = -EINVAL;
 
-	if (ret >= 0) {
-		list_add_tail(&e->list_entry, &db->entries);
-	} else {
+	if (ret < 0) {
 		kdbus_match_db_entry_free(e);
-		kfree(e);
+		kfree(cmd_match);
+		return ret;
 	}
 
+	mutex_lock(&bus->lock);
+	mutex_lock(&db->entries_lock);
+	kdbus_match_db_entry_link(db, e);
+	kdbus_match_db_bus_update(bus, db);
 	mutex_unlock(&db->entries_lock);
-	kfree(cmd_match);
+	mutex_unlock(&bus->lock);
 
-	return ret;
+	kfree(cmd_match);
+	return 0;
 }
 
 int kdbus_match_db_remove(struct kdbus_conn *conn, void __user *buf)
 {
 	struct kdbus_match_db *db = conn->match_db;
+	struct kdbus_bus *bus = conn->ep->bus;
 	struct kdbus_cmd_match *cmd_match;
 	struct kdbus_match_db_entry *e, *tmp;
+	bool update = false;
 
 	cmd_match = cmd_match_from_user(conn, buf, false);
 	if (IS_ERR(cmd_match))
 		return PTR_ERR(cmd_match);
 
+	mutex_lock(&bus->lock);
 	mutex_lock(&db->entries_lock);
-	list_for_each_entry_safe(e, tmp, &db->entries, list_entry)
-		if (e->cookie == cmd_match->cookie &&
-		    e->id == cmd_match->id)
-			kdbus_match_db_entry_free(e);
+	list_for_each_entry_safe(e, tmp, &db->entries, list_entry) {
+		if (e->cookie != cmd_match->cookie ||
+		    e->id != cmd_match->id)
+			continue;
+
+		if (kdbus_match_db_entry_is_user(e)) {
+			db->user_entries_count--;
+			update = true;
+		}
+
+		kdbus_match_db_entry_free(e);
+	}
+
+	if (update) {
+		kdbus_match_db_update_bloom(db);
+		kdbus_match_db_pack_any(db);
+	}
+	kdbus_match_db_bus_update(bus, db);
 	mutex_unlock(&db->entries_lock);
+	mutex_unlock(&bus->lock);
 
 	kfree(cmd_match);
 
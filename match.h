@@ -12,19 +12,62 @@
 #ifndef __KDBUS_MATCH_H
 #define __KDBUS_MATCH_H
 
+#include <linux/hashtable.h>
+
 #include "internal.h"
 
+/* number of kernel notification types, KDBUS_MSG_NAME_ADD to _ID_REMOVE */
+#define KDBUS_MATCH_NOTIFY_TYPES	5
+
+/*
+ * Every entry of the match database is sorted into one bucket, depending
+ * on the messages it can possibly match:
+ *   entries_src_hash:	messages from one specific sender
+ *   entries_any:	messages from any sender, including the kernel
+ *   entries_kernel:	all kernel notifications
+ *   entries_notify:	one specific type of kernel notification
+ * Entries which can never match are only linked into the entries list.
+ */
+struct kdbus_match_db_entry;
+
 struct kdbus_match_db {
 	struct kref		kref;
 	struct list_head	entries;
+	DECLARE_HASHTABLE(entries_src_hash, 6);
+	struct hlist_head	entries_any;
+	struct hlist_head	entries_kernel;
+	struct hlist_head	entries_notify[KDBUS_MATCH_NOTIFY_TYPES];
 	struct mutex		entries_lock;
+
+	/* bloom mask bits all entries for messages from senders require */
+	u64			*bloom_common;
+	unsigned int		bloom_size;
+	unsigned int		user_entries_count;
+
+	/* masks of the any list back to back, to test them in one pass */
+	u64			*any_masks;
+	struct kdbus_match_db_entry **any_entries;
+	unsigned int		any_count;
+
+	/* index of the bus, protected by bus->lock */
+	struct kdbus_conn	*conn;		/* owner of the database */
+	struct hlist_node	bus_entry;	/* bloom heads or any list */
+	struct hlist_node	bus_kernel_entry; /* kernel list */
+	u64			bloom_word_mask; /* required bits of the word */
 };
 
 struct kdbus_conn;
 struct kdbus_kmsg;
+struct kdbus_bus;
 
-struct kdbus_match_db *kdbus_match_db_new(void);
+struct kdbus_match_db *kdbus_match_db_new(struct kdbus_conn *conn);
 void kdbus_match_db_unref(struct kdbus_match_db *db);
+void kdbus_match_db_bus_unlink(struct kdbus_bus *bus,
+			       struct kdbus_match_db *db);
+unsigned int kdbus_match_bus_collect(struct kdbus_bus *bus,
+				     const struct kdbus_kmsg *kmsg,
+				     bool from_kernel,
+				     struct kdbus_conn **conns);
 int kdbus_match_db_add(struct kdbus_conn *conn, void __user *buf);
 int kdbus_match_db_remove(struct kdbus_conn *conn, void __user *buf);
 bool kdbus_match_db_match_kmsg(struct kdbus_match_db *db,
@@ -14,6 +14,10 @@
 
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
 #include <linux/sizes.h>
 #include <linux/sched.h>
 #include <linux/mutex.h>
@@ -29,10 +33,39 @@
 
 static const struct file_operations kdbus_memfd_fops;
 
+/*
+ * Every open file of a memfd has its own file position; the receivers of
+ * a memfd get a new open file each. The content, its size and the seal
+ * are shared.
+ */
 struct kdbus_memfile {
+	unsigned int files;	/* open files, protected by lock */
 	bool sealed;
 	struct mutex lock;
 	struct file *fp;
+
+	/* the connection which created the file, released files go back */
+	struct kdbus_memfd_cache *cache;
+	struct list_head cache_entry;
+};
+
+/* one list of files per power of two in pages, up to the maximum size */
+#define KDBUS_MEMFD_CACHE_CLASSES \
+	(ilog2(KDBUS_CONN_MEMFD_CACHE_SIZE) - PAGE_SHIFT + 1)
+
+/*
+ * Released memfds of a connection, which are not sealed and not mapped
+ * anymore, are kept around and handed out again by KDBUS_CMD_MEMFD_NEW
+ * and KDBUS_CMD_MEMFD_MAKE.
+ * This saves the setup of the shmem file and keeps its pages allocated.
+ * Live files hold a reference to the cache, cached files do not.
+ */
+struct kdbus_memfd_cache {
+	struct kref kref;
+	struct mutex lock;
+	bool disconnected;
+	unsigned int count;
+	struct list_head classes[KDBUS_MEMFD_CACHE_CLASSES];
 };
 
 bool kdbus_is_memfd(const struct file *fp)
@@ -40,52 +73,365 @@ bool kdbus_is_memfd(const struct file *fp)
 	return fp->f_op == &kdbus_memfd_fops;
 }
 
+/*
+ * The content of a sealed file does not change anymore; a reader which
+ * sees the seal sees all the writes which happened before it was set.
+ */
+static bool kdbus_memfile_sealed(const struct kdbus_memfile *mf)
+{
+	bool sealed = ACCESS_ONCE(mf->sealed);
+
+	smp_rmb();
+	return sealed;
+}
+
 bool kdbus_is_memfd_sealed(const struct file *fp)
+{
+	return kdbus_memfile_sealed(fp->private_data);
+}
+
+u64 kdbus_memfd_size(const struct file *fp)
 {
 	struct kdbus_memfile *mf = fp->private_data;
-	bool sealed;
+
+	return i_size_read(file_inode(mf->fp));
+}
+
+static void kdbus_memfile_free(struct kdbus_memfile *mf)
+{
+	fput(mf->fp);
+	kfree(mf);
+}
+
+/* the size class of a file, or -1 if it is too large to be cached */
+static int kdbus_memfd_cache_class(u64 size)
+{
+	if (size > KDBUS_CONN_MEMFD_CACHE_SIZE)
+		return -1;
+
+	if (size <= PAGE_SIZE)
+		return 0;
+
+	return get_order(size);
+}
+
+/**
+ * kdbus_memfd_cache_new() - create a cache of released memfds
+ *
+ * Return: the new cache, NULL if no memory is available
+ */
+struct kdbus_memfd_cache *kdbus_memfd_cache_new(void)
+{
+	struct kdbus_memfd_cache *cache;
+	unsigned int i;
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return NULL;
+
+	kref_init(&cache->kref);
+	mutex_init(&cache->lock);
+	for (i = 0; i < KDBUS_MEMFD_CACHE_CLASSES; i++)
+		INIT_LIST_HEAD(&cache->classes[i]);
+
+	return cache;
+}
+
+static struct kdbus_memfd_cache *
+kdbus_memfd_cache_ref(struct kdbus_memfd_cache *cache)
+{
+	kref_get(&cache->kref);
+	return cache;
+}
+
+/* free all cached files, the caller holds the lock or the last reference */
+static void kdbus_memfd_cache_purge(struct kdbus_memfd_cache *cache)
+{
+	struct kdbus_memfile *mf, *tmp;
+	unsigned int i;
+
+	for (i = 0; i < KDBUS_MEMFD_CACHE_CLASSES; i++) {
+		list_for_each_entry_safe(mf, tmp, &cache->classes[i],
+					 cache_entry) {
+			list_del(&mf->cache_entry);
+			kdbus_memfile_free(mf);
+		}
+	}
+
+	cache->count = 0;
+}
+
+static void __kdbus_memfd_cache_free(struct kref *kref)
+{
+	struct kdbus_memfd_cache *cache =
+		container_of(kref, struct kdbus_memfd_cache, kref);
+
+	kdbus_memfd_cache_purge(cache);
+	kfree(cache);
+}
+
+void kdbus_memfd_cache_unref(struct kdbus_memfd_cache *cache)
+{
+	kref_put(&cache->kref, __kdbus_memfd_cache_free);
+}
+
+/**
+ * kdbus_memfd_cache_disconnect() - stop caching files of a connection
+ * @cache:	The cache
+ *
+ * Frees the cached files; files which are still in use are freed when
+ * they are released.
+ */
+void kdbus_memfd_cache_disconnect(struct kdbus_memfd_cache *cache)
+{
+	mutex_lock(&cache->lock);
+	cache->disconnected = true;
+	kdbus_memfd_cache_purge(cache);
+	mutex_unlock(&cache->lock);
+}
+
+/* take a cached file of the size class of size */
+static struct kdbus_memfile *
+kdbus_memfd_cache_get(struct kdbus_memfd_cache *cache, u64 size)
+{
+	struct kdbus_memfile *mf = NULL;
+	int class;
+
+	class = kdbus_memfd_cache_class(size);
+	if (class < 0)
+		return NULL;
+
+	mutex_lock(&cache->lock);
+	if (!list_empty(&cache->classes[class])) {
+		mf = list_first_entry(&cache->classes[class],
+				      struct kdbus_memfile, cache_entry);
+		list_del(&mf->cache_entry);
+		cache->count--;
+	}
+	mutex_unlock(&cache->lock);
+
+	return mf;
+}
+
+/* keep a released file for reuse, return false if it needs to be freed */
+static bool kdbus_memfd_cache_put(struct kdbus_memfd_cache *cache,
+				  struct kdbus_memfile *mf)
+{
+	bool cached = false;
+	int class;
+
+	/* the content of a sealed file might be trusted by other peers,
+	 * and a mapping still holds a reference to the shmem file */
+	if (mf->sealed || file_count(mf->fp) != 1)
+		return false;
+
+	class = kdbus_memfd_cache_class(i_size_read(file_inode(mf->fp)));
+	if (class < 0)
+		return false;
+
+	mutex_lock(&cache->lock);
+	if (!cache->disconnected &&
+	    cache->count < KDBUS_CONN_MEMFD_CACHE_MAX) {
+		list_add(&mf->cache_entry, &cache->classes[class]);
+		cache->count++;
+		cached = true;
+	}
+	mutex_unlock(&cache->lock);
+
+	return cached;
+}
+
+/*
+ * Bring a cached file to the requested size and clear the pages it kept;
+ * a recycled file must look exactly like a new one. Pages which are out
+ * in swap are dropped instead.
+ */
+static int kdbus_memfile_reset(struct kdbus_memfile *mf, u64 size)
+{
+	struct inode *inode = file_inode(mf->fp);
+	struct address_space *mapping = mf->fp->f_mapping;
+	pgoff_t index, end;
+	int ret;
+
+	if (size != i_size_read(inode)) {
+		ret = vfs_truncate(&mf->fp->f_path, size);
+		if (ret < 0)
+			return ret;
+	}
+
+	end = DIV_ROUND_UP(size, PAGE_SIZE);
+	for (index = 0; index < end; index++) {
+		struct page *page;
+
+		page = find_lock_page(mapping, index);
+		if (!page)
+			continue;
+
+		if (radix_tree_exceptional_entry(page)) {
+			loff_t start = (loff_t)index << PAGE_SHIFT;
+
+			shmem_truncate_range(inode, start,
+					     start + PAGE_SIZE - 1);
+			continue;
+		}
+
+		clear_highpage(page);
+		set_page_dirty(page);
+		unlock_page(page);
+		page_cache_release(page);
+	}
+
+	return 0;
+}
+
+/* allocate all pages of the file, they are zero-filled and not mapped */
+static int kdbus_memfile_prefault(struct kdbus_memfile *mf, u64 size)
+{
+	struct address_space *mapping = mf->fp->f_mapping;
+	pgoff_t index, end;
+
+	end = DIV_ROUND_UP(size, PAGE_SIZE);
+	for (index = 0; index < end; index++) {
+		struct page *page;
+
+		if (fatal_signal_pending(current))
+			return -EINTR;
+
+		page = shmem_read_mapping_page(mapping, index);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+
+		page_cache_release(page);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/* create a new open file of a memfd, the caller holds a reference for it */
+static struct file *kdbus_memfile_open(struct kdbus_memfile *mf)
+{
+	struct file *fp;
+
+	/* The anonymous exported inode ops cannot reach the otherwise
+	 * invisible shmem inode. We rely on the fact that nothing else
+	 * can create a new file for the shmem inode, like by opening the
+	 * fd in /proc/$PID/fd/ */
+	fp = anon_inode_getfile("[kdbus]", &kdbus_memfd_fops, mf, O_RDWR);
+	if (IS_ERR(fp))
+		return fp;
+
+	fp->f_mode |= FMODE_LSEEK|FMODE_PREAD|FMODE_PWRITE;
+	fp->f_mapping = mf->fp->f_mapping;
+	return fp;
+}
+
+/* the last open file of a memfd was closed */
+static void __kdbus_memfile_release(struct kdbus_memfile *mf)
+{
+	struct kdbus_memfd_cache *cache = mf->cache;
+
+	if (cache) {
+		bool cached;
+
+		mf->cache = NULL;
+		cached = kdbus_memfd_cache_put(cache, mf);
+		kdbus_memfd_cache_unref(cache);
+		if (cached)
+			return;
+	}
+
+	kdbus_memfile_free(mf);
+}
+
+static void kdbus_memfile_put(struct kdbus_memfile *mf)
+{
+	bool last;
 
 	mutex_lock(&mf->lock);
-	sealed = mf->sealed;
+	last = --mf->files == 0;
 	mutex_unlock(&mf->lock);
 
-	return sealed;
+	if (last)
+		__kdbus_memfile_release(mf);
 }
 
-u64 kdbus_memfd_size(const struct file *fp)
+/**
+ * kdbus_memfd_reopen() - create a new open file of a memfd
+ * @fp:		An open file of the memfd
+ *
+ * The new file starts at position 0, it shares the content and the seal
+ * with all other open files of the memfd.
+ *
+ * Return: the new file, ERR_PTR on failure
+ */
+struct file *kdbus_memfd_reopen(const struct file *fp)
 {
 	struct kdbus_memfile *mf = fp->private_data;
-	u64 size;
+	struct file *f;
 
+	/* sealing counts the open files under the lock */
 	mutex_lock(&mf->lock);
-	size = i_size_read(file_inode(mf->fp));
+	mf->files++;
 	mutex_unlock(&mf->lock);
 
-	return size;
+	f = kdbus_memfile_open(mf);
+	if (IS_ERR(f))
+		kdbus_memfile_put(mf);
+
+	return f;
 }
 
-/* create file and install a new file descriptor */
-int kdbus_memfd_new(int *fd)
+/**
+ * kdbus_memfd_new() - create file and install a new file descriptor
+ * @cache:	The cache of the creating connection, or NULL
+ * @size:	The initial size of the file
+ * @flags:	KDBUS_MEMFD_* flags
+ * @fd:		The new file descriptor
+ *
+ * A file of the matching size class is taken from the cache if there is
+ * one, otherwise a new shmem file is set up.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int kdbus_memfd_new(struct kdbus_memfd_cache *cache, u64 size, u64 flags,
+		    int *fd)
 {
-	struct kdbus_memfile *mf;
-	struct file *shmemfp;
+	struct kdbus_memfile *mf = NULL;
 	struct file *fp;
 	int f;
 	int ret;
 
-	mf = kzalloc(sizeof(struct kdbus_memfile), GFP_KERNEL);
-	if (!mf)
-		return -ENOMEM;
+	if (cache)
+		mf = kdbus_memfd_cache_get(cache, size);
 
-	mutex_init(&mf->lock);
+	if (mf) {
+		ret = kdbus_memfile_reset(mf, size);
+		if (ret < 0)
+			goto exit_shmem;
+	} else {
+		struct file *shmemfp;
 
-	/* allocate a new unlinked shmem file */
-	shmemfp = shmem_file_setup("kdbus-memfd", 0, 0);
-	if (IS_ERR(shmemfp)) {
-		ret = PTR_ERR(shmemfp);
-		goto exit;
+		mf = kzalloc(sizeof(struct kdbus_memfile), GFP_KERNEL);
+		if (!mf)
+			return -ENOMEM;
+
+		mutex_init(&mf->lock);
+
+		/* allocate a new unlinked shmem file */
+		shmemfp = shmem_file_setup("kdbus-memfd", size, 0);
+		if (IS_ERR(shmemfp)) {
+			ret = PTR_ERR(shmemfp);
+			goto exit;
+		}
+		mf->fp = shmemfp;
+	}
+
+	if (flags & KDBUS_MEMFD_PREFAULT) {
+		ret = kdbus_memfile_prefault(mf, size);
+		if (ret < 0)
+			goto exit_shmem;
 	}
-	mf->fp = shmemfp;
 
 	f = get_unused_fd_flags(O_CLOEXEC);
 	if (f < 0) {
@@ -93,18 +439,16 @@ int kdbus_memfd_new(int *fd)
 		goto exit_shmem;
 	}
 
-	/* The anonymous exported inode ops cannot reach the otherwise
-	 * invisible shmem inode. We rely on the fact that nothing else
-	 * can create a new file for the shmem inode, like by opening the
-	 * fd in /proc/$PID/fd/ */
-	fp = anon_inode_getfile("[kdbus]", &kdbus_memfd_fops, mf, O_RDWR);
+	fp = kdbus_memfile_open(mf);
 	if (IS_ERR(fp)) {
 		ret = PTR_ERR(fp);
 		goto exit_fd;
 	}
 
-	fp->f_mode |= FMODE_LSEEK|FMODE_PREAD|FMODE_PWRITE;
-	fp->f_mapping = shmemfp->f_mapping;
+	mf->files = 1;
+	if (cache)
+		mf->cache = kdbus_memfd_cache_ref(cache);
+
 	fd_install(f, fp);
 
 	*fd = f;
@@ -113,7 +457,7 @@ int kdbus_memfd_new(int *fd)
 exit_fd:
 	put_unused_fd(f);
 exit_shmem:
-	fput(shmemfp);
+	fput(mf->fp);
 exit:
 	kfree(mf);
 	return ret;
@@ -123,27 +467,17 @@ static int kdbus_memfd_release(struct inode *ignored, struct file *file)
 {
 	struct kdbus_memfile *mf = file->private_data;
 
-	fput(mf->fp);
-	kfree(mf);
+	kdbus_memfile_put(mf);
 	return 0;
 }
 
+/* the file position is the one of the open file, not the shmem file */
 static loff_t kdbus_memfd_llseek(struct file *file, loff_t offset, int whence)
 {
 	struct kdbus_memfile *mf = file->private_data;
-	loff_t ret;
 
-	mutex_lock(&mf->lock);
-	ret = mf->fp->f_op->llseek(mf->fp, offset, whence);
-	if (ret < 0)
-		goto exit;
-
-	/* update the anonymous file */
-	file->f_pos = mf->fp->f_pos;
-
-exit:
-	mutex_unlock(&mf->lock);
-	return ret;
+	return generic_file_llseek_size(file, offset, whence, MAX_LFS_FILESIZE,
+					i_size_read(file_inode(mf->fp)));
 }
 
 static ssize_t kdbus_memfd_readv(struct kiocb *iocb, const struct iovec *iov,
@@ -152,17 +486,17 @@ static ssize_t kdbus_memfd_readv(struct kiocb *iocb, const struct iovec *iov,
 	struct kdbus_memfile *mf = iocb->ki_filp->private_data;
 	ssize_t ret;
 
+	/* readers of a sealed file do not need to wait for writers */
+	if (kdbus_memfile_sealed(mf)) {
+		iocb->ki_filp = mf->fp;
+		return mf->fp->f_op->aio_read(iocb, iov, iov_count, pos);
+	}
+
 	mutex_lock(&mf->lock);
 	iocb->ki_filp = mf->fp;
 	ret = mf->fp->f_op->aio_read(iocb, iov, iov_count, pos);
-	if (ret < 0)
-		goto exit;
-
-	/* update the shmem file */
-	mf->fp->f_pos = iocb->ki_pos;
-
-exit:
 	mutex_unlock(&mf->lock);
+
 	return ret;
 }
 
@@ -182,22 +516,37 @@ static ssize_t kdbus_memfd_writev(struct kiocb *iocb, const struct iovec *iov,
 
 	iocb->ki_filp = mf->fp;
 	ret = mf->fp->f_op->aio_write(iocb, iov, iov_count, pos);
-	if (ret < 0)
-		goto exit;
-
-	/* update the shmem file */
-	mf->fp->f_pos = iocb->ki_pos;
 
 exit:
 	mutex_unlock(&mf->lock);
 	return ret;
 }
 
+/* replace the anoymous inode file with our shmem file */
+static int kdbus_memfile_mmap(struct kdbus_memfile *mf, struct file *file,
+			      struct vm_area_struct *vma)
+{
+	if (vma->vm_file)
+		fput(vma->vm_file);
+	vma->vm_file = get_file(mf->fp);
+	return mf->fp->f_op->mmap(file, vma);
+}
+
 static int kdbus_memfd_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct kdbus_memfile *mf = file->private_data;
 	int ret = 0;
 
+	/*
+	 * A read-only mapping of a sealed file does not need the lock; it
+	 * can never be made writable, the seal cannot be broken while the
+	 * mapping holds a reference to the shmem file.
+	 */
+	if (!(vma->vm_flags & VM_WRITE) && kdbus_memfile_sealed(mf)) {
+		vma->vm_flags &= ~VM_MAYWRITE;
+		return kdbus_memfile_mmap(mf, file, vma);
+	}
+
 	mutex_lock(&mf->lock);
 
 	if (vma->vm_flags & VM_WRITE) {
@@ -215,15 +564,11 @@ static int kdbus_memfd_mmap(struct file *file, struct vm_area_struct *vma)
 		if (size > PAGE_ALIGN(i_size_read(file_inode(mf->fp)))) {
 			ret = vfs_truncate(&mf->fp->f_path, size);
 			if (ret < 0)
-				return ret;
+				goto exit;
 		}
 	}
 
-	/* replace the anoymous inode file with our shmem file */
-	if (vma->vm_file)
-		fput(vma->vm_file);
-	vma->vm_file = get_file(mf->fp);
-	ret = mf->fp->f_op->mmap(file, vma);
+	ret = kdbus_memfile_mmap(mf, file, vma);
 
 exit:
 	mutex_unlock(&mf->lock);
@@ -296,8 +641,12 @@ kdbus_memfd_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		 * Make sure we have only one single user of the file
 		 * before we seal, we rely on the fact there is no
 		 * any other possibly writable references to the file.
+		 * Other open files, like the ones of queued messages and
+		 * of receivers, would see the content change if the seal
+		 * is broken.
 		 */
-		if (file_count(mf->fp) != 1) {
+		if (mf->files != 1 ||
+		    file_count(mf->fp) != 1) {
 			if (mf->sealed == !!argp)
 				ret = -EALREADY;
 			else
@@ -305,6 +654,8 @@ kdbus_memfd_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			goto exit;
 		}
 
+		/* publish the content before the seal */
+		smp_wmb();
 		mf->sealed = !!argp;
 		break;
 	}
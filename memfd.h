@@ -15,8 +15,16 @@
 
 #include "internal.h"
 
+struct kdbus_memfd_cache;
+
+struct kdbus_memfd_cache *kdbus_memfd_cache_new(void);
+void kdbus_memfd_cache_disconnect(struct kdbus_memfd_cache *cache);
+void kdbus_memfd_cache_unref(struct kdbus_memfd_cache *cache);
+
 bool kdbus_is_memfd(const struct file *fp);
 bool kdbus_is_memfd_sealed(const struct file *fp);
 u64 kdbus_memfd_size(const struct file *fp);
-int kdbus_memfd_new(int *fd);
+struct file *kdbus_memfd_reopen(const struct file *fp);
+int kdbus_memfd_new(struct kdbus_memfd_cache *cache, u64 size, u64 flags,
+		    int *fd);
 #endif
@@ -25,6 +25,8 @@
 #include <linux/cred.h>
 #include <linux/capability.h>
 #include <linux/sizes.h>
+#include <linux/highmem.h>
+#include <linux/log2.h>
 
 #include "message.h"
 #include "connection.h"
@@ -73,10 +75,169 @@ static void __maybe_unused kdbus_msg_dump(const struct kdbus_msg *msg)
 	}
 }
 
+/*
+ * Most messages and their metadata are small; they come from dedicated
+ * caches instead of the generic kmalloc() size classes.
+ */
+static struct kmem_cache *kdbus_kmsg_cache;
+static struct kmem_cache *kdbus_kmsg_meta_cache;
+
+int kdbus_kmsg_cache_init(void)
+{
+	kdbus_kmsg_cache = kmem_cache_create("kdbus_kmsg",
+					     KDBUS_KMSG_HEADER_SIZE +
+					     KDBUS_KMSG_CACHED_SIZE,
+					     0, 0, NULL);
+	if (!kdbus_kmsg_cache)
+		return -ENOMEM;
+
+	kdbus_kmsg_meta_cache = kmem_cache_create("kdbus_kmsg_meta",
+						  KDBUS_KMSG_META_CACHED_SIZE,
+						  0, 0, NULL);
+	if (!kdbus_kmsg_meta_cache) {
+		kmem_cache_destroy(kdbus_kmsg_cache);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void kdbus_kmsg_cache_exit(void)
+{
+	kmem_cache_destroy(kdbus_kmsg_meta_cache);
+	kmem_cache_destroy(kdbus_kmsg_cache);
+}
+
+/* allocate a message of the given size, only the header is zeroed */
+static struct kdbus_kmsg *kdbus_kmsg_alloc(size_t msg_size)
+{
+	struct kdbus_kmsg *kmsg;
+	bool cached = msg_size <= KDBUS_KMSG_CACHED_SIZE;
+
+	if (cached)
+		kmsg = kmem_cache_alloc(kdbus_kmsg_cache, GFP_KERNEL);
+	else
+		kmsg = kmalloc(KDBUS_KMSG_HEADER_SIZE + msg_size, GFP_KERNEL);
+	if (!kmsg)
+		return NULL;
+
+	memset(kmsg, 0, KDBUS_KMSG_HEADER_SIZE);
+	kmsg->kmsg_cached = cached;
+
+	return kmsg;
+}
+
+static void kdbus_kmsg_meta_free(struct kdbus_kmsg *kmsg)
+{
+	if (!kmsg->meta)
+		return;
+
+	if (kmsg->meta_cached)
+		kmem_cache_free(kdbus_kmsg_meta_cache, kmsg->meta);
+	else
+		kfree(kmsg->meta);
+}
+
+static void kdbus_kmsg_free_vec_pages(struct kdbus_kmsg *kmsg)
+{
+	unsigned int i;
+
+	if (!kmsg->vec_pages)
+		return;
+
+	for (i = 0; i < kmsg->vec_pages_count; i++)
+		if (kmsg->vec_pages[i])
+			__free_page(kmsg->vec_pages[i]);
+
+	kfree(kmsg->vec_pages);
+	kmsg->vec_pages = NULL;
+	kmsg->vec_pages_count = 0;
+}
+
 void kdbus_kmsg_free(struct kdbus_kmsg *kmsg)
 {
-	kfree(kmsg->meta);
-	kfree(kmsg);
+	kdbus_kmsg_free_vec_pages(kmsg);
+	kdbus_kmsg_meta_free(kmsg);
+
+	if (kmsg->kmsg_cached)
+		kmem_cache_free(kdbus_kmsg_cache, kmsg);
+	else
+		kfree(kmsg);
+}
+
+/**
+ * kdbus_kmsg_stage_vecs() - copy the PAYLOAD_VEC data of the sender once
+ * @kmsg:	The message
+ *
+ * A message which is delivered to more than one receiver is copied from
+ * the sender's memory only once, into kernel pages; the pool of every
+ * receiver is filled from there. Every vec starts at a new page.
+ *
+ * Return: 0 on success, < 0 on failure, the message is left untouched
+ */
+int kdbus_kmsg_stage_vecs(struct kdbus_kmsg *kmsg)
+{
+	const struct kdbus_item *item;
+	unsigned int count = 0;
+	unsigned int i = 0;
+	int ret;
+
+	if (kmsg->vec_pages || kmsg->vecs_size == 0)
+		return 0;
+
+	KDBUS_PART_FOREACH(item, &kmsg->msg, items)
+		if (item->type == KDBUS_MSG_PAYLOAD_VEC &&
+		    KDBUS_PTR(item->vec.address))
+			count += DIV_ROUND_UP(item->vec.size, PAGE_SIZE);
+
+	if (count == 0)
+		return 0;
+
+	kmsg->vec_pages = kcalloc(count, sizeof(struct page *), GFP_KERNEL);
+	if (!kmsg->vec_pages)
+		return -ENOMEM;
+	kmsg->vec_pages_count = count;
+
+	KDBUS_PART_FOREACH(item, &kmsg->msg, items) {
+		const char __user *src;
+		size_t remain;
+
+		if (item->type != KDBUS_MSG_PAYLOAD_VEC)
+			continue;
+
+		src = KDBUS_PTR(item->vec.address);
+		if (!src)
+			continue;
+
+		for (remain = item->vec.size; remain > 0; i++) {
+			size_t n = min_t(size_t, remain, PAGE_SIZE);
+			unsigned long failed;
+			struct page *page;
+
+			page = alloc_page(GFP_KERNEL | __GFP_HIGHMEM);
+			if (!page) {
+				ret = -ENOMEM;
+				goto exit_free;
+			}
+			kmsg->vec_pages[i] = page;
+
+			failed = copy_from_user(kmap(page), src, n);
+			kunmap(page);
+			if (failed) {
+				ret = -EFAULT;
+				goto exit_free;
+			}
+
+			src += n;
+			remain -= n;
+		}
+	}
+
+	return 0;
+
+exit_free:
+	kdbus_kmsg_free_vec_pages(kmsg);
+	return ret;
 }
 
 int kdbus_kmsg_new(size_t extra_size, struct kdbus_kmsg **m)
@@ -85,9 +246,10 @@ int kdbus_kmsg_new(size_t extra_size, struct kdbus_kmsg **m)
 	struct kdbus_kmsg *kmsg;
 
 	size = sizeof(struct kdbus_kmsg) + KDBUS_ITEM_SIZE(extra_size);
-	kmsg = kzalloc(size, GFP_KERNEL);
+	kmsg = kdbus_kmsg_alloc(size - KDBUS_KMSG_HEADER_SIZE);
 	if (!kmsg)
 		return -ENOMEM;
+	memset(&kmsg->msg, 0, size - KDBUS_KMSG_HEADER_SIZE);
 
 	kmsg->msg.size = size - KDBUS_KMSG_HEADER_SIZE;
 	kmsg->msg.items[0].size = KDBUS_ITEM_SIZE(extra_size);
@@ -238,6 +400,10 @@ static int kdbus_msg_scan_items(struct kdbus_conn *conn, struct kdbus_kmsg *kmsg
 	if (has_name && has_bloom)
 		return -EBADMSG;
 
+	/* a method call is tracked until its reply or timeout */
+	if ((msg->flags & KDBUS_MSG_FLAGS_EXPECT_REPLY) && !msg->timeout_ns)
+		return -EINVAL;
+
 	return 0;
 }
 
@@ -246,7 +412,7 @@ int kdbus_kmsg_new_from_user(struct kdbus_conn *conn,
 			     struct kdbus_kmsg **m)
 {
 	struct kdbus_kmsg *kmsg;
-	u64 size, alloc_size;
+	u64 size;
 	int ret;
 
 	if (!KDBUS_IS_ALIGNED8((unsigned long)msg))
@@ -258,12 +424,9 @@ int kdbus_kmsg_new_from_user(struct kdbus_conn *conn,
 	if (size < sizeof(struct kdbus_msg) || size > KDBUS_MSG_MAX_SIZE)
 		return -EMSGSIZE;
 
-	alloc_size = size + KDBUS_KMSG_HEADER_SIZE;
-
-	kmsg = kmalloc(alloc_size, GFP_KERNEL);
+	kmsg = kdbus_kmsg_alloc(size);
 	if (!kmsg)
 		return -ENOMEM;
-	memset(kmsg, 0, KDBUS_KMSG_HEADER_SIZE);
 
 	if (copy_from_user(&kmsg->msg, msg, size)) {
 		ret = -EFAULT;
@@ -295,7 +458,14 @@ kdbus_kmsg_append(struct kdbus_kmsg *kmsg, size_t extra_size)
 	/* get new metadata buffer, pre-allocate at least 512 bytes */
 	if (!kmsg->meta) {
 		size = roundup_pow_of_two(256 + KDBUS_ALIGN8(extra_size));
-		kmsg->meta = kzalloc(size, GFP_KERNEL);
+		if (size <= KDBUS_KMSG_META_CACHED_SIZE) {
+			size = KDBUS_KMSG_META_CACHED_SIZE;
+			kmsg->meta = kmem_cache_zalloc(kdbus_kmsg_meta_cache,
+						       GFP_KERNEL);
+			kmsg->meta_cached = true;
+		} else {
+			kmsg->meta = kzalloc(size, GFP_KERNEL);
+		}
 		if (!kmsg->meta)
 			return ERR_PTR(-ENOMEM);
 
@@ -318,8 +488,14 @@ kdbus_kmsg_append(struct kdbus_kmsg *kmsg, size_t extra_size)
 		memcpy(meta, kmsg->meta, kmsg->meta_size);
 		memset((u8 *)meta + kmsg->meta_allocated_size, 0, size_diff);
 
-		kfree(kmsg->meta);
+		/* the short-cut points into the metadata buffer */
+		if (kmsg->src_names)
+			kmsg->src_names = (const char *)meta +
+				(kmsg->src_names - (const char *)kmsg->meta);
+
+		kdbus_kmsg_meta_free(kmsg);
 		kmsg->meta = meta;
+		kmsg->meta_cached = false;
 		kmsg->meta_allocated_size = size;
 
 	}
@@ -331,7 +507,44 @@ kdbus_kmsg_append(struct kdbus_kmsg *kmsg, size_t extra_size)
 	return item;
 }
 
-int kdbus_kmsg_append_timestamp(struct kdbus_kmsg *kmsg, u64 *now_ns)
+/* the KDBUS_HELLO_ATTACH_* flag a metadata item is attached for */
+static u64 kdbus_meta_item_flag(u64 type)
+{
+	switch (type) {
+	case KDBUS_MSG_SRC_TID_COMM:
+	case KDBUS_MSG_SRC_PID_COMM:
+		return KDBUS_HELLO_ATTACH_COMM;
+	case KDBUS_MSG_SRC_EXE:
+		return KDBUS_HELLO_ATTACH_EXE;
+	case KDBUS_MSG_SRC_CMDLINE:
+		return KDBUS_HELLO_ATTACH_CMDLINE;
+	case KDBUS_MSG_SRC_CAPS:
+		return KDBUS_HELLO_ATTACH_CAPS;
+	case KDBUS_MSG_SRC_CGROUP:
+		return KDBUS_HELLO_ATTACH_CGROUP;
+	case KDBUS_MSG_SRC_AUDIT:
+		return KDBUS_HELLO_ATTACH_AUDIT;
+	case KDBUS_MSG_SRC_SECLABEL:
+		return KDBUS_HELLO_ATTACH_SECLABEL;
+	case KDBUS_MSG_TIMESTAMP:
+		return KDBUS_HELLO_ATTACH_TIMESTAMP;
+	}
+
+	return 0;
+}
+
+static void kdbus_kmsg_meta_account(struct kdbus_kmsg *kmsg, u64 type,
+				    size_t size)
+{
+	u64 flag = kdbus_meta_item_flag(type);
+
+	if (flag)
+		kmsg->meta_attach_size[ilog2(flag) -
+				       KDBUS_META_ATTACH_SHIFT] += size;
+}
+
+/* the time the message is delivered to the first receiver asking for it */
+static int kdbus_kmsg_append_timestamp(struct kdbus_kmsg *kmsg)
 {
 	struct kdbus_item *item;
 	u64 size = KDBUS_ITEM_SIZE(sizeof(struct kdbus_timestamp));
@@ -350,12 +563,66 @@ int kdbus_kmsg_append_timestamp(struct kdbus_kmsg *kmsg, u64 *now_ns)
 	ktime_get_real_ts(&ts);
 	item->timestamp.realtime_ns = timespec_to_ns(&ts);
 
-	if (now_ns)
-		*now_ns = item->timestamp.monotonic_ns;
-
+	kdbus_kmsg_meta_account(kmsg, KDBUS_MSG_TIMESTAMP, size);
+	kmsg->meta_attached |= KDBUS_HELLO_ATTACH_TIMESTAMP;
 	return 0;
 }
 
+/**
+ * kdbus_kmsg_meta_size() - size of the metadata a receiver gets
+ * @kmsg:	The message
+ * @flags:	The KDBUS_HELLO_ATTACH_* flags of the receiver
+ *
+ * Return: the size of all metadata items, without the ones attached for
+ * a flag the receiver did not ask for
+ */
+size_t kdbus_kmsg_meta_size(const struct kdbus_kmsg *kmsg, u64 flags)
+{
+	u64 skip = kmsg->meta_attached & ~flags;
+	size_t size = kmsg->meta_size;
+	unsigned int i;
+
+	for (i = 0; skip && i < KDBUS_META_ATTACH_COUNT; i++)
+		if (skip & (1ULL << (KDBUS_META_ATTACH_SHIFT + i)))
+			size -= kmsg->meta_attach_size[i];
+
+	return size;
+}
+
+/**
+ * kdbus_kmsg_meta_write() - copy the metadata a receiver gets
+ * @kmsg:	The message
+ * @flags:	The KDBUS_HELLO_ATTACH_* flags of the receiver
+ * @buf:	The zeroed buffer of kdbus_kmsg_meta_size() bytes
+ */
+void kdbus_kmsg_meta_write(const struct kdbus_kmsg *kmsg, u64 flags,
+			   void *buf)
+{
+	u64 skip = kmsg->meta_attached & ~flags;
+	size_t off = 0;
+	size_t pos = 0;
+
+	if (!skip) {
+		memcpy(buf, kmsg->meta, kmsg->meta_size);
+		return;
+	}
+
+	while (off < kmsg->meta_size) {
+		const struct kdbus_item *item;
+		size_t size;
+
+		item = (const struct kdbus_item *)((u8 *)kmsg->meta + off);
+		size = KDBUS_ALIGN8(item->size);
+		off += size;
+
+		if (kdbus_meta_item_flag(item->type) & skip)
+			continue;
+
+		memcpy((u8 *)buf + pos, item, item->size);
+		pos += size;
+	}
+}
+
 static int kdbus_kmsg_append_data(struct kdbus_kmsg *kmsg, u64 type,
 				  const void *buf, size_t len)
 {
@@ -373,6 +640,7 @@ static int kdbus_kmsg_append_data(struct kdbus_kmsg *kmsg, u64 type,
 	item->type = type;
 	item->size = KDBUS_PART_HEADER_SIZE + len;
 	memcpy(item->data, buf, len);
+	kdbus_kmsg_meta_account(kmsg, type, size);
 
 	return 0;
 }
@@ -440,160 +708,345 @@ int kdbus_kmsg_append_cred(struct kdbus_kmsg *kmsg,
 	return 0;
 }
 
-int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
-			   struct kdbus_conn *conn_src,
-			   struct kdbus_conn *conn_dst)
+/*
+ * Copy the metadata items, which were collected for another message of the
+ * same sender, starting at offset 'off' of its metadata. Only the items
+ * requested by the receiver are copied, kdbus_kmsg_append_meta() adds the
+ * missing ones. The caller makes sure the sender did not change its
+ * credentials in the meantime.
+ */
+int kdbus_kmsg_copy_meta(struct kdbus_kmsg *kmsg,
+			 const struct kdbus_kmsg *from, size_t off,
+			 struct kdbus_conn *conn_dst)
 {
-	int ret = 0;
+	u64 want = conn_dst->flags & from->meta_attached & ~kmsg->meta_attached;
+	const struct kdbus_item *item;
 
-	if (!conn_src)
-		return 0;
+	/* the time is not the sender's, it is never copied */
+	want &= ~KDBUS_HELLO_ATTACH_TIMESTAMP;
 
-	/* all metadata already added */
-	if ((conn_dst->flags & kmsg->meta_attached) == conn_dst->flags)
+	if (!want)
 		return 0;
 
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_COMM) {
-		char comm[TASK_COMM_LEN];
+	while (off < from->meta_size) {
+		struct kdbus_item *copy;
 
-		get_task_comm(comm, current->group_leader);
-		ret = kdbus_kmsg_append_str(kmsg, KDBUS_MSG_SRC_TID_COMM, comm);
-		if (ret < 0)
-			return ret;
+		item = (const struct kdbus_item *)((u8 *)from->meta + off);
+		off += KDBUS_ALIGN8(item->size);
 
-		get_task_comm(comm, current);
-		ret = kdbus_kmsg_append_str(kmsg, KDBUS_MSG_SRC_PID_COMM, comm);
-		if (ret < 0)
-			return ret;
+		if (!(kdbus_meta_item_flag(item->type) & want))
+			continue;
 
-		kmsg->meta_attached |= KDBUS_HELLO_ATTACH_COMM;
+		copy = kdbus_kmsg_append(kmsg, item->size);
+		if (IS_ERR(copy))
+			return PTR_ERR(copy);
+
+		memcpy(copy, item, item->size);
+		kdbus_kmsg_meta_account(kmsg, item->type,
+					KDBUS_ALIGN8(item->size));
 	}
 
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_EXE) {
-		struct mm_struct *mm = get_task_mm(current);
-		struct path *exe_path = NULL;
+	kmsg->meta_attached |= want;
+	return 0;
+}
 
-		if (mm) {
-			down_read(&mm->mmap_sem);
-			if (mm->exe_file) {
-				path_get(&mm->exe_file->f_path);
-				exe_path = &mm->exe_file->f_path;
-			}
-			up_read(&mm->mmap_sem);
-			mmput(mm);
-		}
+void kdbus_meta_cache_init(struct kdbus_meta_cache *c)
+{
+	mutex_init(&c->lock);
+}
 
-		if (exe_path) {
-			char *tmp;
-			char *pathname;
-			size_t len;
+static void kdbus_meta_cache_drop(struct kdbus_meta_cache *c)
+{
+	kfree(c->exe);
+	kfree(c->cmdline);
+	c->exe = NULL;
+	c->cmdline = NULL;
+	c->exe_len = 0;
+	c->cmdline_len = 0;
+	c->valid = 0;
+
+	if (c->cred) {
+		put_cred(c->cred);
+		c->cred = NULL;
+	}
 
-			tmp = (char *) __get_free_page(GFP_TEMPORARY | __GFP_ZERO);
-			if (!tmp) {
-				path_put(exe_path);
-				return -ENOMEM;
-			}
+	put_pid(c->tgid);
+	c->tgid = NULL;
+}
 
-			pathname = d_path(exe_path, tmp, PAGE_SIZE);
-			if (!IS_ERR(pathname)) {
-				len = tmp + PAGE_SIZE - pathname;
-				ret = kdbus_kmsg_append_data(kmsg, KDBUS_MSG_SRC_EXE,
-							     pathname, len);
-			}
+void kdbus_meta_cache_free(struct kdbus_meta_cache *c)
+{
+	kdbus_meta_cache_drop(c);
+}
 
-			free_page((unsigned long) tmp);
-			path_put(exe_path);
+/*
+ * The snapshot is tied to the thread group, which shares the mm the
+ * executable and the command line come from, and to the credentials;
+ * the tgid and the credentials are pinned, so their addresses can not be
+ * reused while the snapshot exists. The threads of a process usually share
+ * their credentials, they all use the same snapshot.
+ */
+static void kdbus_meta_cache_update(struct kdbus_meta_cache *c)
+{
+	if (c->tgid == task_tgid(current) &&
+	    c->exec_id == current->self_exec_id &&
+	    c->cred == current_cred())
+		return;
 
-			if (ret < 0)
-				return ret;
-		}
+	kdbus_meta_cache_drop(c);
 
-		kmsg->meta_attached |= KDBUS_HELLO_ATTACH_EXE;
+	c->tgid = get_pid(task_tgid(current));
+	c->exec_id = current->self_exec_id;
+	c->cred = get_current_cred();
+	c->generation++;
+}
+
+static int kdbus_meta_cache_collect_exe(struct kdbus_meta_cache *c)
+{
+	struct mm_struct *mm = get_task_mm(current);
+	struct path *exe_path = NULL;
+	int ret = 0;
+
+	if (mm) {
+		down_read(&mm->mmap_sem);
+		if (mm->exe_file) {
+			path_get(&mm->exe_file->f_path);
+			exe_path = &mm->exe_file->f_path;
+		}
+		up_read(&mm->mmap_sem);
+		mmput(mm);
 	}
 
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_CMDLINE) {
-		struct mm_struct *mm = current->mm;
+	if (exe_path) {
 		char *tmp;
+		char *pathname;
 
 		tmp = (char *) __get_free_page(GFP_TEMPORARY | __GFP_ZERO);
-		if (!tmp)
+		if (!tmp) {
+			path_put(exe_path);
 			return -ENOMEM;
+		}
 
-		if (mm && mm->arg_end) {
-			size_t len = mm->arg_end - mm->arg_start;
-
-			if (len > PAGE_SIZE)
-				len = PAGE_SIZE;
+		pathname = d_path(exe_path, tmp, PAGE_SIZE);
+		if (!IS_ERR(pathname)) {
+			size_t len = tmp + PAGE_SIZE - pathname;
 
-			ret = copy_from_user(tmp, (const char __user *) mm->arg_start, len);
-			if (ret == 0)
-				ret = kdbus_kmsg_append_data(kmsg, KDBUS_MSG_SRC_CMDLINE,
-							     tmp, len);
+			c->exe = kmemdup(pathname, len, GFP_KERNEL);
+			if (c->exe)
+				c->exe_len = len;
+			else
+				ret = -ENOMEM;
 		}
 
 		free_page((unsigned long) tmp);
+		path_put(exe_path);
 
 		if (ret < 0)
 			return ret;
+	}
 
-		kmsg->meta_attached |= KDBUS_HELLO_ATTACH_CMDLINE;
+	c->valid |= KDBUS_HELLO_ATTACH_EXE;
+	return 0;
+}
+
+static int kdbus_meta_cache_collect_cmdline(struct kdbus_meta_cache *c)
+{
+	struct mm_struct *mm = current->mm;
+	size_t len;
+
+	if (mm && mm->arg_end) {
+		len = mm->arg_end - mm->arg_start;
+		if (len > PAGE_SIZE)
+			len = PAGE_SIZE;
+
+		c->cmdline = kmalloc(len, GFP_KERNEL);
+		if (!c->cmdline)
+			return -ENOMEM;
+
+		/* like before, a faulting command line is just left out */
+		if (copy_from_user(c->cmdline,
+				   (const char __user *) mm->arg_start, len)) {
+			kfree(c->cmdline);
+			c->cmdline = NULL;
+			return 0;
+		}
+		c->cmdline_len = len;
+	}
+
+	c->valid |= KDBUS_HELLO_ATTACH_CMDLINE;
+	return 0;
+}
+
+/* we always return a 4 elements, the element size is 1/4  */
+static void kdbus_meta_cache_collect_caps(struct kdbus_meta_cache *c)
+{
+	const struct cred *cred = c->cred;
+	unsigned int i;
+
+	for (i = 0; i < _KERNEL_CAPABILITY_U32S; i++) {
+		c->caps[0][i] = cred->cap_inheritable.cap[i];
+		c->caps[1][i] = cred->cap_permitted.cap[i];
+		c->caps[2][i] = cred->cap_effective.cap[i];
+		c->caps[3][i] = cred->cap_bset.cap[i];
+	}
+
+	/* clear unused bits */
+	for (i = 0; i < 4; i++)
+		c->caps[i][CAP_TO_INDEX(CAP_LAST_CAP)] &=
+			CAP_TO_MASK(CAP_LAST_CAP + 1) - 1;
+
+	c->valid |= KDBUS_HELLO_ATTACH_CAPS;
+}
+
+#ifdef CONFIG_CGROUPS
+/*
+ * The path of the one group hierarchy specified for the bus. A thread can
+ * move to another cgroup at any time and its css_set can not be pinned
+ * from here, so the path is not kept in the snapshot; it is looked up
+ * once per message.
+ */
+static int kdbus_kmsg_append_cgroup(struct kdbus_kmsg *kmsg)
+{
+	char *tmp;
+	int ret;
+
+	tmp = (char *) __get_free_page(GFP_TEMPORARY | __GFP_ZERO);
+	if (!tmp)
+		return -ENOMEM;
+
+	ret = task_cgroup_path(current, tmp, PAGE_SIZE);
+	if (ret >= 0)
+		ret = kdbus_kmsg_append_str(kmsg, KDBUS_MSG_SRC_CGROUP, tmp);
+
+	free_page((unsigned long) tmp);
+
+	if (ret < 0)
+		return ret;
+
+	kmsg->meta_attached |= KDBUS_HELLO_ATTACH_CGROUP;
+	return 0;
+}
+#endif
+
+#define KDBUS_META_CACHED	(KDBUS_HELLO_ATTACH_EXE |	\
+				 KDBUS_HELLO_ATTACH_CMDLINE |	\
+				 KDBUS_HELLO_ATTACH_CAPS)
+
+/*
+ * Append the metadata kept in the snapshot of the sender; it is only
+ * collected when a receiver asks for it the first time.
+ */
+static int kdbus_kmsg_append_cached_meta(struct kdbus_kmsg *kmsg,
+					 struct kdbus_meta_cache *c,
+					 u64 missing)
+{
+	int ret = 0;
+
+	mutex_lock(&c->lock);
+	kdbus_meta_cache_update(c);
+
+	if (missing & KDBUS_HELLO_ATTACH_EXE) {
+		if (!(c->valid & KDBUS_HELLO_ATTACH_EXE)) {
+			ret = kdbus_meta_cache_collect_exe(c);
+			if (ret < 0)
+				goto exit_unlock;
+		}
+
+		ret = kdbus_kmsg_append_data(kmsg, KDBUS_MSG_SRC_EXE,
+					     c->exe, c->exe_len);
+		if (ret < 0)
+			goto exit_unlock;
+
+		kmsg->meta_attached |= KDBUS_HELLO_ATTACH_EXE;
 	}
 
-	/* we always return a 4 elements, the element size is 1/4  */
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_CAPS) {
-		const struct cred *cred;
-		struct caps {
-			u32 cap[_KERNEL_CAPABILITY_U32S];
-		} cap[4];
-		unsigned int i;
-
-		rcu_read_lock();
-		cred = __task_cred(current);
-		for (i = 0; i < _KERNEL_CAPABILITY_U32S; i++) {
-			cap[0].cap[i] = cred->cap_inheritable.cap[i];
-			cap[1].cap[i] = cred->cap_permitted.cap[i];
-			cap[2].cap[i] = cred->cap_effective.cap[i];
-			cap[3].cap[i] = cred->cap_bset.cap[i];
+	if (missing & KDBUS_HELLO_ATTACH_CMDLINE) {
+		if (!(c->valid & KDBUS_HELLO_ATTACH_CMDLINE)) {
+			ret = kdbus_meta_cache_collect_cmdline(c);
+			if (ret < 0)
+				goto exit_unlock;
 		}
-		rcu_read_unlock();
 
-		/* clear unused bits */
-		for (i = 0; i < 4; i++)
-			cap[i].cap[CAP_TO_INDEX(CAP_LAST_CAP)] &=
-				CAP_TO_MASK(CAP_LAST_CAP + 1) - 1;
+		ret = kdbus_kmsg_append_data(kmsg, KDBUS_MSG_SRC_CMDLINE,
+					     c->cmdline, c->cmdline_len);
+		if (ret < 0)
+			goto exit_unlock;
+
+		kmsg->meta_attached |= KDBUS_HELLO_ATTACH_CMDLINE;
+	}
+
+	if (missing & KDBUS_HELLO_ATTACH_CAPS) {
+		if (!(c->valid & KDBUS_HELLO_ATTACH_CAPS))
+			kdbus_meta_cache_collect_caps(c);
 
 		ret = kdbus_kmsg_append_data(kmsg, KDBUS_MSG_SRC_CAPS,
-					     cap, sizeof(cap));
+					     c->caps, sizeof(c->caps));
 		if (ret < 0)
-			return ret;
+			goto exit_unlock;
 
 		kmsg->meta_attached |= KDBUS_HELLO_ATTACH_CAPS;
 	}
 
-#ifdef CONFIG_CGROUPS
-	/* attach the path of the one group hierarchy specified for the bus */
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_CGROUP) {
-		char *tmp;
+exit_unlock:
+	mutex_unlock(&c->lock);
+	return ret;
+}
 
-		tmp = (char *) __get_free_page(GFP_TEMPORARY | __GFP_ZERO);
-		if (!tmp)
-			return -ENOMEM;
+int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
+			   struct kdbus_conn *conn_src,
+			   struct kdbus_conn *conn_dst)
+{
+	u64 missing;
+	int ret = 0;
 
-		ret = task_cgroup_path(current, tmp, PAGE_SIZE);
-		if (ret >= 0)
-			ret = kdbus_kmsg_append_str(kmsg, KDBUS_MSG_SRC_CGROUP, tmp);
+	/* all metadata already added */
+	missing = conn_dst->flags & ~kmsg->meta_attached;
+	if (!missing)
+		return 0;
 
-		free_page((unsigned long) tmp);
+	/* kernel notifications get the timestamp only */
+	if (missing & KDBUS_HELLO_ATTACH_TIMESTAMP) {
+		ret = kdbus_kmsg_append_timestamp(kmsg);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (!conn_src)
+		return 0;
 
+	if (missing & KDBUS_HELLO_ATTACH_COMM) {
+		char comm[TASK_COMM_LEN];
+
+		get_task_comm(comm, current->group_leader);
+		ret = kdbus_kmsg_append_str(kmsg, KDBUS_MSG_SRC_TID_COMM, comm);
 		if (ret < 0)
 			return ret;
 
-		kmsg->meta_attached |= KDBUS_HELLO_ATTACH_CGROUP;
+		get_task_comm(comm, current);
+		ret = kdbus_kmsg_append_str(kmsg, KDBUS_MSG_SRC_PID_COMM, comm);
+		if (ret < 0)
+			return ret;
+
+		kmsg->meta_attached |= KDBUS_HELLO_ATTACH_COMM;
+	}
+
+	if (missing & KDBUS_META_CACHED) {
+		ret = kdbus_kmsg_append_cached_meta(kmsg, &conn_src->meta_cache,
+						    missing & KDBUS_META_CACHED);
+		if (ret < 0)
+			return ret;
+	}
+
+#ifdef CONFIG_CGROUPS
+	if (missing & KDBUS_HELLO_ATTACH_CGROUP) {
+		ret = kdbus_kmsg_append_cgroup(kmsg);
+		if (ret < 0)
+			return ret;
 	}
 #endif
 
 #ifdef CONFIG_AUDITSYSCALL
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_AUDIT) {
+	if (missing & KDBUS_HELLO_ATTACH_AUDIT) {
 		ret = kdbus_kmsg_append_data(kmsg, KDBUS_MSG_SRC_AUDIT,
 					     conn_src->audit_ids,
 					     sizeof(conn_src->audit_ids));
@@ -605,7 +1058,7 @@ int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
 #endif
 
 #ifdef CONFIG_SECURITY
-	if (conn_dst->flags & KDBUS_HELLO_ATTACH_SECLABEL) {
+	if (missing & KDBUS_HELLO_ATTACH_SECLABEL) {
 		if (conn_src->sec_label_len > 0) {
 			ret = kdbus_kmsg_append_data(kmsg,
 						     KDBUS_MSG_SRC_SECLABEL,
@@ -12,8 +12,45 @@
 #ifndef __KDBUS_MESSAGE_H
 #define __KDBUS_MESSAGE_H
 
+#include <linux/capability.h>
+#include <linux/mutex.h>
+
 #include "internal.h"
 
+/*
+ * Metadata of the sending process, which is expensive to collect, is kept
+ * on the connection; the snapshot belongs to one thread group and stays
+ * valid until the process executes a new program or the sending thread
+ * has different credentials. The command line is read at the time of the
+ * snapshot, later changes of the argument area by the task itself are not
+ * seen.
+ */
+struct kdbus_meta_cache {
+	struct mutex lock;
+	unsigned int generation;	/* bumped for every new snapshot */
+
+	/* the process state the snapshot was taken from */
+	struct pid *tgid;
+	u32 exec_id;
+	const struct cred *cred;
+
+	/* KDBUS_HELLO_ATTACH_* flags of the collected data */
+	u64 valid;
+	char *exe;
+	size_t exe_len;
+	char *cmdline;
+	size_t cmdline_len;
+	u32 caps[4][_KERNEL_CAPABILITY_U32S];
+};
+
+/* messages and metadata up to this size are allocated from a cache */
+#define KDBUS_KMSG_CACHED_SIZE		SZ_1K
+#define KDBUS_KMSG_META_CACHED_SIZE	512
+
+/* KDBUS_HELLO_ATTACH_COMM to KDBUS_HELLO_ATTACH_TIMESTAMP */
+#define KDBUS_META_ATTACH_SHIFT		10
+#define KDBUS_META_ATTACH_COUNT		8
+
 struct kdbus_kmsg {
 	/* short-cuts for faster lookup */
 	u64 notification_type;
@@ -30,25 +67,46 @@ struct kdbus_kmsg {
 	size_t meta_size;
 	size_t meta_allocated_size;
 
+	/* allocated from the kmsg and the metadata caches */
+	bool kmsg_cached;
+	bool meta_cached;
+
 	/* size of PAYLOAD data */
 	size_t vecs_size;
 	unsigned int vecs_count;
 	unsigned int memfds_count;
 
-	/* added metadata flags KDBUS_HELLO_ATTACH_* */
+	/* added metadata flags KDBUS_HELLO_ATTACH_*, and the size of the
+	 * items of every flag, to copy only the ones a receiver asked for */
 	u64 meta_attached;
+	size_t meta_attach_size[KDBUS_META_ATTACH_COUNT];
+
+	/* PAYLOAD_VEC data copied from the sender, every vec starts at a
+	 * new page; used to deliver a broadcast to its receivers */
+	struct page **vec_pages;
+	unsigned int vec_pages_count;
+
+	/* kernel notifications collected by one operation */
+	struct list_head notify_entry;
 
 	struct kdbus_msg msg;
 };
 
 struct kdbus_ep;
+struct page;
 struct kdbus_conn;
 
+int kdbus_kmsg_cache_init(void);
+void kdbus_kmsg_cache_exit(void);
+
 int kdbus_kmsg_new(size_t extra_size, struct kdbus_kmsg **m);
 int kdbus_kmsg_new_from_user(struct kdbus_conn *conn, struct kdbus_msg __user *msg, struct kdbus_kmsg **m);
 void kdbus_kmsg_free(struct kdbus_kmsg *kmsg);
+int kdbus_kmsg_stage_vecs(struct kdbus_kmsg *kmsg);
+
+void kdbus_meta_cache_init(struct kdbus_meta_cache *c);
+void kdbus_meta_cache_free(struct kdbus_meta_cache *c);
 
-int kdbus_kmsg_append_timestamp(struct kdbus_kmsg *kmsg, u64 *now_ns);
 int kdbus_kmsg_append_src_names(struct kdbus_kmsg *kmsg,
 				struct kdbus_conn *conn);
 int kdbus_kmsg_append_cred(struct kdbus_kmsg *kmsg,
@@ -56,4 +114,10 @@ int kdbus_kmsg_append_cred(struct kdbus_kmsg *kmsg,
 int kdbus_kmsg_append_meta(struct kdbus_kmsg *kmsg,
 			   struct kdbus_conn *conn_src,
 			   struct kdbus_conn *conn_dst);
+size_t kdbus_kmsg_meta_size(const struct kdbus_kmsg *kmsg, u64 flags);
+void kdbus_kmsg_meta_write(const struct kdbus_kmsg *kmsg, u64 flags,
+			   void *buf);
+int kdbus_kmsg_copy_meta(struct kdbus_kmsg *kmsg,
+			 const struct kdbus_kmsg *from, size_t off,
+			 struct kdbus_conn *conn_dst);
 #endif
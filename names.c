@@ -23,6 +23,7 @@
 #include <linux/hash.h>
 #include <linux/uaccess.h>
 #include <linux/ctype.h>
+#include <linux/rcupdate.h>
 
 #include "names.h"
 #include "connection.h"
@@ -39,11 +40,12 @@ struct kdbus_name_queue_item {
 	struct list_head	 conn_entry;
 };
 
-static void kdbus_name_entry_free(struct kdbus_name_entry *e)
+static void kdbus_name_entry_free(struct kdbus_name_registry *reg,
+				  struct kdbus_name_entry *e)
 {
-	hash_del(&e->hentry);
-	kfree(e->name);
-	kfree(e);
+	idr_remove(&reg->entries_idr, e->id);
+	kdbus_hash_del(&reg->entries_hash, &e->hentry);
+	kfree_rcu(e, rcu);
 }
 
 static void __kdbus_name_registry_free(struct kref *kref)
@@ -55,10 +57,14 @@ static void __kdbus_name_registry_free(struct kref *kref)
 	unsigned int i;
 
 	mutex_lock(&reg->entries_lock);
-	hash_for_each_safe(reg->entries_hash, i, tmp, e, hentry)
-		kdbus_name_entry_free(e);
+	kdbus_hash_for_each_safe(&reg->entries_hash, i, tmp, e, hentry) {
+		__kdbus_hash_del(&reg->entries_hash, &e->hentry);
+		kfree_rcu(e, rcu);
+	}
 	mutex_unlock(&reg->entries_lock);
 
+	idr_destroy(&reg->entries_idr);
+	kdbus_hash_cleanup(&reg->entries_hash);
 	kfree(reg);
 }
 
@@ -75,8 +81,13 @@ struct kdbus_name_registry *kdbus_name_registry_new(void)
 	if (!reg)
 		return NULL;
 
+	if (kdbus_hash_init(&reg->entries_hash, 6) < 0) {
+		kfree(reg);
+		return NULL;
+	}
+
 	kref_init(&reg->kref);
-	hash_init(reg->entries_hash);
+	idr_init(&reg->entries_idr);
 	mutex_init(&reg->entries_lock);
 
 	return reg;
@@ -88,7 +99,7 @@ __kdbus_name_lookup(struct kdbus_name_registry *reg,
 {
 	struct kdbus_name_entry *e;
 
-	hash_for_each_possible(reg->entries_hash, e, hentry, hash)
+	kdbus_hash_for_each_possible(&reg->entries_hash, e, hentry, hash)
 		if (strcmp(e->name, name) == 0)
 			return e;
 
@@ -102,34 +113,64 @@ static void kdbus_name_queue_item_free(struct kdbus_name_queue_item *q)
 	kfree(q);
 }
 
+/*
+ * The generations are unique across all connections, the policy caches
+ * the access bits of the names of a connection by it. All connections
+ * without a name share the generation 0.
+ */
+static atomic_t kdbus_name_generation = ATOMIC_INIT(0);
+
+/* the caller holds names_lock */
+static void kdbus_name_generation_update(struct kdbus_conn *conn)
+{
+	if (list_empty(&conn->names_list))
+		conn->names_generation = 0;
+	else
+		conn->names_generation =
+			atomic_inc_return(&kdbus_name_generation);
+}
+
 static void kdbus_name_entry_detach(struct kdbus_name_entry *e)
 {
+	struct kdbus_conn *conn = e->conn;
+
+	mutex_lock(&conn->names_lock);
 	list_del(&e->conn_entry);
+	kdbus_name_generation_update(conn);
+	mutex_unlock(&conn->names_lock);
 }
 
 static void kdbus_name_entry_attach(struct kdbus_name_entry *e,
 				    struct kdbus_conn *conn)
 {
 	e->conn = conn;
-	list_add_tail(&e->conn_entry, &e->conn->names_list);
+
+	mutex_lock(&conn->names_lock);
+	list_add_tail(&e->conn_entry, &conn->names_list);
+	kdbus_name_generation_update(conn);
+	mutex_unlock(&conn->names_lock);
 }
 
-static void kdbus_name_entry_release(struct kdbus_name_entry *e)
+static void kdbus_name_entry_release(struct kdbus_name_registry *reg,
+				     struct kdbus_name_entry *e,
+				     struct list_head *notify_list)
 {
 	struct kdbus_name_queue_item *q;
 
+	reg->generation++;
 	kdbus_name_entry_detach(e);
 
 	if (list_empty(&e->queue_list)) {
 		if (e->starter) {
-			kdbus_notify_name_change(e->conn->ep, KDBUS_MSG_NAME_CHANGE,
+			kdbus_notify_name_change(KDBUS_MSG_NAME_CHANGE,
 						 e->conn->id, e->starter->id,
-						 e->flags, e->name);
+						 e->flags, e->name, notify_list);
 			e->conn = e->starter;
 		} else {
-			kdbus_notify_name_change(e->conn->ep, KDBUS_MSG_NAME_REMOVE,
-						 e->conn->id, 0, e->flags, e->name);
-			kdbus_name_entry_free(e);
+			kdbus_notify_name_change(KDBUS_MSG_NAME_REMOVE,
+						 e->conn->id, 0, e->flags,
+						 e->name, notify_list);
+			kdbus_name_entry_free(reg, e);
 		}
 	} else {
 		struct kdbus_conn *old_conn = e->conn;
@@ -140,47 +181,77 @@ static void kdbus_name_entry_release(struct kdbus_name_entry *e)
 		e->flags = q->flags;
 		kdbus_name_entry_attach(e, q->conn);
 		kdbus_name_queue_item_free(q);
-		kdbus_notify_name_change(old_conn->ep, KDBUS_MSG_NAME_CHANGE,
-				old_conn->id, e->conn->id, e->flags, e->name);
+		kdbus_notify_name_change(KDBUS_MSG_NAME_CHANGE,
+					 old_conn->id, e->conn->id, e->flags,
+					 e->name, notify_list);
 	}
 }
 
+/* the notifications are added to notify_list, for the caller to send
+ * them together with the other ones of the disconnect */
 void kdbus_name_remove_by_conn(struct kdbus_name_registry *reg,
-			       struct kdbus_conn *conn)
+			       struct kdbus_conn *conn,
+			       struct list_head *notify_list)
 {
 	struct kdbus_name_entry *e_tmp, *e;
 	struct kdbus_name_queue_item *q_tmp, *q;
 
+	/* the names are detached one by one, under names_lock */
 	mutex_lock(&reg->entries_lock);
-	mutex_lock(&conn->names_lock);
 
 	list_for_each_entry_safe(q, q_tmp, &conn->names_queue_list, conn_entry)
 		kdbus_name_queue_item_free(q);
 
 	list_for_each_entry_safe(e, e_tmp, &conn->names_list, conn_entry)
-		kdbus_name_entry_release(e);
+		kdbus_name_entry_release(reg, e, notify_list);
 
-	mutex_unlock(&conn->names_lock);
 	mutex_unlock(&reg->entries_lock);
 }
 
-struct kdbus_name_entry *kdbus_name_lookup(struct kdbus_name_registry *reg,
-					   const char *name)
+/**
+ * kdbus_name_lookup_conn() - find and pin the current owner of a name
+ * @reg:	The name registry
+ * @name:	The well-known name to look up
+ *
+ * This does not take the entries lock; the owner is read under RCU and
+ * only returned if it is still alive.
+ *
+ * Return: the owning connection with an additional reference, or NULL
+ */
+struct kdbus_conn *kdbus_name_lookup_conn(struct kdbus_name_registry *reg,
+					  const char *name)
 {
-	struct kdbus_name_entry *e = NULL;
+	struct kdbus_name_entry *e;
+	struct kdbus_conn *c, *conn = NULL;
+	struct kdbus_hash_table *t;
 	u32 hash = kdbus_str_hash(name);
+	unsigned int seq;
+
+	rcu_read_lock();
+	do {
+		seq = kdbus_hash_read_begin(&reg->entries_hash, &t);
+		kdbus_hash_for_each_possible_rcu(t, e, hentry, hash) {
+			if (strcmp(e->name, name) != 0)
+				continue;
+
+			c = ACCESS_ONCE(e->conn);
+			if (c && kref_get_unless_zero(&c->kref))
+				conn = c;
+			goto exit_unlock;
+		}
+	} while (kdbus_hash_read_retry(&reg->entries_hash, seq));
 
-	mutex_lock(&reg->entries_lock);
-	e = __kdbus_name_lookup(reg, hash, name);
-	mutex_unlock(&reg->entries_lock);
+exit_unlock:
+	rcu_read_unlock();
 
-	return e;
+	return conn;
 }
 
 /* called with entries_lock held! */
 static int kdbus_name_handle_conflict(struct kdbus_name_registry *reg,
 				      struct kdbus_conn *conn,
-				      struct kdbus_name_entry *e, u64 *flags)
+				      struct kdbus_name_entry *e, u64 *flags,
+				      struct list_head *notify_list)
 {
 	if (conn->flags & KDBUS_HELLO_STARTER) {
 		if (e->starter == NULL) {
@@ -194,12 +265,14 @@ static int kdbus_name_handle_conflict(struct kdbus_name_registry *reg,
 	if (((*flags   & KDBUS_NAME_REPLACE_EXISTING) &&
 	     (e->flags & KDBUS_NAME_ALLOW_REPLACEMENT)) ||
 	     (e->starter && e->starter != conn)) {
+		u64 old_id = e->conn->id;
+
 		kdbus_name_entry_detach(e);
 		kdbus_name_entry_attach(e, conn);
 
-		return kdbus_notify_name_change(conn->ep, KDBUS_MSG_NAME_CHANGE,
-						e->conn->id, conn->id, *flags,
-						e->name);
+		return kdbus_notify_name_change(KDBUS_MSG_NAME_CHANGE,
+						old_id, conn->id, *flags,
+						e->name, notify_list);
 	}
 
 	if (*flags & KDBUS_NAME_QUEUE) {
@@ -264,7 +337,9 @@ int kdbus_cmd_name_acquire(struct kdbus_name_registry *reg,
 			   void __user *buf)
 {
 	struct kdbus_name_entry *e = NULL;
+	struct kdbus_conn *new_conn = NULL;
 	struct kdbus_cmd_name *cmd_name;
+	LIST_HEAD(notify_list);
 	u64 size;
 	u32 hash;
 	int ret = 0;
@@ -280,20 +355,24 @@ int kdbus_cmd_name_acquire(struct kdbus_name_registry *reg,
 	if (IS_ERR(cmd_name))
 		return PTR_ERR(cmd_name);
 
-	if (!kdbus_name_is_valid(cmd_name->name))
-		return -EINVAL;
+	if (!kdbus_name_is_valid(cmd_name->name)) {
+		ret = -EINVAL;
+		goto exit_free;
+	}
 
 	/* privileged users can act on behalf of someone else */
 	if (cmd_name->id > 0) {
-		struct kdbus_conn *new_conn;
-
 		new_conn = kdbus_bus_find_conn_by_id(conn->ep->bus, cmd_name->id);
-		if (!new_conn)
-			return -ENXIO;
+		if (!new_conn) {
+			ret = -ENXIO;
+			goto exit_free;
+		}
 
 		if (conn->creds.uid != new_conn->creds.uid &&
-		    !kdbus_bus_uid_is_privileged(conn->ep->bus))
-			return -EPERM;
+		    !kdbus_bus_uid_is_privileged(conn->ep->bus)) {
+			ret = -EPERM;
+			goto exit_free;
+		}
 
 		conn = new_conn;
 	}
@@ -305,7 +384,7 @@ int kdbus_cmd_name_acquire(struct kdbus_name_registry *reg,
 		ret = kdbus_policy_db_check_own_access(conn->ep->policy_db,
 						       conn, cmd_name->name);
 		if (ret < 0)
-			return ret;
+			goto exit_free;
 	}
 
 	mutex_lock(&reg->entries_lock);
@@ -316,7 +395,8 @@ int kdbus_cmd_name_acquire(struct kdbus_name_registry *reg,
 			e->flags = cmd_name->flags;
 		} else {
 			ret = kdbus_name_handle_conflict(reg, conn, e,
-							 &cmd_name->flags);
+							 &cmd_name->flags,
+							 &notify_list);
 			if (ret < 0)
 				goto exit_unlock;
 		}
@@ -324,17 +404,21 @@ int kdbus_cmd_name_acquire(struct kdbus_name_registry *reg,
 		goto exit_copy;
 	}
 
-	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	e = kzalloc(sizeof(*e) + strlen(cmd_name->name) + 1, GFP_KERNEL);
 	if (!e) {
 		ret = -ENOMEM;
-		goto exit_unlock_free;
+		goto exit_unlock;
 	}
 
-	e->name = kstrdup(cmd_name->name, GFP_KERNEL);
-	if (!e->name) {
-		ret = -ENOMEM;
-		goto exit_unlock_free;
+	strcpy(e->name, cmd_name->name);
+
+	ret = idr_alloc_cyclic(&reg->entries_idr, e, 1, 0, GFP_KERNEL);
+	if (ret < 0) {
+		kfree(e);
+		goto exit_unlock;
 	}
+	e->id = ret;
+	ret = 0;
 
 	if (conn->flags & KDBUS_HELLO_STARTER)
 		e->starter = conn;
@@ -343,28 +427,31 @@ int kdbus_cmd_name_acquire(struct kdbus_name_registry *reg,
 	INIT_LIST_HEAD(&e->queue_list);
 	INIT_LIST_HEAD(&e->conn_entry);
 
-	hash_add(reg->entries_hash, &e->hentry, hash);
+	/* lockless readers must never see an entry without an owner */
 	kdbus_name_entry_attach(e, conn);
+	kdbus_hash_add(&reg->entries_hash, &e->hentry, hash);
 
 exit_copy:
+	reg->generation++;
+
 	if (copy_to_user(buf, cmd_name, size)) {
 		ret = -EFAULT;
-		goto exit_unlock_free;
+		if (e->conn == conn)
+			kdbus_name_entry_release(reg, e, &notify_list);
+		goto exit_unlock;
 	}
 
-	kdbus_notify_name_change(e->conn->ep, KDBUS_MSG_NAME_ADD, 0,
-				 e->conn->id, e->flags, e->name);
+	kdbus_notify_name_change(KDBUS_MSG_NAME_ADD, 0, e->conn->id,
+				 e->flags, e->name, &notify_list);
 
-	kfree(cmd_name);
+exit_unlock:
 	mutex_unlock(&reg->entries_lock);
-	return 0;
+	kdbus_notify_flush(conn->ep, &notify_list);
 
-exit_unlock_free:
+exit_free:
+	if (new_conn)
+		kdbus_conn_unref(new_conn);
 	kfree(cmd_name);
-	kdbus_name_entry_release(e);
-
-exit_unlock:
-	mutex_unlock(&reg->entries_lock);
 	return ret;
 }
 
@@ -374,6 +461,7 @@ int kdbus_cmd_name_release(struct kdbus_name_registry *reg,
 {
 	struct kdbus_name_entry *e;
 	struct kdbus_cmd_name *cmd_name;
+	LIST_HEAD(notify_list);
 	u64 size;
 	u32 hash;
 	int ret = 0;
@@ -401,67 +489,200 @@ int kdbus_cmd_name_release(struct kdbus_name_registry *reg,
 	else if (e->conn != conn)
 		ret = -EPERM;
 	else
-		kdbus_name_entry_release(e);
+		kdbus_name_entry_release(reg, e, &notify_list);
 	mutex_unlock(&reg->entries_lock);
 
+	kdbus_notify_flush(conn->ep, &notify_list);
+
 	kfree(cmd_name);
 
 	return ret;
 }
 
+/*
+ * The names are listed in chunks; the registry lock is only held while
+ * a chunk is collected, not while it is copied to the caller.
+ */
+#define KDBUS_NAME_LIST_CHUNK		PAGE_SIZE
+#define KDBUS_NAME_LIST_SCAN		256
+
+/* the size of the complete list, in struct kdbus_cmd_names */
+static u64 kdbus_name_list_size(struct kdbus_name_registry *reg)
+{
+	struct kdbus_name_entry *e;
+	u64 size = sizeof(struct kdbus_cmd_names);
+	int id = 0;
+
+	do {
+		unsigned int scanned = 0;
+
+		mutex_lock(&reg->entries_lock);
+		while (scanned++ < KDBUS_NAME_LIST_SCAN &&
+		       (e = idr_get_next(&reg->entries_idr, &id))) {
+			size += KDBUS_ALIGN8(sizeof(struct kdbus_cmd_name) +
+					     strlen(e->name) + 1);
+			id++;
+		}
+		mutex_unlock(&reg->entries_lock);
+	} while (e);
+
+	return size;
+}
+
+/**
+ * kdbus_cmd_name_list() - list the well-known names of the registry
+ * @reg:	The name registry
+ * @conn:	The connection asking
+ * @buf:	The struct kdbus_cmd_name_list or struct kdbus_cmd_names
+ * @cursor:	KDBUS_CMD_NAME_LIST_CURSOR: the list may be returned in
+ *		pieces; otherwise the complete list or -ENOBUFS is returned
+ *
+ * Return: 0 on success, negative errno on failure
+ */
 int kdbus_cmd_name_list(struct kdbus_name_registry *reg,
 			struct kdbus_conn *conn,
-			void __user *buf)
+			void __user *buf, bool cursor)
 {
-	struct kdbus_cmd_names *cmd_names = NULL;
-	struct kdbus_cmd_name *cmd_name;
-	struct kdbus_name_entry *e;
-	u64 user_size, size = 0, tmp;
+	struct kdbus_cmd_name_list cmd;
+	struct kdbus_name_entry *e = NULL;
+	size_t head_size;
+	char *prefix = NULL;
+	size_t prefix_len = 0;
+	u64 pos, generation;
+	u64 need = 0;
+	bool full = false;
+	u8 *chunk;
+	int id;
 	int ret = 0;
 
-	if (kdbus_size_get_user(&user_size, buf, struct kdbus_cmd_names))
-		return -EFAULT;
-
-	mutex_lock(&reg->entries_lock);
+	memset(&cmd, 0, sizeof(cmd));
+	if (cursor) {
+		head_size = sizeof(struct kdbus_cmd_name_list);
+		if (copy_from_user(&cmd, buf, sizeof(cmd)))
+			return -EFAULT;
+	} else {
+		head_size = sizeof(struct kdbus_cmd_names);
+		if (kdbus_size_get_user(&cmd.size, buf,
+					struct kdbus_cmd_names))
+			return -EFAULT;
+	}
 
-	size = sizeof(struct kdbus_cmd_names);
+	if (cmd.size < head_size)
+		return -EINVAL;
 
-	hash_for_each(reg->entries_hash, tmp, e, hentry)
-		size += KDBUS_ALIGN8(sizeof(struct kdbus_cmd_name) +
-				     strlen(e->name) + 1);
+	if (cmd.cursor > INT_MAX)
+		return -EINVAL;
 
-	if (size > user_size) {
-		kdbus_size_set_user(&size, buf, struct kdbus_cmd_names);
-		ret = -ENOBUFS;
-		goto exit_unlock;
+	if (cmd.prefix) {
+		prefix = strndup_user(KDBUS_PTR(cmd.prefix),
+				      KDBUS_NAME_MAX_LEN + 1);
+		if (IS_ERR(prefix))
+			return PTR_ERR(prefix);
+		prefix_len = strlen(prefix);
 	}
 
-	cmd_names = kzalloc(size, GFP_KERNEL);
-	if (!cmd_names) {
+	chunk = kmalloc(KDBUS_NAME_LIST_CHUNK, GFP_KERNEL);
+	if (!chunk) {
 		ret = -ENOMEM;
-		goto exit_unlock;
+		goto exit_free;
+	}
+
+	mutex_lock(&reg->entries_lock);
+	generation = reg->generation;
+	mutex_unlock(&reg->entries_lock);
+
+	/* nothing changed since the last complete listing */
+	if ((cmd.flags & KDBUS_NAME_LIST_IF_CHANGED) && cmd.cursor == 0 &&
+	    cmd.generation == generation) {
+		ret = -EALREADY;
+		goto exit_free;
 	}
 
-	cmd_names->size = size;
-	cmd_name = cmd_names->names;
+	pos = head_size;
+	id = cmd.cursor;
+
+	do {
+		size_t chunk_size = 0;
+		unsigned int scanned = 0;
+
+		mutex_lock(&reg->entries_lock);
+		while (scanned++ < KDBUS_NAME_LIST_SCAN &&
+		       (e = idr_get_next(&reg->entries_idr, &id))) {
+			struct kdbus_cmd_name *cmd_name;
+			size_t len;
+
+			if (prefix && strncmp(e->name, prefix, prefix_len)) {
+				id++;
+				continue;
+			}
+
+			len = sizeof(struct kdbus_cmd_name) +
+			      strlen(e->name) + 1;
+
+			if (pos + chunk_size + KDBUS_ALIGN8(len) > cmd.size) {
+				need = head_size + KDBUS_ALIGN8(len);
+				full = true;
+				break;
+			}
+
+			if (chunk_size + KDBUS_ALIGN8(len) >
+			    KDBUS_NAME_LIST_CHUNK)
+				break;
+
+			cmd_name = (struct kdbus_cmd_name *)(chunk + chunk_size);
+			memset(cmd_name, 0, KDBUS_ALIGN8(len));
+			cmd_name->size = len;
+			cmd_name->flags = e->flags;
+			cmd_name->id = e->conn->id;
+			strcpy(cmd_name->name, e->name);
+
+			chunk_size += KDBUS_ALIGN8(len);
+			id++;
+		}
+		mutex_unlock(&reg->entries_lock);
+
+		if (chunk_size > 0 &&
+		    copy_to_user((u8 __user *)buf + pos, chunk, chunk_size)) {
+			ret = -EFAULT;
+			goto exit_free;
+		}
 
-	hash_for_each(reg->entries_hash, tmp, e, hentry) {
-		cmd_name->size = sizeof(struct kdbus_cmd_name) +
-				 strlen(e->name) + 1;
-		cmd_name->flags = e->flags;
-		cmd_name->id = e->conn->id;
-		strcpy(cmd_name->name, e->name);
-		cmd_name = KDBUS_PART_NEXT(cmd_name);
+		pos += chunk_size;
+	} while (e && !full);
+
+	/* the complete list does not fit, tell the size it needs */
+	if (full && !cursor) {
+		need = kdbus_name_list_size(reg);
+		if (kdbus_size_set_user(&need, buf, struct kdbus_cmd_names))
+			ret = -EFAULT;
+		else
+			ret = -ENOBUFS;
+		goto exit_free;
 	}
 
-	if (copy_to_user(buf, cmd_names, size)) {
+	/* not even a single name fits, tell the size it needs */
+	if (full && pos == head_size) {
+		kdbus_size_set_user(&need, buf, struct kdbus_cmd_name_list);
+		ret = -ENOBUFS;
+		goto exit_free;
+	}
+
+	cmd.size = pos;
+	cmd.generation = generation;
+	cmd.cursor = e ? id : 0;
+
+	if (!cursor) {
+		if (kdbus_size_set_user(&cmd.size, buf,
+					struct kdbus_cmd_names))
+			ret = -EFAULT;
+	} else if (copy_to_user(buf, &cmd,
+				offsetof(struct kdbus_cmd_name_list, prefix))) {
 		ret = -EFAULT;
-		goto exit_unlock;
 	}
 
-exit_unlock:
-	mutex_unlock(&reg->entries_lock);
-	kfree(cmd_names);
+exit_free:
+	kfree(chunk);
+	kfree(prefix);
 
 	return ret;
 }
@@ -509,7 +730,8 @@ int kdbus_cmd_name_query(struct kdbus_name_registry *reg,
 	struct kdbus_name_entry *e = NULL;
 	struct kdbus_cmd_name_info *cmd_name_info;
 	struct kdbus_item *info_item;
-	struct kdbus_conn *owner_conn;
+	struct kdbus_conn *owner_conn = NULL;
+	struct kdbus_conn *id_conn = NULL;
 	size_t extra_size;
 	u64 size;
 	u32 hash;
@@ -529,27 +751,34 @@ int kdbus_cmd_name_query(struct kdbus_name_registry *reg,
 
 	/* The API offers to look up a connection by ID or by name */
 	if (cmd_name_info->id != 0) {
-		owner_conn = kdbus_bus_find_conn_by_id(conn->ep->bus,
-						       cmd_name_info->id);
-		if (!owner_conn)
-			return -ENXIO;
+		id_conn = kdbus_bus_find_conn_by_id(conn->ep->bus,
+						    cmd_name_info->id);
+		if (!id_conn) {
+			ret = -ENXIO;
+			goto exit_free;
+		}
+
+		owner_conn = id_conn;
 	} else {
 		KDBUS_PART_FOREACH(info_item, cmd_name_info, items) {
-			if (!KDBUS_PART_VALID(info_item, cmd_name_info))
-				return -EINVAL;
+			if (!KDBUS_PART_VALID(info_item, cmd_name_info)) {
+				ret = -EINVAL;
+				goto exit_free;
+			}
 
-			if (name)
-				return -EBADMSG;
+			if (name) {
+				ret = -EBADMSG;
+				goto exit_free;
+			}
 
 			if (info_item->type == KDBUS_NAME_INFO_ITEM_NAME)
 				name = info_item->data;
 		}
 
-		if (!KDBUS_PART_END(info_item, cmd_name_info))
-			return -EINVAL;
-
-		if (!name)
-			return -EINVAL;
+		if (!KDBUS_PART_END(info_item, cmd_name_info) || !name) {
+			ret = -EINVAL;
+			goto exit_free;
+		}
 
 		hash = kdbus_str_hash(name);
 	}
@@ -592,6 +821,9 @@ int kdbus_cmd_name_query(struct kdbus_name_registry *reg,
 exit_unlock:
 	mutex_unlock(&reg->entries_lock);
 
+exit_free:
+	if (id_conn)
+		kdbus_conn_unref(id_conn);
 	kfree(cmd_name_info);
 
 	return ret;
@@ -12,24 +12,34 @@
 #ifndef __KDBUS_NAMES_H
 #define __KDBUS_NAMES_H
 
-#include <linux/hashtable.h>
+#include <linux/idr.h>
 
 #include "internal.h"
+#include "hash.h"
 
 struct kdbus_name_registry {
 	struct kref		kref;
-	DECLARE_HASHTABLE(entries_hash, 6);
+	struct kdbus_hash	entries_hash;
+	struct idr		entries_idr;	/* list order, cursor */
+	u64			generation;	/* bumped on every change */
 	struct mutex		entries_lock;
 };
 
+/*
+ * Entries are added and removed under entries_lock; lookups on the
+ * message send path only take the RCU read lock, the entry and the name
+ * are freed after a grace period.
+ */
 struct kdbus_name_entry {
-	char			*name;
 	u64			flags;
 	struct list_head	queue_list;
 	struct list_head	conn_entry;
-	struct hlist_node	hentry;
+	struct kdbus_hash_node	hentry;
 	struct kdbus_conn	*conn;
 	struct kdbus_conn	*starter;
+	int			id;		/* in entries_idr */
+	struct rcu_head		rcu;
+	char			name[0];
 };
 
 struct kdbus_name_registry *kdbus_name_registry_new(void);
@@ -43,15 +53,16 @@ int kdbus_cmd_name_release(struct kdbus_name_registry *reg,
 			   void __user *buf);
 int kdbus_cmd_name_list(struct kdbus_name_registry *reg,
 			struct kdbus_conn *conn,
-			void __user *buf);
+			void __user *buf, bool cursor);
 int kdbus_cmd_name_query(struct kdbus_name_registry *reg,
 			 struct kdbus_conn *conn,
 			 void __user *buf);
 
-struct kdbus_name_entry *kdbus_name_lookup(struct kdbus_name_registry *reg,
-					   const char *name);
+struct kdbus_conn *kdbus_name_lookup_conn(struct kdbus_name_registry *reg,
+					  const char *name);
 void kdbus_name_remove_by_conn(struct kdbus_name_registry *reg,
-			       struct kdbus_conn *conn);
+			       struct kdbus_conn *conn,
+			       struct list_head *notify_list);
 
 bool kdbus_name_is_valid(const char *p);
 #endif
@@ -28,18 +28,18 @@
 #include "message.h"
 #include "connection.h"
 
-static int kdbus_notify_reply(struct kdbus_ep *ep, u64 src_id,
-			      u64 cookie, u64 msg_type)
+/*
+ * Notifications are not sent right away; they are collected in a list
+ * by the operation which causes them, and handed out together with
+ * kdbus_notify_flush(), once the operation dropped its locks.
+ */
+static int kdbus_notify_reply(u64 src_id, u64 cookie, u64 msg_type,
+			      struct list_head *notify_list)
 {
-	struct kdbus_conn *dst_conn;
 	struct kdbus_kmsg *kmsg;
 	struct kdbus_item *item;
 	int ret;
 
-	dst_conn = kdbus_bus_find_conn_by_id(ep->bus, src_id);
-	if (!dst_conn)
-		return -ENXIO;
-
 	ret = kdbus_kmsg_new(KDBUS_ITEM_SIZE(0), &kmsg);
 	if (ret < 0)
 		return ret;
@@ -59,25 +59,26 @@ static int kdbus_notify_reply(struct kdbus_ep *ep, u64 src_id,
 	item = kmsg->msg.items;
 	item->type = msg_type;
 
-	ret = kdbus_conn_kmsg_send(ep, NULL, kmsg);
-	kdbus_kmsg_free(kmsg);
-
-	return ret;
+	list_add_tail(&kmsg->notify_entry, notify_list);
+	return 0;
 }
 
-int kdbus_notify_reply_timeout(struct kdbus_ep *ep, u64 src_id, u64 cookie)
+int kdbus_notify_reply_timeout(u64 src_id, u64 cookie,
+			       struct list_head *notify_list)
 {
-	return kdbus_notify_reply(ep, src_id, cookie, KDBUS_MSG_REPLY_TIMEOUT);
+	return kdbus_notify_reply(src_id, cookie, KDBUS_MSG_REPLY_TIMEOUT,
+				  notify_list);
 }
 
-int kdbus_notify_reply_dead(struct kdbus_ep *ep, u64 src_id, u64 cookie)
+int kdbus_notify_reply_dead(u64 src_id, u64 cookie,
+			    struct list_head *notify_list)
 {
-	return kdbus_notify_reply(ep, src_id, cookie, KDBUS_MSG_REPLY_DEAD);
+	return kdbus_notify_reply(src_id, cookie, KDBUS_MSG_REPLY_DEAD,
+				  notify_list);
 }
 
-int kdbus_notify_name_change(struct kdbus_ep *ep, u64 type,
-			     u64 old_id, u64 new_id, u64 flags,
-			     const char *name)
+int kdbus_notify_name_change(u64 type, u64 old_id, u64 new_id, u64 flags,
+			     const char *name, struct list_head *notify_list)
 {
 	struct kdbus_manager_msg_name_change *name_change;
 	struct kdbus_kmsg *kmsg = NULL;
@@ -91,6 +92,8 @@ int kdbus_notify_name_change(struct kdbus_ep *ep, u64 type,
 	if (ret < 0)
 		return ret;
 
+	kmsg->notification_type = type;
+
 	msg = &kmsg->msg;
 	item = msg->items;
 	name_change = (struct kdbus_manager_msg_name_change *)item->data;
@@ -106,14 +109,12 @@ int kdbus_notify_name_change(struct kdbus_ep *ep, u64 type,
 	name_change->flags = flags;
 	strcpy(name_change->name, name);
 
-	ret = kdbus_conn_kmsg_send(ep, NULL, kmsg);
-	kdbus_kmsg_free(kmsg);
-
-	return ret;
+	list_add_tail(&kmsg->notify_entry, notify_list);
+	return 0;
 }
 
-int kdbus_notify_id_change(struct kdbus_ep *ep, u64 type,
-			   u64 id, u64 flags)
+int kdbus_notify_id_change(u64 type, u64 id, u64 flags,
+			   struct list_head *notify_list)
 {
 	struct kdbus_manager_msg_id_change *id_change;
 	struct kdbus_kmsg *kmsg = NULL;
@@ -125,6 +126,8 @@ int kdbus_notify_id_change(struct kdbus_ep *ep, u64 type,
 	if (ret < 0)
 		return ret;
 
+	kmsg->notification_type = type;
+
 	msg = &kmsg->msg;
 	item = msg->items;
 	id_change = (struct kdbus_manager_msg_id_change *)item->data;
@@ -137,8 +140,26 @@ int kdbus_notify_id_change(struct kdbus_ep *ep, u64 type,
 	id_change->id = id;
 	id_change->flags = flags;
 
-	ret = kdbus_conn_kmsg_send(ep, NULL, kmsg);
-	kdbus_kmsg_free(kmsg);
+	list_add_tail(&kmsg->notify_entry, notify_list);
+	return 0;
+}
+
+/**
+ * kdbus_notify_flush() - send and free the collected notifications
+ * @ep:			The endpoint to send the notifications on
+ * @notify_list:	The notifications, empty afterwards
+ */
+void kdbus_notify_flush(struct kdbus_ep *ep, struct list_head *notify_list)
+{
+	struct kdbus_kmsg *kmsg, *tmp;
+
+	if (list_empty(notify_list))
+		return;
+
+	kdbus_conn_kmsg_send_notify(ep, notify_list);
 
-	return ret;
+	list_for_each_entry_safe(kmsg, tmp, notify_list, notify_entry) {
+		list_del(&kmsg->notify_entry);
+		kdbus_kmsg_free(kmsg);
+	}
 }
@@ -16,11 +16,13 @@
 
 struct kdbus_ep;
 
-int kdbus_notify_name_change(struct kdbus_ep *ep, u64 type,
-			     u64 old_id, u64 new_id, u64 flags,
-			     const char *name);
-int kdbus_notify_id_change(struct kdbus_ep *ep, u64 type,
-			   u64 id, u64 flags);
-int kdbus_notify_reply_timeout(struct kdbus_ep *ep, u64 src_id, u64 cookie);
-int kdbus_notify_reply_dead(struct kdbus_ep *ep, u64 src_id, u64 cookie);
+int kdbus_notify_name_change(u64 type, u64 old_id, u64 new_id, u64 flags,
+			     const char *name, struct list_head *notify_list);
+int kdbus_notify_id_change(u64 type, u64 id, u64 flags,
+			   struct list_head *notify_list);
+int kdbus_notify_reply_timeout(u64 src_id, u64 cookie,
+			       struct list_head *notify_list);
+int kdbus_notify_reply_dead(u64 src_id, u64 cookie,
+			    struct list_head *notify_list);
+void kdbus_notify_flush(struct kdbus_ep *ep, struct list_head *notify_list);
 #endif
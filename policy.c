@@ -27,14 +27,6 @@
 #include "connection.h"
 #include "names.h"
 
-struct kdbus_policy_db_cache_entry {
-	struct kdbus_conn	*conn_a;
-	struct kdbus_conn	*conn_b;
-	struct hlist_node	hentry;
-	u64			deadline_ns;
-	struct list_head	timeout_entry;
-};
-
 struct kdbus_policy_db_entry_access {
 	u8			type;	/* USER, GROUP, WORLD */
 	u8			bits;	/* RECV, SEND, OWN */
@@ -44,60 +36,79 @@ struct kdbus_policy_db_entry_access {
 
 struct kdbus_policy_db_entry {
 	char			*name;
-	struct hlist_node	hentry;
+	struct kdbus_hash_node	hentry;
 	struct list_head	access_list;
 };
 
-static void kdbus_policy_db_scan_timeout(struct kdbus_policy_db *db)
+/*
+ * The access bits of a set of credentials and names, shared by all
+ * connections with the same ones. The names are represented by their
+ * generation, which is the same for all connections without a name, and
+ * unique for every other state of the names of a connection.
+ */
+struct kdbus_policy_db_cache_entry {
+	struct kdbus_hash_node	hentry;
+	struct list_head	lru_entry;
+	u64			uid;
+	u64			gid;
+	unsigned int		names_generation;
+	u64			access;
+};
+
+static u64 kdbus_policy_cache_key(u64 uid, u64 gid,
+				  unsigned int names_generation)
+{
+	return uid ^ (gid << 21) ^ ((u64)names_generation << 42);
+}
+
+/* the caller holds entries_lock or the last reference */
+static void kdbus_policy_db_cache_flush(struct kdbus_policy_db *db)
 {
 	struct kdbus_policy_db_cache_entry *ce, *tmp;
-	struct timespec ts;
-	u64 deadline = -1;
-	u64 now;
-
-	ktime_get_ts(&ts);
-	now = timespec_to_ns(&ts);
-
-	mutex_lock(&db->cache_lock);
-	list_for_each_entry_safe(ce, tmp, &db->timeout_list, timeout_entry) {
-		if (ce->deadline_ns <= now) {
-			list_del(&ce->timeout_entry);
-			hash_del(&ce->hentry);
-			kfree(ce);
-		} else if (ce->deadline_ns < deadline) {
-			deadline = ce->deadline_ns;
-		}
-	}
-	mutex_unlock(&db->cache_lock);
 
-	if (deadline != -1) {
-		u64 usecs = deadline - now;
-		do_div(usecs, 1000ULL);
-		mod_timer(&db->timer, jiffies + usecs_to_jiffies(usecs));
+	list_for_each_entry_safe(ce, tmp, &db->cache_list, lru_entry) {
+		__kdbus_hash_del(&db->cache_hash, &ce->hentry);
+		list_del(&ce->lru_entry);
+		kfree(ce);
 	}
-}
 
-static void kdbus_policy_db_work(struct work_struct *work)
-{
-	struct kdbus_policy_db *db = container_of(work, struct kdbus_policy_db, work);
-	kdbus_policy_db_scan_timeout(db);
+	db->cache_count = 0;
 }
 
-static void kdbus_policy_db_schedule_timeout_scan(struct kdbus_policy_db *db)
+/* the caller holds entries_lock; the least recently used entry makes
+ * room for the new one */
+static void kdbus_policy_db_cache_add(struct kdbus_policy_db *db,
+				      u64 uid, u64 gid,
+				      unsigned int names_generation,
+				      u64 access)
 {
-	schedule_work(&db->work);
-}
+	struct kdbus_policy_db_cache_entry *ce;
 
-static void kdbus_policy_db_timer_func(unsigned long val)
-{
-	struct kdbus_policy_db *db = (struct kdbus_policy_db *) val;
-	kdbus_policy_db_schedule_timeout_scan(db);
+	if (db->cache_count >= KDBUS_POLICY_CACHE_MAX) {
+		ce = list_entry(db->cache_list.prev,
+				struct kdbus_policy_db_cache_entry, lru_entry);
+		__kdbus_hash_del(&db->cache_hash, &ce->hentry);
+		list_del(&ce->lru_entry);
+		db->cache_count--;
+	} else {
+		ce = kmalloc(sizeof(*ce), GFP_KERNEL);
+		if (!ce)
+			return;
+	}
+
+	ce->uid = uid;
+	ce->gid = gid;
+	ce->names_generation = names_generation;
+	ce->access = access;
+	kdbus_hash_add(&db->cache_hash, &ce->hentry,
+		       kdbus_policy_cache_key(uid, gid, names_generation));
+	list_add(&ce->lru_entry, &db->cache_list);
+	db->cache_count++;
 }
 
 static void __kdbus_policy_db_free(struct kref *kref)
 {
 	struct kdbus_policy_db_entry *e;
-	struct kdbus_policy_db_cache_entry *ce;
 	struct hlist_node *tmp;
 	struct kdbus_policy_db *db =
 		container_of(kref, struct kdbus_policy_db, kref);
@@ -105,7 +116,7 @@ static void __kdbus_policy_db_free(struct kref *kref)
 
 	/* purge entries */
 	mutex_lock(&db->entries_lock);
-	hash_for_each_safe(db->entries_hash, i, tmp, e, hentry) {
+	kdbus_hash_for_each_safe(&db->entries_hash, i, tmp, e, hentry) {
 		struct kdbus_policy_db_entry_access *a, *tmp;
 
 		list_for_each_entry_safe(a, tmp, &e->access_list, list) {
@@ -113,20 +124,15 @@ static void __kdbus_policy_db_free(struct kref *kref)
 			kfree(a);
 		}
 
-		hash_del(&e->hentry);
+		__kdbus_hash_del(&db->entries_hash, &e->hentry);
 		kfree(e->name);
 		kfree(e);
 	}
+	kdbus_policy_db_cache_flush(db);
 	mutex_unlock(&db->entries_lock);
 
-	/* purge cache */
-	mutex_lock(&db->cache_lock);
-	hash_for_each_safe(db->send_access_hash, i, tmp, ce, hentry) {
-		hash_del(&ce->hentry);
-		kfree(ce);
-	}
-	mutex_unlock(&db->cache_lock);
-
+	kdbus_hash_cleanup(&db->cache_hash);
+	kdbus_hash_cleanup(&db->entries_hash);
 	kfree(db);
 }
 
@@ -143,20 +149,20 @@ struct kdbus_policy_db *kdbus_policy_db_new(void)
 	if (!db)
 		return NULL;
 
-	kref_init(&db->kref);
-	hash_init(db->entries_hash);
-	hash_init(db->send_access_hash);
-	INIT_LIST_HEAD(&db->timeout_list);
-	mutex_init(&db->entries_lock);
-	mutex_init(&db->cache_lock);
+	if (kdbus_hash_init(&db->entries_hash, 6) < 0) {
+		kfree(db);
+		return NULL;
+	}
 
-	INIT_WORK(&db->work, kdbus_policy_db_work);
+	if (kdbus_hash_init(&db->cache_hash, 6) < 0) {
+		kdbus_hash_cleanup(&db->entries_hash);
+		kfree(db);
+		return NULL;
+	}
 
-	init_timer(&db->timer);
-	db->timer.expires = 0;
-	db->timer.function = kdbus_policy_db_timer_func;
-	db->timer.data = (unsigned long) db;
-	add_timer(&db->timer);
+	kref_init(&db->kref);
+	INIT_LIST_HEAD(&db->cache_list);
+	mutex_init(&db->entries_lock);
 
 	return db;
 }
@@ -186,157 +192,97 @@ static inline u64 kdbus_collect_entry_accesses(struct kdbus_policy_db_entry *db_
 	return access;
 }
 
-static int __kdbus_policy_db_check_send_access(struct kdbus_policy_db *db,
-					       struct kdbus_conn *conn_src,
-					       struct kdbus_conn *conn_dst)
+/*
+ * The access bits a connection gets through its names and credentials
+ * are looked up in the cache of the database; they are only collected
+ * from the entries for credentials and names which were not seen since
+ * the last policy update. The names can not change while they are
+ * collected. The caller holds entries_lock.
+ */
+static u64 kdbus_policy_db_conn_access(struct kdbus_policy_db *db,
+				       struct kdbus_conn *conn)
 {
+	struct kdbus_policy_db_cache_entry *ce;
 	struct kdbus_name_entry *name_entry;
 	struct kdbus_policy_db_entry *db_entry;
-	u64 access;
-	u32 hash;
+	unsigned int names_generation;
+	u64 uid = conn->creds.uid;
+	u64 gid = conn->creds.gid;
+	u64 access = 0;
+	u64 key;
 
-	/*
-	 * send access is granted if either the source connection has a
-	 * matching SEND rule or the receiver connection has a matching
-	 * RECV rule.
-	 * Hence, we walk the list of the names registered for each
-	 * connection.
-	 */
-	list_for_each_entry(name_entry, &conn_src->names_list, conn_entry) {
-		hash = kdbus_str_hash(name_entry->name);
-		hash_for_each_possible(db->entries_hash, db_entry, hentry, hash) {
-			if (strcmp(db_entry->name, name_entry->name) != 0)
-				continue;
+	mutex_lock(&conn->names_lock);
+	names_generation = conn->names_generation;
+	key = kdbus_policy_cache_key(uid, gid, names_generation);
 
-			access = kdbus_collect_entry_accesses(db_entry, conn_src);
-			if (access & KDBUS_POLICY_SEND)
-				return 0;
-		}
+	kdbus_hash_for_each_possible(&db->cache_hash, ce, hentry, key) {
+		if (ce->uid != uid || ce->gid != gid ||
+		    ce->names_generation != names_generation)
+			continue;
+
+		list_move(&ce->lru_entry, &db->cache_list);
+		db->access_hits++;
+		access = ce->access;
+		goto exit_unlock;
 	}
 
-	list_for_each_entry(name_entry, &conn_dst->names_list, conn_entry) {
-		hash = kdbus_str_hash(name_entry->name);
-		hash_for_each_possible(db->entries_hash, db_entry, hentry, hash) {
+	db->access_misses++;
+
+	list_for_each_entry(name_entry, &conn->names_list, conn_entry) {
+		u32 hash = kdbus_str_hash(name_entry->name);
+
+		kdbus_hash_for_each_possible(&db->entries_hash, db_entry,
+					     hentry, hash) {
 			if (strcmp(db_entry->name, name_entry->name) != 0)
 				continue;
 
-			access = kdbus_collect_entry_accesses(db_entry, conn_dst);
-			if (access & KDBUS_POLICY_RECV)
-				return 0;
+			access |= kdbus_collect_entry_accesses(db_entry, conn);
 		}
 	}
 
-	return 0;
-}
-
-static struct kdbus_policy_db_cache_entry *
-kdbus_policy_cache_entry_new(struct kdbus_conn *conn_a,
-			     struct kdbus_conn *conn_b)
-{
-	struct kdbus_policy_db_cache_entry *ce;
+	kdbus_policy_db_cache_add(db, uid, gid, names_generation, access);
 
-	ce = kzalloc(sizeof(*ce), GFP_KERNEL);
-	if (!ce)
-		return NULL;
-
-	ce->conn_a = conn_a;
-	ce->conn_b = conn_b;
-	INIT_LIST_HEAD(&ce->timeout_entry);
+exit_unlock:
+	mutex_unlock(&conn->names_lock);
 
-	return ce;
+	return access;
 }
 
-static int kdbus_add_reverse_cache_entry(struct kdbus_policy_db *db,
-				   struct kdbus_policy_db_cache_entry *ce,
-				   u64 reply_deadline_ns)
+static int __kdbus_policy_db_check_send_access(struct kdbus_policy_db *db,
+					       struct kdbus_conn *conn_src,
+					       struct kdbus_conn *conn_dst)
 {
-	struct kdbus_policy_db_cache_entry *new;
-	unsigned int hash = 0;
-
-	/* note that the entries are given in reverse order (b, a) */
-	new = kdbus_policy_cache_entry_new(ce->conn_b, ce->conn_a);
-	if (!new)
-		return -ENOMEM;
-
-	hash ^= hash_ptr(ce->conn_b, sizeof(ce->conn_b) * 8);
-	hash ^= hash_ptr(ce->conn_a, sizeof(ce->conn_a) * 8);
-	new->deadline_ns = reply_deadline_ns;
-
-	mutex_lock(&db->cache_lock);
-	hash_add(db->send_access_hash, &new->hentry, hash);
-	list_add_tail(&new->timeout_entry, &db->timeout_list);
-	mutex_unlock(&db->cache_lock);
+	/*
+	 * send access is granted if either the source connection has a
+	 * matching SEND rule or the receiver connection has a matching
+	 * RECV rule.
+	 */
+	if (kdbus_policy_db_conn_access(db, conn_src) & KDBUS_POLICY_SEND)
+		return 0;
 
-	kdbus_policy_db_scan_timeout(db);
+	if (kdbus_policy_db_conn_access(db, conn_dst) & KDBUS_POLICY_RECV)
+		return 0;
 
 	return 0;
 }
 
+/*
+ * Replies to method calls are not checked here, the connections track
+ * the calls they have to answer and route the replies directly.
+ */
 int kdbus_policy_db_check_send_access(struct kdbus_policy_db *db,
 				      struct kdbus_conn *conn_src,
-				      struct kdbus_conn *conn_dst,
-				      u64 reply_deadline_ns)
+				      struct kdbus_conn *conn_dst)
 {
-	int ret = 0;
-	unsigned int hash = 0;
-	struct kdbus_policy_db_cache_entry *ce;
-
-	/* FIXME */
-	hash ^= hash_ptr(conn_src, sizeof(conn_src) * 8);
-	hash ^= hash_ptr(conn_dst, sizeof(conn_dst) * 8);
-
-	mutex_lock(&db->cache_lock);
-	hash_for_each_possible(db->send_access_hash, ce, hentry, hash)
-		if (ce->conn_a == conn_src && ce->conn_b == conn_dst) {
-			mutex_unlock(&db->cache_lock);
-			/* do we need a temporaty rule for replies? */
-			if (reply_deadline_ns)
-				ret = kdbus_add_reverse_cache_entry(db, ce, reply_deadline_ns);
-			return ret;
-		}
-	mutex_unlock(&db->cache_lock);
+	int ret;
 
 	mutex_lock(&db->entries_lock);
 	ret = __kdbus_policy_db_check_send_access(db, conn_src, conn_dst);
-	if (ret == 0) {
-		/* add to cache */
-		ce = kdbus_policy_cache_entry_new(conn_src, conn_dst);
-		if (!ce) {
-			ret = -ENOMEM;
-			goto exit_unlock_entries;
-		}
-
-		mutex_lock(&db->cache_lock);
-		hash_add(db->send_access_hash, &ce->hentry, hash);
-		mutex_unlock(&db->cache_lock);
-
-		/* do we need a temporaty rule for replies? */
-		if (reply_deadline_ns)
-			ret = kdbus_add_reverse_cache_entry(db, ce, reply_deadline_ns);
-	}
-
-exit_unlock_entries:
 	mutex_unlock(&db->entries_lock);
 
 	return ret;
 }
 
-void kdbus_policy_db_remove_conn(struct kdbus_policy_db *db,
-				 struct kdbus_conn *conn)
-{
-	struct kdbus_policy_db_cache_entry *ce;
-	struct hlist_node *tmp;
-	int i;
-
-	mutex_lock(&db->cache_lock);
-	hash_for_each_safe(db->send_access_hash, i, tmp, ce, hentry)
-		if (ce->conn_a == conn || ce->conn_b == conn) {
-			hash_del(&ce->hentry);
-			kfree(ce);
-		}
-	mutex_unlock(&db->cache_lock);
-}
-
 int kdbus_policy_db_check_own_access(struct kdbus_policy_db *db,
 				     struct kdbus_conn *conn,
 				     const char *name)
@@ -347,8 +293,8 @@ int kdbus_policy_db_check_own_access(struct kdbus_policy_db *db,
 
 	/* Walk the list of the names registered for a connection ... */
 	mutex_lock(&db->entries_lock);
-	hash_for_each_possible(db->entries_hash, db_entry,
-			       hentry, hash) {
+	kdbus_hash_for_each_possible(&db->entries_hash, db_entry,
+				     hentry, hash) {
 		u64 access;
 
 		if (strcmp(db_entry->name, name) != 0)
@@ -392,7 +338,8 @@ static int kdbus_policy_db_parse(struct kdbus_policy_db *db,
 			INIT_LIST_HEAD(&e->access_list);
 
 			mutex_lock(&db->entries_lock);
-			hash_add(db->entries_hash, &e->hentry, hash);
+			kdbus_hash_add(&db->entries_hash, &e->hentry, hash);
+			kdbus_policy_db_cache_flush(db);
 			mutex_unlock(&db->entries_lock);
 
 			current_entry = e;
@@ -416,6 +363,7 @@ static int kdbus_policy_db_parse(struct kdbus_policy_db *db,
 
 			mutex_lock(&db->entries_lock);
 			list_add_tail(&a->list, &current_entry->access_list);
+			kdbus_policy_db_cache_flush(db);
 			mutex_unlock(&db->entries_lock);
 			break;
 		}
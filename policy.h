@@ -12,20 +12,21 @@
 #ifndef __KDBUS_POLICY_H
 #define __KDBUS_POLICY_H
 
-#include <linux/hashtable.h>
-
 #include "internal.h"
+#include "hash.h"
 
 struct kdbus_policy_db {
 	struct kref	kref;
-	DECLARE_HASHTABLE(entries_hash, 6);
-	DECLARE_HASHTABLE(send_access_hash, 6);
-	struct list_head timeout_list;
+	struct kdbus_hash entries_hash;
 	struct mutex	entries_lock;
-	struct mutex	cache_lock;
 
-	struct work_struct work;
-	struct timer_list timer;
+	/* access bits by credentials and names, flushed with every policy
+	 * update; under entries_lock */
+	struct kdbus_hash cache_hash;
+	struct list_head cache_list;	/* most recently used first */
+	unsigned int	cache_count;
+	unsigned long	access_hits;	/* answered from the cache */
+	unsigned long	access_misses;	/* collected from the entries */
 };
 
 struct kdbus_conn;
@@ -36,11 +37,8 @@ int kdbus_cmd_policy_set_from_user(struct kdbus_policy_db *db,
 				   void __user *buf);
 int kdbus_policy_db_check_send_access(struct kdbus_policy_db *db,
 				      struct kdbus_conn *conn_src,
-				      struct kdbus_conn *conn_dst,
-				      u64 reply_deadline_ns);
+				      struct kdbus_conn *conn_dst);
 int kdbus_policy_db_check_own_access(struct kdbus_policy_db *db,
 				     struct kdbus_conn *conn,
 				     const char *name);
-void kdbus_policy_db_remove_conn(struct kdbus_policy_db *db,
-				 struct kdbus_conn *conn);
 #endif
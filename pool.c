@@ -20,10 +20,14 @@
 #include <linux/init.h>
 #include <linux/mm.h>
 #include <linux/highmem.h>
+#include <linux/pagemap.h>
 #include <linux/rbtree.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/file.h>
 #include <linux/shmem_fs.h>
 #include <linux/aio.h>
+#include <linux/jiffies.h>
 
 #include "pool.h"
 #include "message.h"
@@ -39,16 +43,49 @@
  * with KDBUS_CMD_MSG_RELEASE.
  */
 
+/* Free slices smaller than this are kept in per size-class lists */
+#define KDBUS_POOL_SMALL_SIZE		SZ_4K
+#define KDBUS_POOL_CLASSES		(ilog2(KDBUS_POOL_SMALL_SIZE) - 3)
+/* maximum number of slices to look at in the class of a requested size */
+#define KDBUS_POOL_CLASS_SCAN		8
+/* initial number of tracked allocations of a ring pool */
+#define KDBUS_POOL_RING_ENTS		64
+
+/* an allocation in a ring pool */
+struct kdbus_pool_ring_ent {
+	size_t off;
+	size_t size;
+	bool released;
+};
+
 /* The receiver's buffer, managed as a pool of allocated and free
  * slices containing the queued messages. */
 struct kdbus_pool {
 	struct file *f;			/* shmem file */
 	size_t size;			/* size of file  */
 	size_t busy;			/* currently allocated size */
+	size_t busy_max;		/* high-water mark of busy */
+
+	/* whole free pages which might still be backed by memory */
+	size_t trim_start;
+	size_t trim_end;		/* trim_start == trim_end: none */
+	unsigned long active;		/* jiffies of the last alloc or free */
 
 	struct list_head slices;	/* all slices sorted by address */
 	struct rb_root slices_busy;	/* tree of allocated slices */
-	struct rb_root slices_free;	/* tree of free slices */
+	struct rb_root slices_free;	/* tree of large free slices */
+
+	/* small free slices, list n holds sizes from 8 << n to 16 << n */
+	struct list_head slices_class[KDBUS_POOL_CLASSES];
+
+	/* ring mode, used instead of the slices */
+	bool ring;
+	size_t ring_head;		/* offset of the next allocation */
+	size_t ring_tail;		/* offset of the oldest allocation */
+	struct kdbus_pool_ring_ent *ring_ents; /* allocations, oldest first */
+	unsigned int ring_first;	/* index of the oldest allocation */
+	unsigned int ring_count;	/* number of allocations */
+	unsigned int ring_max;		/* size of ring_ents, power of two */
 };
 
 /* The pool has one or more slices, always spanning the entire size of the
@@ -57,25 +94,31 @@ struct kdbus_pool {
  * Every slice is an element in a list sorted by the buffer address, to
  * provide access to the next neighbor slice.
  *
- * Every slice is member in either the busy or the free tree. The free
- * tree is organized by slice size, the busy tree organized by buffer
- * offset. */
+ * Every slice is member in either the busy tree, the free tree or one
+ * of the class lists. The free tree is organized by slice size, the busy
+ * tree organized by buffer offset. Free slices which are not linked
+ * anywhere have an empty rb_node and class_entry. */
 struct kdbus_slice {
 	size_t off;			/* offset of slice */
 	size_t size;			/* size of slice */
 
 	struct list_head entry;
 	struct rb_node rb_node;
+	struct list_head class_entry;
 	bool free;
 };
 
+static struct kmem_cache *kdbus_slice_cache;
+
+static size_t kdbus_pool_ring_largest(const struct kdbus_pool *pool);
+
 static void __maybe_unused kdbus_pool_slices_dump(struct kdbus_pool *pool,
 						  const char *str)
 {
 	struct kdbus_slice *s;
 
-	pr_info("=== dump start '%s' pool=%p size=%zu ===\n",
-		str, pool, pool->size);
+	pr_info("=== dump start '%s' pool=%p size=%zu fragmentation=%u%% ===\n",
+		str, pool, pool->size, kdbus_pool_fragmentation(pool));
 
 	list_for_each_entry(s, &pool->slices, entry)
 		pr_info("  slice=%p free=%u, off=%zu size=%zu\n",
@@ -88,23 +131,45 @@ static struct kdbus_slice *kdbus_pool_slice_new(size_t off, size_t size)
 {
 	struct kdbus_slice *slice;
 
-	slice = kzalloc(sizeof(struct kdbus_slice), GFP_KERNEL);
+	slice = kmem_cache_zalloc(kdbus_slice_cache, GFP_KERNEL);
 	if (!slice)
 		return NULL;
 
 	slice->off = off;
 	slice->size = size;
 	slice->free = true;
+	RB_CLEAR_NODE(&slice->rb_node);
+	INIT_LIST_HEAD(&slice->class_entry);
 	return slice;
 }
 
-/* insert a slice into the free tree */
+static void kdbus_pool_slice_free(struct kdbus_slice *slice)
+{
+	kmem_cache_free(kdbus_slice_cache, slice);
+}
+
+static unsigned int kdbus_pool_size_class(size_t size)
+{
+	if (size < 16)
+		return 0;
+
+	return ilog2(size) - 3;
+}
+
+/* insert a slice into the free tree or its class list */
 static void kdbus_pool_add_free_slice(struct kdbus_pool *pool,
 				      struct kdbus_slice *slice)
 {
 	struct rb_node **n;
 	struct rb_node *pn = NULL;
 
+	if (slice->size < KDBUS_POOL_SMALL_SIZE) {
+		unsigned int c = kdbus_pool_size_class(slice->size);
+
+		list_add(&slice->class_entry, &pool->slices_class[c]);
+		return;
+	}
+
 	n = &pool->slices_free.rb_node;
 	while (*n) {
 		struct kdbus_slice *pslice;
@@ -121,6 +186,18 @@ static void kdbus_pool_add_free_slice(struct kdbus_pool *pool,
 	rb_insert_color(&slice->rb_node, &pool->slices_free);
 }
 
+/* unlink a free slice from wherever it is linked */
+static void kdbus_pool_remove_free_slice(struct kdbus_pool *pool,
+					 struct kdbus_slice *slice)
+{
+	if (!list_empty(&slice->class_entry)) {
+		list_del_init(&slice->class_entry);
+	} else if (!RB_EMPTY_NODE(&slice->rb_node)) {
+		rb_erase(&slice->rb_node, &pool->slices_free);
+		RB_CLEAR_NODE(&slice->rb_node);
+	}
+}
+
 /* insert a slice into the busy tree */
 static void kdbus_pool_add_busy_slice(struct kdbus_pool *pool,
 				      struct kdbus_slice *slice)
@@ -166,52 +243,88 @@ static struct kdbus_slice *kdbus_pool_find_slice(struct kdbus_pool *pool,
 	return NULL;
 }
 
-/* allocate a slice from the pool with the given size */
-static int kdbus_pool_alloc_slice(struct kdbus_pool *pool,
-				  size_t size, struct kdbus_slice **slice)
+/* find a small free slice of at least the given size in the class lists */
+static struct kdbus_slice *kdbus_pool_find_small(struct kdbus_pool *pool,
+						 size_t size)
 {
-	size_t slice_size = KDBUS_ALIGN8(size);
-	struct rb_node *n;
+	unsigned int c = kdbus_pool_size_class(size);
+	unsigned int scan = 0;
 	struct kdbus_slice *s;
-	struct rb_node *found = NULL;
 
-	/* search a free slice with the closest matching size */
+	/* the own class holds slices smaller and larger than the size */
+	list_for_each_entry(s, &pool->slices_class[c], class_entry) {
+		if (s->size >= size)
+			return s;
+
+		if (++scan == KDBUS_POOL_CLASS_SCAN)
+			break;
+	}
+
+	/* every slice of a larger class fits */
+	for (c++; c < KDBUS_POOL_CLASSES; c++)
+		if (!list_empty(&pool->slices_class[c]))
+			return list_first_entry(&pool->slices_class[c],
+						struct kdbus_slice,
+						class_entry);
+
+	return NULL;
+}
+
+/* find a large free slice with the closest matching size */
+static struct kdbus_slice *kdbus_pool_find_large(struct kdbus_pool *pool,
+						 size_t size)
+{
+	struct kdbus_slice *s, *found = NULL;
+	struct rb_node *n;
+
 	n = pool->slices_free.rb_node;
 	while (n) {
 		s = rb_entry(n, struct kdbus_slice, rb_node);
-		if (slice_size < s->size) {
-			found = n;
+		if (size < s->size) {
+			found = s;
 			n = n->rb_left;
-		} else if (slice_size > s->size)
+		} else if (size > s->size) {
 			n = n->rb_right;
-		else {
-			found = n;
-			break;
+		} else {
+			return s;
 		}
 	}
 
-	/* no slice with the minimum size found in the pool */
-	if (!found)
-		return -ENOBUFS;
+	return found;
+}
+
+/* allocate a slice from the pool with the given size */
+static int kdbus_pool_alloc_slice(struct kdbus_pool *pool,
+				  size_t size, struct kdbus_slice **slice)
+{
+	size_t slice_size = KDBUS_ALIGN8(size);
+	struct kdbus_slice *s = NULL;
+	struct kdbus_slice *s_new = NULL;
 
-	/* no exact match, use the closest one */
-	if (!n)
-		s = rb_entry(found, struct kdbus_slice, rb_node);
+	if (slice_size < KDBUS_POOL_SMALL_SIZE)
+		s = kdbus_pool_find_small(pool, slice_size);
 
-	/* move slice from free to the busy tree */
-	rb_erase(found, &pool->slices_free);
-	kdbus_pool_add_busy_slice(pool, s);
+	if (!s)
+		s = kdbus_pool_find_large(pool, slice_size);
+
+	/* no slice with the minimum size found in the pool */
+	if (!s)
+		return -ENOBUFS;
 
 	/* we got a slice larger than what we asked for? */
 	if (s->size > slice_size) {
-		struct kdbus_slice *s_new;
-
 		/* split-off the remainder of the size to its own slice */
 		s_new = kdbus_pool_slice_new(s->off + slice_size,
 					     s->size - slice_size);
 		if (!s_new)
 			return -ENOMEM;
+	}
 
+	/* move slice from free to the busy tree */
+	kdbus_pool_remove_free_slice(pool, s);
+	kdbus_pool_add_busy_slice(pool, s);
+
+	if (s_new) {
 		list_add(&s_new->entry, &s->entry);
 		kdbus_pool_add_free_slice(pool, s_new);
 
@@ -225,11 +338,36 @@ static int kdbus_pool_alloc_slice(struct kdbus_pool *pool,
 	return 0;
 }
 
+/*
+ * Remember the whole pages of a free area; they are returned to the
+ * system by kdbus_pool_trim() once the pool is idle. Only the range which
+ * covers all of them is tracked.
+ */
+static void kdbus_pool_trim_mark(struct kdbus_pool *pool,
+				 size_t off, size_t size)
+{
+	size_t start = PAGE_ALIGN(off);
+	size_t end = round_down(off + size, PAGE_SIZE);
+
+	if (start >= end)
+		return;
+
+	if (pool->trim_start == pool->trim_end) {
+		pool->trim_start = start;
+		pool->trim_end = end;
+		return;
+	}
+
+	pool->trim_start = min(pool->trim_start, start);
+	pool->trim_end = max(pool->trim_end, end);
+}
+
 /* return an allocated slice back to the pool */
 static void kdbus_pool_free_slice(struct kdbus_pool *pool,
 				  struct kdbus_slice *slice)
 {
 	rb_erase(&slice->rb_node, &pool->slices_busy);
+	RB_CLEAR_NODE(&slice->rb_node);
 	pool->busy -= slice->size;
 
 	/* merge with the next free slice */
@@ -238,10 +376,10 @@ static void kdbus_pool_free_slice(struct kdbus_pool *pool,
 
 		s = list_entry(slice->entry.next, struct kdbus_slice, entry);
 		if (s->free) {
-			rb_erase(&s->rb_node, &pool->slices_free);
+			kdbus_pool_remove_free_slice(pool, s);
 			list_del(&s->entry);
 			slice->size += s->size;
-			kfree(s);
+			kdbus_pool_slice_free(s);
 		}
 	}
 
@@ -251,40 +389,347 @@ static void kdbus_pool_free_slice(struct kdbus_pool *pool,
 
 		s = list_entry(slice->entry.prev, struct kdbus_slice, entry);
 		if (s->free) {
-			rb_erase(&s->rb_node, &pool->slices_free);
+			kdbus_pool_remove_free_slice(pool, s);
 			list_del(&slice->entry);
 			s->size += slice->size;
-			kfree(slice);
+			kdbus_pool_slice_free(slice);
 			slice = s;
 		}
 	}
 
 	slice->free = true;
 	kdbus_pool_add_free_slice(pool, slice);
+	kdbus_pool_trim_mark(pool, slice->off, slice->size);
 }
 
-int kdbus_pool_init(struct kdbus_pool **pool, size_t size)
+/* Merge all free slices between first and last, including their free
+ * neighbors, in a single walk over the list of slices. Slices which are
+ * not linked anywhere are the ones just released. */
+static void kdbus_pool_merge_slices(struct kdbus_pool *pool,
+				    struct kdbus_slice *first,
+				    struct kdbus_slice *last)
+{
+	struct kdbus_slice *s, *merged = NULL;
+	struct list_head *pos, *next, *stop;
+
+	/* include the free neighbors of the range */
+	if (pool->slices.next != &first->entry) {
+		s = list_entry(first->entry.prev, struct kdbus_slice, entry);
+		if (s->free)
+			first = s;
+	}
+
+	if (!list_is_last(&last->entry, &pool->slices)) {
+		s = list_entry(last->entry.next, struct kdbus_slice, entry);
+		if (s->free)
+			last = s;
+	}
+
+	stop = last->entry.next;
+	for (pos = &first->entry; pos != stop; pos = next) {
+		next = pos->next;
+		s = list_entry(pos, struct kdbus_slice, entry);
+
+		if (!s->free) {
+			/* a busy slice ends the current run */
+			if (merged) {
+				kdbus_pool_add_free_slice(pool, merged);
+				kdbus_pool_trim_mark(pool, merged->off,
+						     merged->size);
+				merged = NULL;
+			}
+			continue;
+		}
+
+		kdbus_pool_remove_free_slice(pool, s);
+
+		if (!merged) {
+			merged = s;
+			continue;
+		}
+
+		list_del(&s->entry);
+		merged->size += s->size;
+		kdbus_pool_slice_free(s);
+	}
+
+	if (merged) {
+		kdbus_pool_add_free_slice(pool, merged);
+		kdbus_pool_trim_mark(pool, merged->off, merged->size);
+	}
+}
+
+/**
+ * kdbus_pool_fragmentation() - fragmentation of the free space of a pool
+ * @pool:	The pool
+ *
+ * Return: the percentage of the free space in the pool which is not part
+ * of the largest free slice; 0 if the free space is contiguous.
+ */
+unsigned int kdbus_pool_fragmentation(const struct kdbus_pool *pool)
+{
+	size_t avail = pool->size - pool->busy;
+	size_t largest = 0;
+	struct kdbus_slice *s;
+	struct rb_node *n;
+	int c;
+
+	if (avail == 0)
+		return 0;
+
+	if (pool->ring)
+		return 100 - div64_u64((u64)kdbus_pool_ring_largest(pool) * 100,
+				       avail);
+
+	n = rb_last(&pool->slices_free);
+	if (n) {
+		largest = rb_entry(n, struct kdbus_slice, rb_node)->size;
+	} else {
+		for (c = KDBUS_POOL_CLASSES - 1; c >= 0 && largest == 0; c--)
+			list_for_each_entry(s, &pool->slices_class[c],
+					    class_entry)
+				largest = max(largest, s->size);
+	}
+
+	return 100 - div64_u64((u64)largest * 100, avail);
+}
+
+/*
+ * In ring mode, the pool is used as a contiguous ring buffer: allocations
+ * are taken from the head, and the tail advances when the oldest
+ * allocation is released. An allocation which does not fit at the end of
+ * the pool starts over at offset 0, the rest of the pool stays unused
+ * until the tail wraps around too. The head never catches up with the
+ * tail, so head == tail means the ring is empty.
+ *
+ * Allocations are tracked in an array, which only grows if more
+ * allocations are outstanding than ever before. Releasing a message out
+ * of order is allowed; its space is reclaimed as soon as all older
+ * messages are released.
+ */
+static struct kdbus_pool_ring_ent *
+kdbus_pool_ring_ent(const struct kdbus_pool *pool, unsigned int i)
+{
+	return &pool->ring_ents[(pool->ring_first + i) & (pool->ring_max - 1)];
+}
+
+static size_t kdbus_pool_ring_used(const struct kdbus_pool *pool)
+{
+	if (pool->ring_count == 0)
+		return 0;
+
+	if (pool->ring_head > pool->ring_tail)
+		return pool->ring_head - pool->ring_tail;
+
+	return pool->size - pool->ring_tail + pool->ring_head;
+}
+
+/* the largest contiguous free area of the ring */
+static size_t kdbus_pool_ring_largest(const struct kdbus_pool *pool)
+{
+	if (pool->ring_count == 0)
+		return pool->size;
+
+	if (pool->ring_head > pool->ring_tail)
+		return max(pool->size - pool->ring_head, pool->ring_tail);
+
+	return pool->ring_tail - pool->ring_head;
+}
+
+/* the free areas of a ring which is not empty */
+static void kdbus_pool_ring_trim_mark(struct kdbus_pool *pool)
+{
+	if (pool->ring_head > pool->ring_tail) {
+		kdbus_pool_trim_mark(pool, pool->ring_head,
+				     pool->size - pool->ring_head);
+		kdbus_pool_trim_mark(pool, 0, pool->ring_tail);
+	} else {
+		kdbus_pool_trim_mark(pool, pool->ring_head,
+				     pool->ring_tail - pool->ring_head);
+	}
+}
+
+static int kdbus_pool_ring_grow(struct kdbus_pool *pool)
+{
+	struct kdbus_pool_ring_ent *ents;
+	unsigned int i;
+
+	ents = kmalloc(pool->ring_max * 2 * sizeof(*ents), GFP_KERNEL);
+	if (!ents)
+		return -ENOMEM;
+
+	for (i = 0; i < pool->ring_count; i++)
+		ents[i] = *kdbus_pool_ring_ent(pool, i);
+
+	kfree(pool->ring_ents);
+	pool->ring_ents = ents;
+	pool->ring_first = 0;
+	pool->ring_max *= 2;
+	return 0;
+}
+
+static int kdbus_pool_ring_alloc(struct kdbus_pool *pool,
+				 size_t size, size_t *off)
+{
+	size_t slice_size = KDBUS_ALIGN8(size);
+	struct kdbus_pool_ring_ent *ent;
+	size_t o;
+	int ret;
+
+	if (pool->ring_count == 0) {
+		/* start over at the beginning of the empty pool */
+		pool->ring_head = 0;
+		pool->ring_tail = 0;
+
+		if (slice_size >= pool->size)
+			return -ENOBUFS;
+
+		o = 0;
+	} else if (pool->ring_head > pool->ring_tail) {
+		size_t end = pool->size - pool->ring_head;
+
+		/* filling the end wraps the head, which must not hit the tail */
+		if (slice_size < end ||
+		    (slice_size == end && pool->ring_tail > 0))
+			o = pool->ring_head;
+		else if (slice_size < pool->ring_tail)
+			o = 0;
+		else
+			return -ENOBUFS;
+	} else {
+		if (slice_size < pool->ring_tail - pool->ring_head)
+			o = pool->ring_head;
+		else
+			return -ENOBUFS;
+	}
+
+	if (pool->ring_count == pool->ring_max) {
+		ret = kdbus_pool_ring_grow(pool);
+		if (ret < 0)
+			return ret;
+	}
+
+	ent = kdbus_pool_ring_ent(pool, pool->ring_count);
+	ent->off = o;
+	ent->size = slice_size;
+	ent->released = false;
+	pool->ring_count++;
+
+	pool->ring_head = o + slice_size;
+	if (pool->ring_head == pool->size)
+		pool->ring_head = 0;
+
+	pool->busy = kdbus_pool_ring_used(pool);
+	*off = o;
+	return 0;
+}
+
+static int kdbus_pool_ring_free(struct kdbus_pool *pool, size_t off)
+{
+	struct kdbus_pool_ring_ent *ent = NULL;
+	unsigned int i;
+
+	/* in-order consumers release the oldest allocation */
+	for (i = 0; i < pool->ring_count; i++) {
+		ent = kdbus_pool_ring_ent(pool, i);
+		if (!ent->released && ent->off == off)
+			break;
+	}
+
+	if (i == pool->ring_count)
+		return -ENXIO;
+
+	ent->released = true;
+
+	/* reclaim the released allocations at the tail ... */
+	while (pool->ring_count > 0 && kdbus_pool_ring_ent(pool, 0)->released) {
+		pool->ring_first = (pool->ring_first + 1) & (pool->ring_max - 1);
+		pool->ring_count--;
+	}
+
+	/* ... and the ones at the head, which failed to be queued */
+	while (pool->ring_count > 0) {
+		ent = kdbus_pool_ring_ent(pool, pool->ring_count - 1);
+		if (!ent->released)
+			break;
+
+		pool->ring_head = ent->off;
+		pool->ring_count--;
+	}
+
+	if (pool->ring_count == 0) {
+		pool->ring_head = 0;
+		pool->ring_tail = 0;
+		kdbus_pool_trim_mark(pool, 0, pool->size);
+	} else {
+		pool->ring_tail = kdbus_pool_ring_ent(pool, 0)->off;
+		kdbus_pool_ring_trim_mark(pool);
+	}
+
+	pool->busy = kdbus_pool_ring_used(pool);
+	return 0;
+}
+
+int kdbus_pool_cache_init(void)
+{
+	kdbus_slice_cache = KMEM_CACHE(kdbus_slice, 0);
+	if (!kdbus_slice_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void kdbus_pool_cache_exit(void)
+{
+	kmem_cache_destroy(kdbus_slice_cache);
+}
+
+/**
+ * kdbus_pool_init() - create a new pool
+ * @pool:	Pointer to a reference where the new pool is stored
+ * @size:	The size of the pool
+ * @ring:	Manage the pool as a ring buffer, for receivers which release
+ *		their messages in the order they are received
+ *
+ * Return: 0 on success, < 0 on failure
+ */
+int kdbus_pool_init(struct kdbus_pool **pool, size_t size, bool ring)
 {
 	struct kdbus_pool *p;
 	struct file *f;
-	struct kdbus_slice *s;
+	struct kdbus_slice *s = NULL;
+	unsigned int i;
 	int ret;
 
 	p = kzalloc(sizeof(struct kdbus_pool), GFP_KERNEL);
 	if (!p)
 		return -ENOMEM;
 
-	f = shmem_file_setup("kdbus-pool", size, 0);
+	/* memory is committed when a page is used, not for the whole size */
+	f = shmem_file_setup("kdbus-pool", size, VM_NORESERVE);
 	if (IS_ERR(f)) {
 		ret = PTR_ERR(f);
 		goto exit_free_p;
 	}
 
-	/* allocate first slice spanning the entire pool */
-	s = kdbus_pool_slice_new(0, size);
-	if (!s) {
-		ret = -ENOMEM;
-		goto exit_put_shmem;
+	if (ring) {
+		p->ring_ents = kmalloc(KDBUS_POOL_RING_ENTS *
+				       sizeof(struct kdbus_pool_ring_ent),
+				       GFP_KERNEL);
+		if (!p->ring_ents) {
+			ret = -ENOMEM;
+			goto exit_put_shmem;
+		}
+
+		p->ring = true;
+		p->ring_max = KDBUS_POOL_RING_ENTS;
+	} else {
+		/* allocate first slice spanning the entire pool */
+		s = kdbus_pool_slice_new(0, size);
+		if (!s) {
+			ret = -ENOMEM;
+			goto exit_put_shmem;
+		}
 	}
 
 	p->f = f;
@@ -292,11 +737,15 @@ int kdbus_pool_init(struct kdbus_pool **pool, size_t size)
 	p->busy = 0;
 	p->slices_free = RB_ROOT;
 	p->slices_busy = RB_ROOT;
+	for (i = 0; i < KDBUS_POOL_CLASSES; i++)
+		INIT_LIST_HEAD(&p->slices_class[i]);
 
 	INIT_LIST_HEAD(&p->slices);
-	list_add(&s->entry, &p->slices);
+	if (s) {
+		list_add(&s->entry, &p->slices);
+		kdbus_pool_add_free_slice(p, s);
+	}
 
-	kdbus_pool_add_free_slice(p, s);
 	*pool = p;
 	return 0;
 
@@ -316,10 +765,11 @@ void kdbus_pool_cleanup(struct kdbus_pool *pool)
 
 	list_for_each_entry_safe(s, tmp, &pool->slices, entry) {
 		list_del(&s->entry);
-		kfree(s);
+		kdbus_pool_slice_free(s);
 	}
 
 	fput(pool->f);
+	kfree(pool->ring_ents);
 	kfree(pool);
 }
 
@@ -328,17 +778,126 @@ size_t kdbus_pool_remain(const struct kdbus_pool *pool)
 	return pool->size - pool->busy;
 }
 
+/**
+ * kdbus_pool_stats() - collect the usage of a pool
+ * @pool:	The pool
+ * @s:		The statistics to fill in
+ */
+void kdbus_pool_stats(const struct kdbus_pool *pool,
+		      struct kdbus_pool_stats *s)
+{
+	s->size = pool->size;
+	s->used = pool->busy;
+	s->used_max = pool->busy_max;
+	s->resident = pool->f->f_mapping->nrpages << PAGE_SHIFT;
+	s->fragmentation = kdbus_pool_fragmentation(pool);
+}
+
+/* return the memory of whole pages in a free area to the system */
+static void kdbus_pool_punch(struct kdbus_pool *pool, size_t start, size_t end)
+{
+	struct address_space *mapping = pool->f->f_mapping;
+
+	start = PAGE_ALIGN(start);
+	end = round_down(end, PAGE_SIZE);
+	if (start >= end)
+		return;
+
+	/* the receiver's mapping of the pages, then the pages themselves */
+	unmap_mapping_range(mapping, start, end - start, 0);
+	shmem_truncate_range(file_inode(pool->f), start, end - 1);
+}
+
+static void kdbus_pool_ring_trim(struct kdbus_pool *pool,
+				 size_t start, size_t end)
+{
+	if (pool->ring_count == 0) {
+		kdbus_pool_punch(pool, start, end);
+	} else if (pool->ring_head > pool->ring_tail) {
+		kdbus_pool_punch(pool, max(start, pool->ring_head), end);
+		kdbus_pool_punch(pool, start, min(end, pool->ring_tail));
+	} else {
+		kdbus_pool_punch(pool, max(start, pool->ring_head),
+				 min(end, pool->ring_tail));
+	}
+}
+
+/**
+ * kdbus_pool_trim() - return the memory of free pages of an idle pool
+ * @pool:	The pool
+ * @idle:	The number of jiffies the pool has to be unused
+ *
+ * Whole pages of the free space which were in use since the last trim
+ * are punched out of the shmem file; the next message placed there gets
+ * fresh pages. A pool which was used within the last @idle jiffies is
+ * left alone.
+ *
+ * Return: 0 if nothing is left to do, otherwise the number of jiffies
+ * until the pool might be idle long enough
+ */
+unsigned long kdbus_pool_trim(struct kdbus_pool *pool, unsigned long idle)
+{
+	size_t start = pool->trim_start;
+	size_t end = pool->trim_end;
+	struct kdbus_slice *s;
+
+	if (start == end)
+		return 0;
+
+	if (time_before(jiffies, pool->active + idle))
+		return pool->active + idle - jiffies;
+
+	pool->trim_start = 0;
+	pool->trim_end = 0;
+
+	if (pool->ring) {
+		kdbus_pool_ring_trim(pool, start, end);
+		return 0;
+	}
+
+	list_for_each_entry(s, &pool->slices, entry) {
+		if (s->off >= end)
+			break;
+
+		if (!s->free || s->off + s->size <= start)
+			continue;
+
+		kdbus_pool_punch(pool, max(start, s->off),
+				 min(end, s->off + s->size));
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/* free pages wait for kdbus_pool_trim() */
+bool kdbus_pool_trim_pending(const struct kdbus_pool *pool)
+{
+	return pool->trim_start != pool->trim_end;
+}
+
 /* allocate a message of the given size in the receiver's pool */
 int kdbus_pool_alloc(struct kdbus_pool *pool, size_t size, size_t *off)
 {
 	struct kdbus_slice *s;
 	int ret;
 
-	ret = kdbus_pool_alloc_slice(pool, size, &s);
-	if (ret < 0)
-		return ret;
+	if (pool->ring) {
+		ret = kdbus_pool_ring_alloc(pool, size, off);
+		if (ret < 0)
+			return ret;
+	} else {
+		ret = kdbus_pool_alloc_slice(pool, size, &s);
+		if (ret < 0)
+			return ret;
+
+		*off = s->off;
+	}
+
+	if (pool->busy > pool->busy_max)
+		pool->busy_max = pool->busy;
 
-	*off = s->off;
+	pool->active = jiffies;
 	return 0;
 }
 
@@ -353,6 +912,11 @@ int kdbus_pool_free(struct kdbus_pool *pool, size_t off)
 	if (off >= pool->size)
 		return -EINVAL;
 
+	pool->active = jiffies;
+
+	if (pool->ring)
+		return kdbus_pool_ring_free(pool, off);
+
 	slice = kdbus_pool_find_slice(pool, off);
 	if (!slice)
 		return -ENXIO;
@@ -361,31 +925,186 @@ int kdbus_pool_free(struct kdbus_pool *pool, size_t off)
 	return 0;
 }
 
-/* write to the receiver's shmem file */
-ssize_t kdbus_pool_write_user(const struct kdbus_pool *pool, size_t off,
-			      void __user *data, size_t len)
+/*
+ * Free a vector of allocated messages. The offsets are released in order
+ * until the first one which is not a currently allocated slice; the number
+ * of released offsets is returned in 'freed', all following offsets are
+ * left untouched. Neighboring free slices are merged in one pass.
+ */
+int kdbus_pool_free_batch(struct kdbus_pool *pool, const u64 *offs,
+			  unsigned int count, unsigned int *freed)
 {
-	loff_t o = off;
+	struct kdbus_slice *first = NULL, *last = NULL;
+	struct kdbus_slice *slice;
+	unsigned int i;
+	int ret = 0;
 
-	return pool->f->f_op->write(pool->f, data, len, &o);
+	if (!pool) {
+		*freed = count;
+		return 0;
+	}
+
+	pool->active = jiffies;
+
+	for (i = 0; i < count; i++) {
+		if (offs[i] >= pool->size) {
+			ret = -EINVAL;
+			break;
+		}
+
+		if (pool->ring) {
+			ret = kdbus_pool_ring_free(pool, offs[i]);
+			if (ret < 0)
+				break;
+			continue;
+		}
+
+		slice = kdbus_pool_find_slice(pool, offs[i]);
+		if (!slice) {
+			ret = -ENXIO;
+			break;
+		}
+
+		/* unlink from the busy tree, merging happens below */
+		rb_erase(&slice->rb_node, &pool->slices_busy);
+		RB_CLEAR_NODE(&slice->rb_node);
+		pool->busy -= slice->size;
+		slice->free = true;
+
+		if (!first || slice->off < first->off)
+			first = slice;
+		if (!last || slice->off > last->off)
+			last = slice;
+	}
+
+	if (first)
+		kdbus_pool_merge_slices(pool, first, last);
+
+	*freed = i;
+	return ret;
 }
 
-ssize_t kdbus_pool_write(const struct kdbus_pool *pool, size_t off,
-			 void *data, size_t len)
+/*
+ * Copy data into the pages of the receiver's shmem file. Every page is
+ * looked up once in the page cache and written directly, instead of
+ * going through the file's write() operation.
+ */
+static ssize_t kdbus_pool_copy(const struct kdbus_pool *pool, size_t off,
+			       const void *data, size_t len, bool user)
 {
-	loff_t o = off;
-	mm_segment_t old_fs;
-	void __user *p;
-	ssize_t ret;
+	struct address_space *mapping = pool->f->f_mapping;
+	const char *src = data;
+	size_t remain = len;
 
-	old_fs = get_fs();
-	set_fs(get_ds());
+	if (off > pool->size || len > pool->size - off)
+		return -EFAULT;
 
-	p = (void __force __user *)data;
-	ret = pool->f->f_op->write(pool->f, p, len, &o);
+	while (remain > 0) {
+		size_t page_off = off & (PAGE_SIZE - 1);
+		size_t n = min_t(size_t, remain, PAGE_SIZE - page_off);
+		unsigned long failed = 0;
+		struct page *page;
+		char *kaddr;
+
+		page = shmem_read_mapping_page(mapping, off >> PAGE_SHIFT);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+
+		kaddr = kmap(page);
+		if (user)
+			failed = copy_from_user(kaddr + page_off,
+						(const void __user __force *)src,
+						n);
+		else
+			memcpy(kaddr + page_off, src, n);
+		kunmap(page);
 
-	set_fs(old_fs);
-	return ret;
+		flush_dcache_page(page);
+		set_page_dirty(page);
+		mark_page_accessed(page);
+		page_cache_release(page);
+
+		if (failed)
+			return -EFAULT;
+
+		src += n;
+		off += n;
+		remain -= n;
+	}
+
+	return len;
+}
+
+/**
+ * kdbus_pool_write_pages() - write pinned pages to the receiver's pool
+ * @pool:	The pool
+ * @off:	The offset in the pool to write to
+ * @pages:	The source pages, the data starts at the beginning of the
+ *		first page
+ * @len:	The number of bytes to copy
+ *
+ * Return: the number of bytes written, or < 0 on failure
+ */
+ssize_t kdbus_pool_write_pages(const struct kdbus_pool *pool, size_t off,
+			       struct page **pages, size_t len)
+{
+	struct address_space *mapping = pool->f->f_mapping;
+	size_t done = 0;
+
+	if (off > pool->size || len > pool->size - off)
+		return -EFAULT;
+
+	while (done < len) {
+		size_t page_off = off & (PAGE_SIZE - 1);
+		size_t n = min_t(size_t, len - done, PAGE_SIZE - page_off);
+		size_t copied = 0;
+		struct page *page;
+		char *dst;
+
+		page = shmem_read_mapping_page(mapping, off >> PAGE_SHIFT);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+
+		/* an unaligned destination page spans two source pages */
+		dst = kmap_atomic(page);
+		while (copied < n) {
+			size_t src_pos = done + copied;
+			size_t src_off = src_pos & (PAGE_SIZE - 1);
+			size_t m = min_t(size_t, n - copied, PAGE_SIZE - src_off);
+			char *src;
+
+			src = kmap_atomic(pages[src_pos >> PAGE_SHIFT]);
+			memcpy(dst + page_off + copied, src + src_off, m);
+			kunmap_atomic(src);
+			copied += m;
+		}
+		kunmap_atomic(dst);
+
+		flush_dcache_page(page);
+		set_page_dirty(page);
+		mark_page_accessed(page);
+		page_cache_release(page);
+
+		done += n;
+		off += n;
+	}
+
+	return len;
+}
+
+/* write user memory to the receiver's pool */
+ssize_t kdbus_pool_write_user(const struct kdbus_pool *pool, size_t off,
+			      void __user *data, size_t len)
+{
+	return kdbus_pool_copy(pool, off, (const void __force *)data, len,
+			       true);
+}
+
+/* write kernel memory to the receiver's pool */
+ssize_t kdbus_pool_write(const struct kdbus_pool *pool, size_t off,
+			 void *data, size_t len)
+{
+	return kdbus_pool_copy(pool, off, data, len, false);
 }
 
 /* map the shmem file for the receiver */
@@ -15,16 +15,36 @@
 
 struct kdbus_pool;
 
-int kdbus_pool_init(struct kdbus_pool **pool, size_t size);
+struct kdbus_pool_stats {
+	size_t		size;
+	size_t		used;		/* allocated bytes */
+	size_t		used_max;	/* high-water mark of used */
+	size_t		resident;	/* bytes backed by memory */
+	unsigned int	fragmentation;	/* see kdbus_pool_fragmentation() */
+};
+
+int kdbus_pool_cache_init(void);
+void kdbus_pool_cache_exit(void);
+
+int kdbus_pool_init(struct kdbus_pool **pool, size_t size, bool ring);
 void kdbus_pool_cleanup(struct kdbus_pool *pool);
 
 int kdbus_pool_alloc(struct kdbus_pool *pool, size_t size, size_t *off);
 int kdbus_pool_free(struct kdbus_pool *pool, size_t off);
+int kdbus_pool_free_batch(struct kdbus_pool *pool, const u64 *offs,
+			  unsigned int count, unsigned int *freed);
 size_t kdbus_pool_remain(const struct kdbus_pool *pool);
+unsigned int kdbus_pool_fragmentation(const struct kdbus_pool *pool);
+void kdbus_pool_stats(const struct kdbus_pool *pool,
+		      struct kdbus_pool_stats *s);
+unsigned long kdbus_pool_trim(struct kdbus_pool *pool, unsigned long idle);
+bool kdbus_pool_trim_pending(const struct kdbus_pool *pool);
 
 ssize_t kdbus_pool_write(const struct kdbus_pool *pool, size_t off,
 			 void *data, size_t len);
 ssize_t kdbus_pool_write_user(const struct kdbus_pool *pool, size_t off,
 			 void __user *data, size_t len);
+ssize_t kdbus_pool_write_pages(const struct kdbus_pool *pool, size_t off,
+			       struct page **pages, size_t len);
 int kdbus_pool_mmap(const struct kdbus_pool *pool, struct vm_area_struct *vma);
 #endif
@@ -46,6 +46,7 @@ TABLE(CMD) = {
 	ENUM(KDBUS_CMD_NAME_RELEASE),
 	ENUM(KDBUS_CMD_NAME_LIST),
 	ENUM(KDBUS_CMD_NAME_QUERY),
+	ENUM(KDBUS_CMD_NAME_LIST_CURSOR),
 	ENUM(KDBUS_CMD_MATCH_ADD),
 	ENUM(KDBUS_CMD_MATCH_REMOVE),
 	ENUM(KDBUS_CMD_MONITOR),
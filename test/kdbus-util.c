@@ -53,7 +53,8 @@ struct conn *connect_to_bus(const char *path)
 			   KDBUS_HELLO_ATTACH_CAPS |
 			   KDBUS_HELLO_ATTACH_CGROUP |
 			   KDBUS_HELLO_ATTACH_SECLABEL |
-			   KDBUS_HELLO_ATTACH_AUDIT;
+			   KDBUS_HELLO_ATTACH_AUDIT |
+			   KDBUS_HELLO_ATTACH_TIMESTAMP;
 	hello.size = sizeof(struct kdbus_cmd_hello);
 	hello.pool_size = POOL_SIZE;
 
@@ -79,6 +80,7 @@ struct conn *connect_to_bus(const char *path)
 
 	conn->fd = fd;
 	conn->id = hello.id;
+	conn->size = POOL_SIZE;
 	return conn;
 }
 
@@ -206,11 +208,13 @@ void msg_dump(const struct conn *conn, const struct kdbus_msg *msg)
 	const struct kdbus_item *item = msg->items;
 	char buf[32];
 
-	printf("MESSAGE: %s (%llu bytes) flags=0x%llx, %s → %s, cookie=%llu, timeout=%llu\n",
+	printf("MESSAGE: %s (%llu bytes) flags=0x%llx, %s → %s, cookie=%llu, timeout=%llu, priority=%lld, seqnum=%llu\n",
 		enum_PAYLOAD(msg->payload_type), (unsigned long long) msg->size,
 		(unsigned long long) msg->flags,
 		msg_id(msg->src_id, buf), msg_id(msg->dst_id, buf),
-		(unsigned long long) msg->cookie, (unsigned long long) msg->timeout_ns);
+		(unsigned long long) msg->cookie, (unsigned long long) msg->timeout_ns,
+		(long long) msg->priority,
+		(unsigned long long) msg->seqnum);
 
 	KDBUS_PART_FOREACH(item, msg, items) {
 		if (item->size <= KDBUS_PART_HEADER_SIZE) {
@@ -444,23 +448,30 @@ int name_release(struct conn *conn, const char *name)
 int name_list(struct conn *conn)
 {
 	uint64_t size = 0xffff;
-	struct kdbus_cmd_names *names;
+	struct kdbus_cmd_name_list *names;
 	struct kdbus_cmd_name *name;
+	uint64_t cursor = 0;
 	int ret;
 
 	names = alloca(size);
-	memset(names, 0, size);
-	names->size = size;
-
-	ret = ioctl(conn->fd, KDBUS_CMD_NAME_LIST, names);
-	if (ret) {
-		fprintf(stderr, "error listing names: %d (%m)\n", ret);
-		return EXIT_FAILURE;
-	}
 
 	printf("REGISTRY:\n");
-	KDBUS_PART_FOREACH(name, names, names)
-		printf("  '%s' is acquired by id %llx\n", name->name, name->id);
+	do {
+		memset(names, 0, size);
+		names->size = size;
+		names->cursor = cursor;
+
+		ret = ioctl(conn->fd, KDBUS_CMD_NAME_LIST_CURSOR, names);
+		if (ret) {
+			fprintf(stderr, "error listing names: %d (%m)\n", ret);
+			return EXIT_FAILURE;
+		}
+
+		KDBUS_PART_FOREACH(name, names, names)
+			printf("  '%s' is acquired by id %llx\n", name->name, name->id);
+
+		cursor = names->cursor;
+	} while (cursor);
 	printf("\n");
 
 	return 0;
@@ -0,0 +1,1412 @@
+/*
+ * Copyright (C) 2013 Kay Sievers
+ *
+ * kdbus is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+//#include "include/uapi/kdbus/kdbus.h"
+#include "../kdbus.h"
+
+#include "kdbus-util.h"
+#include "kdbus-enum.h"
+
+/* CPUs to pin the sending and the receiving threads to, -1: not pinned */
+static int cpu_send = -1;
+static int cpu_recv = -1;
+
+/* the CPUs the process may run on, before the main thread was pinned */
+static cpu_set_t cpus_all;
+
+/* the CPU set to run on, all CPUs of the process if cpu is -1 */
+static void cpu_set_for(cpu_set_t *set, int cpu)
+{
+	if (cpu < 0) {
+		*set = cpus_all;
+		return;
+	}
+
+	CPU_ZERO(set);
+	CPU_SET(cpu, set);
+}
+
+static int pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return 0;
+
+	cpu_set_for(&set, cpu);
+	return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* start a thread which does not inherit the CPU of the main thread */
+static int thread_start(pthread_t *thread, void *(*fn)(void *), void *data,
+			int cpu)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int ret;
+
+	ret = pthread_attr_init(&attr);
+	if (ret != 0)
+		return -ret;
+
+	cpu_set_for(&set, cpu);
+	ret = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	if (ret == 0)
+		ret = pthread_create(thread, &attr, fn, data);
+
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		fprintf(stderr, "unable to start thread on CPU %d: %s\n",
+			cpu, strerror(ret));
+		return -ret;
+	}
+
+	return 0;
+}
+
+struct poller {
+	pthread_t thread;
+	struct conn *conn;
+	int stop_fd;
+	long wakeups;
+};
+
+static int make_bus(char **path, uint64_t bloom_size)
+{
+	struct {
+		struct kdbus_cmd_bus_make head;
+
+		/* name item */
+		uint64_t n_size;
+		uint64_t n_type;
+		char name[64];
+	} __attribute__ ((__aligned__(8))) bus_make;
+	int fdc;
+
+	fdc = open("/dev/kdbus/control", O_RDWR|O_CLOEXEC);
+	if (fdc < 0) {
+		fprintf(stderr, "--- error %d (%m)\n", fdc);
+		return -1;
+	}
+
+	memset(&bus_make, 0, sizeof(bus_make));
+	bus_make.head.bloom_size = bloom_size;
+
+	snprintf(bus_make.name, sizeof(bus_make.name), "%u-benchbus-%u-%llu",
+		 getuid(), getpid(), (unsigned long long)bloom_size);
+	bus_make.n_type = KDBUS_MAKE_NAME;
+	bus_make.n_size = KDBUS_PART_HEADER_SIZE + strlen(bus_make.name) + 1;
+
+	bus_make.head.size = sizeof(struct kdbus_cmd_bus_make) +
+			     bus_make.n_size;
+
+	if (ioctl(fdc, KDBUS_CMD_BUS_MAKE, &bus_make) < 0) {
+		fprintf(stderr, "--- error creating bus (%m)\n");
+		close(fdc);
+		return -1;
+	}
+
+	if (asprintf(path, "/dev/kdbus/%s/bus", bus_make.name) < 0) {
+		close(fdc);
+		return -1;
+	}
+
+	return fdc;
+}
+
+static void disconnect(struct conn *conn)
+{
+	munmap(conn->buf, conn->size);
+	close(conn->fd);
+	free(conn);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* send a small unicast message with a single payload vector */
+static int send_small(const struct conn *conn, uint64_t dst_id, uint64_t cookie)
+{
+	static const char payload[8] = "kdbus!!";
+	struct kdbus_msg *msg;
+	struct kdbus_item *item;
+	uint64_t size;
+	int ret;
+
+	size = sizeof(struct kdbus_msg);
+	size += KDBUS_ITEM_SIZE(sizeof(struct kdbus_vec));
+
+	msg = alloca(size);
+	memset(msg, 0, size);
+	msg->size = size;
+	msg->dst_id = dst_id;
+	msg->cookie = cookie;
+	msg->payload_type = KDBUS_PAYLOAD_DBUS1;
+
+	item = msg->items;
+	item->type = KDBUS_MSG_PAYLOAD_VEC;
+	item->size = KDBUS_PART_HEADER_SIZE + sizeof(struct kdbus_vec);
+	item->vec.address = (uint64_t)payload;
+	item->vec.size = sizeof(payload);
+
+	ret = ioctl(conn->fd, KDBUS_CMD_MSG_SEND, msg);
+	if (ret < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* receive and immediately release the next queued message */
+static int recv_release(const struct conn *conn)
+{
+	uint64_t off;
+
+	if (ioctl(conn->fd, KDBUS_CMD_MSG_RECV, &off) < 0)
+		return -errno;
+
+	if (ioctl(conn->fd, KDBUS_CMD_MSG_RELEASE, &off) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static long thread_nvcsw(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru) < 0)
+		return 0;
+
+	return ru.ru_nvcsw;
+}
+
+/* An idle connection which never gets a message. Every time its poll()
+ * sleeps and gets woken up, a voluntary context switch is accounted. */
+static void *poller_thread(void *userdata)
+{
+	struct poller *p = userdata;
+	struct pollfd fds[2];
+	long start;
+
+	fds[0].fd = p->conn->fd;
+	fds[1].fd = p->stop_fd;
+
+	start = thread_nvcsw();
+
+	for (;;) {
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+			break;
+
+		if (fds[1].revents & POLLIN)
+			break;
+
+		/* an idle poller must never see a message */
+		if (fds[0].revents & POLLIN)
+			recv_release(p->conn);
+	}
+
+	/* do not account the final wakeup which stopped us */
+	p->wakeups = thread_nvcsw() - start - 1;
+	return NULL;
+}
+
+static int bench_wakeup(const char *bus, unsigned int n_pollers,
+			unsigned int n_msgs)
+{
+	struct conn *conn_src, *conn_dst;
+	struct poller *pollers;
+	int stop[2];
+	uint64_t start, duration;
+	long wakeups = 0;
+	unsigned int i, sent;
+	int ret = 0;
+
+	conn_src = connect_to_bus(bus);
+	conn_dst = connect_to_bus(bus);
+	if (!conn_src || !conn_dst)
+		return EXIT_FAILURE;
+
+	if (pipe2(stop, O_CLOEXEC) < 0)
+		return EXIT_FAILURE;
+
+	pollers = calloc(n_pollers, sizeof(*pollers));
+	if (!pollers)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < n_pollers; i++) {
+		pollers[i].conn = connect_to_bus(bus);
+		if (!pollers[i].conn)
+			return EXIT_FAILURE;
+
+		pollers[i].stop_fd = stop[0];
+		if (thread_start(&pollers[i].thread, poller_thread,
+				 &pollers[i], -1) < 0)
+			return EXIT_FAILURE;
+	}
+
+	/* let all pollers settle in poll() */
+	usleep(100 * 1000);
+
+	start = now_ns();
+	for (i = 0; i < n_msgs; i++) {
+		ret = send_small(conn_src, conn_dst->id, i + 1);
+		if (ret < 0) {
+			fprintf(stderr, "error sending message: %s\n",
+				strerror(-ret));
+			break;
+		}
+
+		ret = recv_release(conn_dst);
+		if (ret < 0) {
+			fprintf(stderr, "error receiving message: %s\n",
+				strerror(-ret));
+			break;
+		}
+	}
+	duration = now_ns() - start;
+	sent = i;
+
+	/* wake up and stop all pollers */
+	if (write(stop[1], "x", 1) != 1)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < n_pollers; i++) {
+		pthread_join(pollers[i].thread, NULL);
+		if (pollers[i].wakeups > 0)
+			wakeups += pollers[i].wakeups;
+		disconnect(pollers[i].conn);
+	}
+
+	printf("wakeup: pollers=%5u messages=%u wakeups/msg=%.3f ns/msg=%llu\n",
+	       n_pollers, sent, sent > 0 ? (double)wakeups / sent : 0.0,
+	       sent > 0 ? (unsigned long long)(duration / sent) : 0ULL);
+
+	close(stop[0]);
+	close(stop[1]);
+	free(pollers);
+	disconnect(conn_src);
+	disconnect(conn_dst);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int add_match_bloom(const struct conn *conn, const uint64_t *mask,
+			   uint64_t bloom_size, uint64_t cookie)
+{
+	struct kdbus_cmd_match *cmd_match;
+	struct kdbus_item *item;
+	uint64_t size;
+
+	size = sizeof(struct kdbus_cmd_match) + KDBUS_ITEM_SIZE(bloom_size);
+	cmd_match = alloca(size);
+	memset(cmd_match, 0, size);
+	cmd_match->size = size;
+	cmd_match->cookie = cookie;
+	cmd_match->src_id = KDBUS_MATCH_SRC_ID_ANY;
+
+	item = cmd_match->items;
+	item->type = KDBUS_MATCH_BLOOM;
+	item->size = KDBUS_PART_HEADER_SIZE + bloom_size;
+	memcpy(item->data, mask, bloom_size);
+
+	if (ioctl(conn->fd, KDBUS_CMD_MATCH_ADD, cmd_match) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int send_broadcast(const struct conn *conn, const uint64_t *bloom,
+			  uint64_t bloom_size, uint64_t cookie)
+{
+	struct kdbus_msg *msg;
+	struct kdbus_item *item;
+	uint64_t size;
+
+	size = sizeof(struct kdbus_msg) + KDBUS_ITEM_SIZE(bloom_size);
+	msg = alloca(size);
+	memset(msg, 0, size);
+	msg->size = size;
+	msg->dst_id = KDBUS_DST_ID_BROADCAST;
+	msg->cookie = cookie;
+	msg->payload_type = KDBUS_PAYLOAD_DBUS1;
+
+	item = msg->items;
+	item->type = KDBUS_MSG_BLOOM;
+	item->size = KDBUS_PART_HEADER_SIZE + bloom_size;
+	memcpy(item->data, bloom, bloom_size);
+
+	if (ioctl(conn->fd, KDBUS_CMD_MSG_SEND, msg) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void bloom_set(uint64_t *bloom, unsigned int bit)
+{
+	bloom[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static bool bloom_test(const uint64_t *bloom, unsigned int bit)
+{
+	return bloom[bit / 64] & (1ULL << (bit % 64));
+}
+
+/*
+ * A broadcast with a few bloom bits set. One receiver has a matching rule
+ * and drains the messages; all other connections have rules which share one
+ * bit with the message, like a common member name, but miss one other bit
+ * of it. The cost per broadcast is the cost of the match path.
+ */
+static int bench_match(uint64_t bloom_size, unsigned int n_conns,
+		       unsigned int n_rules, unsigned int n_msgs)
+{
+	unsigned int bits = bloom_size * 8;
+	struct conn *conn_src, *conn_dst;
+	struct conn **conns;
+	uint64_t *filter, *mask;
+	uint64_t start, duration;
+	unsigned int i, j;
+	char *bus;
+	int fdc;
+	int ret = 0;
+
+	fdc = make_bus(&bus, bloom_size);
+	if (fdc < 0)
+		return EXIT_FAILURE;
+
+	filter = calloc(1, bloom_size);
+	mask = calloc(1, bloom_size);
+	conns = calloc(n_conns, sizeof(*conns));
+	if (!filter || !mask || !conns)
+		return EXIT_FAILURE;
+
+	/* the properties of the message; bit 0 is shared with all rules */
+	bloom_set(filter, 0);
+	for (i = 0; i < 8; i++)
+		bloom_set(filter, rand() % bits);
+
+	conn_src = connect_to_bus(bus);
+	conn_dst = connect_to_bus(bus);
+	if (!conn_src || !conn_dst)
+		return EXIT_FAILURE;
+
+	if (add_match_bloom(conn_dst, filter, bloom_size, 1) < 0)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < n_conns; i++) {
+		conns[i] = connect_to_bus(bus);
+		if (!conns[i])
+			return EXIT_FAILURE;
+
+		for (j = 0; j < n_rules; j++) {
+			unsigned int bit;
+
+			memset(mask, 0, bloom_size);
+			bloom_set(mask, 0);
+
+			do {
+				bit = rand() % bits;
+			} while (bloom_test(filter, bit));
+			bloom_set(mask, bit);
+
+			if (add_match_bloom(conns[i], mask, bloom_size, j + 1) < 0)
+				return EXIT_FAILURE;
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < n_msgs; i++) {
+		ret = send_broadcast(conn_src, filter, bloom_size, i + 1);
+		if (ret < 0) {
+			fprintf(stderr, "error sending broadcast: %s\n",
+				strerror(-ret));
+			break;
+		}
+
+		ret = recv_release(conn_dst);
+		if (ret < 0) {
+			fprintf(stderr, "error receiving broadcast: %s\n",
+				strerror(-ret));
+			break;
+		}
+	}
+	duration = now_ns() - start;
+
+	printf("match: bloom=%4llu conns=%5u rules=%4u ns/broadcast=%llu\n",
+	       (unsigned long long)bloom_size, n_conns, n_rules,
+	       i > 0 ? (unsigned long long)(duration / i) : 0ULL);
+
+	for (i = 0; i < n_conns; i++)
+		disconnect(conns[i]);
+	disconnect(conn_src);
+	disconnect(conn_dst);
+	free(conns);
+	free(filter);
+	free(mask);
+	close(fdc);
+	free(bus);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* the latencies of all messages of a run */
+struct samples {
+	uint64_t *ns;
+	unsigned int count;
+	uint64_t duration;
+};
+
+static int samples_init(struct samples *s, unsigned int n)
+{
+	s->ns = calloc(n ? n : 1, sizeof(uint64_t));
+	s->count = 0;
+	s->duration = 0;
+	return s->ns ? 0 : -ENOMEM;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* the latency which the given per mille of all messages did not exceed */
+static uint64_t samples_pct(const struct samples *s, unsigned int permille)
+{
+	if (s->count == 0)
+		return 0;
+
+	return s->ns[(uint64_t)(s->count - 1) * permille / 1000];
+}
+
+static void samples_report(const char *bench, const char *params,
+			   struct samples *s)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	qsort(s->ns, s->count, sizeof(uint64_t), cmp_u64);
+	for (i = 0; i < s->count; i++)
+		sum += s->ns[i];
+
+	printf("%s: %s msgs=%u msgs/s=%.0f mean=%lluns p50=%lluns p99=%lluns p999=%lluns\n",
+	       bench, params, s->count,
+	       s->duration > 0 ? s->count * 1e9 / s->duration : 0.0,
+	       s->count > 0 ? (unsigned long long)(sum / s->count) : 0ULL,
+	       (unsigned long long)samples_pct(s, 500),
+	       (unsigned long long)samples_pct(s, 990),
+	       (unsigned long long)samples_pct(s, 999));
+
+	free(s->ns);
+	s->ns = NULL;
+}
+
+/* a message of the benchmarks, with its payload and the files to pass */
+struct bench_msg {
+	uint64_t dst_id;
+	const char *dst_name;		/* used instead of dst_id */
+	uint64_t cookie;
+	uint64_t flags;
+	uint64_t timeout_ns;		/* of a call */
+	uint64_t cookie_reply;		/* of a reply */
+	const void *vec;
+	uint64_t vec_size;
+	int memfd;			/* -1: none */
+	uint64_t memfd_size;
+	const int *fds;
+	unsigned int fds_count;
+};
+
+static int send_msg(const struct conn *conn, const struct bench_msg *m)
+{
+	struct kdbus_msg *msg;
+	struct kdbus_item *item;
+	uint64_t size;
+
+	size = sizeof(struct kdbus_msg);
+	if (m->dst_name)
+		size += KDBUS_ITEM_SIZE(strlen(m->dst_name) + 1);
+	if (m->vec_size > 0)
+		size += KDBUS_ITEM_SIZE(sizeof(struct kdbus_vec));
+	if (m->memfd >= 0)
+		size += KDBUS_ITEM_SIZE(sizeof(struct kdbus_memfd));
+	if (m->fds_count > 0)
+		size += KDBUS_ITEM_SIZE(m->fds_count * sizeof(int));
+
+	msg = alloca(size);
+	memset(msg, 0, size);
+	msg->size = size;
+	msg->flags = m->flags;
+	msg->dst_id = m->dst_name ? KDBUS_DST_ID_WELL_KNOWN_NAME : m->dst_id;
+	msg->cookie = m->cookie;
+	if (m->flags & KDBUS_MSG_FLAGS_EXPECT_REPLY)
+		msg->timeout_ns = m->timeout_ns;
+	else
+		msg->cookie_reply = m->cookie_reply;
+	msg->payload_type = KDBUS_PAYLOAD_DBUS1;
+
+	item = msg->items;
+
+	if (m->dst_name) {
+		item->type = KDBUS_MSG_DST_NAME;
+		item->size = KDBUS_PART_HEADER_SIZE + strlen(m->dst_name) + 1;
+		strcpy(item->str, m->dst_name);
+		item = KDBUS_PART_NEXT(item);
+	}
+
+	if (m->vec_size > 0) {
+		item->type = KDBUS_MSG_PAYLOAD_VEC;
+		item->size = KDBUS_PART_HEADER_SIZE + sizeof(struct kdbus_vec);
+		item->vec.address = (uint64_t)(uintptr_t)m->vec;
+		item->vec.size = m->vec_size;
+		item = KDBUS_PART_NEXT(item);
+	}
+
+	if (m->memfd >= 0) {
+		item->type = KDBUS_MSG_PAYLOAD_MEMFD;
+		item->size = KDBUS_PART_HEADER_SIZE + sizeof(struct kdbus_memfd);
+		item->memfd.size = m->memfd_size;
+		item->memfd.fd = m->memfd;
+		item = KDBUS_PART_NEXT(item);
+	}
+
+	if (m->fds_count > 0) {
+		item->type = KDBUS_MSG_FDS;
+		item->size = KDBUS_PART_HEADER_SIZE + m->fds_count * sizeof(int);
+		memcpy(item->fds, m->fds, m->fds_count * sizeof(int));
+	}
+
+	if (ioctl(conn->fd, KDBUS_CMD_MSG_SEND, msg) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* wait for the next message and return its offset in the pool */
+static int recv_wait(const struct conn *conn, uint64_t *off)
+{
+	struct pollfd fd = { .fd = conn->fd, .events = POLLIN };
+
+	for (;;) {
+		if (ioctl(conn->fd, KDBUS_CMD_MSG_RECV, off) == 0)
+			return 0;
+
+		if (errno != EAGAIN)
+			return -errno;
+
+		if (poll(&fd, 1, 10 * 1000) <= 0)
+			return -ETIMEDOUT;
+	}
+}
+
+static volatile uint8_t touch_sink;
+
+/* read one byte of every page, like a receiver looking at the data */
+static void touch(const uint8_t *p, uint64_t size)
+{
+	uint8_t sum = 0;
+	uint64_t i;
+
+	for (i = 0; i < size; i += 4096)
+		sum += p[i];
+
+	touch_sink = sum;
+}
+
+/* look at the payload of a received message and close its files */
+static int msg_consume(const struct conn *conn, const struct kdbus_msg *msg)
+{
+	const struct kdbus_item *item;
+	int ret = 0;
+
+	KDBUS_PART_FOREACH(item, msg, items) {
+		switch (item->type) {
+		case KDBUS_MSG_PAYLOAD_OFF:
+			if (item->vec.offset != ~0ULL)
+				touch((const uint8_t *)conn->buf + item->vec.offset,
+				      item->vec.size);
+			break;
+
+		case KDBUS_MSG_PAYLOAD_MEMFD: {
+			void *p;
+
+			p = mmap(NULL, item->memfd.size, PROT_READ, MAP_SHARED,
+				 item->memfd.fd, 0);
+			if (p == MAP_FAILED) {
+				ret = -errno;
+			} else {
+				touch(p, item->memfd.size);
+				munmap(p, item->memfd.size);
+			}
+			close(item->memfd.fd);
+			break;
+		}
+
+		case KDBUS_MSG_FDS: {
+			unsigned int i, n;
+
+			n = (item->size - KDBUS_PART_HEADER_SIZE) / sizeof(int);
+			for (i = 0; i < n; i++)
+				close(item->fds[i]);
+			break;
+		}
+		}
+	}
+
+	return ret;
+}
+
+/* create, fill and seal a memfd, like a sender of a large payload */
+static int memfd_make(const struct conn *conn, const void *data,
+		      uint64_t size)
+{
+	struct kdbus_cmd_memfd_make mfd = { .size = size };
+	int ret;
+
+	if (ioctl(conn->fd, KDBUS_CMD_MEMFD_MAKE, &mfd) < 0)
+		return -errno;
+
+	if (pwrite(mfd.fd, data, size, 0) != (ssize_t)size) {
+		ret = -errno;
+		close(mfd.fd);
+		return ret;
+	}
+
+	if (ioctl(mfd.fd, KDBUS_CMD_MEMFD_SEAL_SET, 1) < 0) {
+		ret = -errno;
+		close(mfd.fd);
+		return ret;
+	}
+
+	return mfd.fd;
+}
+
+/* the calls of a ping-pong run */
+struct pingpong {
+	const char *dst_name;		/* address the server by name */
+	unsigned int n_names;		/* other names on the bus */
+	uint64_t vec_size;
+	uint64_t memfd_size;
+	unsigned int fds_count;
+};
+
+struct pingpong_server {
+	pthread_t thread;
+	struct conn *conn;
+	unsigned int n_msgs;
+	int ret;
+};
+
+/* look at every call and answer it with a small reply */
+static void *pingpong_server_thread(void *userdata)
+{
+	static const char pong[8] = "pong";
+	struct pingpong_server *srv = userdata;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < srv->n_msgs; i++) {
+		const struct kdbus_msg *msg;
+		struct bench_msg m = {
+			.memfd = -1,
+			.vec = pong,
+			.vec_size = sizeof(pong),
+		};
+		uint64_t off;
+
+		ret = recv_wait(srv->conn, &off);
+		if (ret < 0)
+			break;
+
+		msg = (const struct kdbus_msg *)((uint8_t *)srv->conn->buf + off);
+		m.dst_id = msg->src_id;
+		m.cookie = msg->cookie;
+		m.cookie_reply = msg->cookie;
+
+		ret = msg_consume(srv->conn, msg);
+		if (ioctl(srv->conn->fd, KDBUS_CMD_MSG_RELEASE, &off) < 0 &&
+		    ret == 0)
+			ret = -errno;
+		if (ret < 0)
+			break;
+
+		ret = send_msg(srv->conn, &m);
+		if (ret < 0)
+			break;
+	}
+
+	srv->ret = ret;
+	return NULL;
+}
+
+/*
+ * Method calls and their replies between two threads, the latency is the
+ * round trip of one call. The payload of the call is looked at by the
+ * server, passed files are closed again.
+ */
+static int bench_pingpong(const char *bench, const char *bus,
+			  const struct pingpong *pp, unsigned int n_msgs)
+{
+	struct pingpong_server srv = {};
+	struct conn *conn_src;
+	struct conn **others = NULL;
+	struct samples s;
+	uint64_t start, size;
+	uint8_t *data;
+	char params[128];
+	int fds[253];
+	unsigned int i;
+	int ret = 0;
+
+	if (pp->fds_count > ELEMENTSOF(fds))
+		return EXIT_FAILURE;
+
+	conn_src = connect_to_bus(bus);
+	srv.conn = connect_to_bus(bus);
+	if (!conn_src || !srv.conn)
+		return EXIT_FAILURE;
+
+	if (pp->dst_name) {
+		if (name_acquire(srv.conn, pp->dst_name, 0) != 0)
+			return EXIT_FAILURE;
+
+		/* the name is looked up among all the others */
+		others = calloc(pp->n_names, sizeof(*others));
+		if (pp->n_names > 0 && !others)
+			return EXIT_FAILURE;
+
+		for (i = 0; i < pp->n_names; i++) {
+			char name[64];
+
+			others[i] = connect_to_bus(bus);
+			if (!others[i])
+				return EXIT_FAILURE;
+
+			snprintf(name, sizeof(name), "org.kdbus.bench.other%u", i);
+			if (name_acquire(others[i], name, 0) != 0)
+				return EXIT_FAILURE;
+		}
+	}
+
+	size = pp->vec_size > pp->memfd_size ? pp->vec_size : pp->memfd_size;
+	data = malloc(size > 0 ? size : 1);
+	if (!data)
+		return EXIT_FAILURE;
+	memset(data, 'k', size);
+
+	for (i = 0; i < pp->fds_count; i++) {
+		fds[i] = open("/dev/null", O_RDONLY|O_CLOEXEC);
+		if (fds[i] < 0)
+			return EXIT_FAILURE;
+	}
+
+	if (samples_init(&s, n_msgs) < 0)
+		return EXIT_FAILURE;
+
+	srv.n_msgs = n_msgs;
+	if (thread_start(&srv.thread, pingpong_server_thread, &srv,
+			 cpu_recv) < 0)
+		return EXIT_FAILURE;
+
+	start = now_ns();
+	for (i = 0; i < n_msgs; i++) {
+		struct bench_msg m = {
+			.dst_id = srv.conn->id,
+			.dst_name = pp->dst_name,
+			.cookie = i + 1,
+			.flags = KDBUS_MSG_FLAGS_EXPECT_REPLY,
+			.timeout_ns = 10ULL * 1000 * 1000 * 1000,
+			.vec = data,
+			.vec_size = pp->vec_size,
+			.memfd = -1,
+			.fds = fds,
+			.fds_count = pp->fds_count,
+		};
+		uint64_t t, off;
+
+		t = now_ns();
+
+		if (pp->memfd_size > 0) {
+			m.memfd = memfd_make(conn_src, data, pp->memfd_size);
+			if (m.memfd < 0) {
+				ret = m.memfd;
+				break;
+			}
+			m.memfd_size = pp->memfd_size;
+		}
+
+		ret = send_msg(conn_src, &m);
+		if (m.memfd >= 0)
+			close(m.memfd);
+		if (ret < 0) {
+			fprintf(stderr, "error sending call: %s\n", strerror(-ret));
+			break;
+		}
+
+		ret = recv_wait(conn_src, &off);
+		if (ret < 0) {
+			fprintf(stderr, "error receiving reply: %s\n",
+				strerror(-ret));
+			break;
+		}
+
+		if (ioctl(conn_src->fd, KDBUS_CMD_MSG_RELEASE, &off) < 0) {
+			ret = -errno;
+			break;
+		}
+
+		s.ns[s.count++] = now_ns() - t;
+	}
+	s.duration = now_ns() - start;
+
+	pthread_join(srv.thread, NULL);
+	if (ret == 0 && srv.ret < 0) {
+		fprintf(stderr, "error in server: %s\n", strerror(-srv.ret));
+		ret = srv.ret;
+	}
+
+	snprintf(params, sizeof(params),
+		 "vec=%7llu memfd=%7llu fds=%3u names=%5u",
+		 (unsigned long long)pp->vec_size,
+		 (unsigned long long)pp->memfd_size, pp->fds_count,
+		 pp->dst_name ? pp->n_names + 1 : 0);
+	samples_report(bench, params, &s);
+
+	for (i = 0; i < pp->fds_count; i++)
+		close(fds[i]);
+	for (i = 0; others && i < pp->n_names; i++)
+		disconnect(others[i]);
+	free(others);
+	free(data);
+	disconnect(srv.conn);
+	disconnect(conn_src);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+struct unix_server {
+	pthread_t thread;
+	int fd;
+	unsigned int n_msgs;
+	uint64_t size;
+	int ret;
+};
+
+static void *unix_server_thread(void *userdata)
+{
+	static const char pong[8] = "pong";
+	struct unix_server *srv = userdata;
+	uint8_t *buf;
+	unsigned int i;
+	int ret = 0;
+
+	buf = malloc(srv->size);
+	if (!buf) {
+		srv->ret = -ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < srv->n_msgs; i++) {
+		ssize_t n;
+
+		n = recv(srv->fd, buf, srv->size, 0);
+		if (n <= 0) {
+			ret = n < 0 ? -errno : -ECONNRESET;
+			break;
+		}
+
+		touch(buf, n);
+
+		if (send(srv->fd, pong, sizeof(pong), 0) != sizeof(pong)) {
+			ret = -errno;
+			break;
+		}
+	}
+
+	free(buf);
+	srv->ret = ret;
+	return NULL;
+}
+
+/* the same calls over an AF_UNIX socket pair, as a baseline */
+static int bench_unix(uint64_t size, unsigned int n_msgs)
+{
+	struct unix_server srv = {};
+	struct samples s;
+	uint8_t *data, reply[8];
+	uint64_t start;
+	char params[64];
+	int sv[2];
+	int sndbuf;
+	unsigned int i;
+	int ret = 0;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) < 0)
+		return EXIT_FAILURE;
+
+	/* a datagram needs to fit into the send buffer as a whole */
+	sndbuf = size * 2 + 4096;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	data = malloc(size);
+	if (!data)
+		return EXIT_FAILURE;
+	memset(data, 'k', size);
+
+	if (samples_init(&s, n_msgs) < 0)
+		return EXIT_FAILURE;
+
+	srv.fd = sv[1];
+	srv.n_msgs = n_msgs;
+	srv.size = size;
+	if (thread_start(&srv.thread, unix_server_thread, &srv, cpu_recv) < 0)
+		return EXIT_FAILURE;
+
+	start = now_ns();
+	for (i = 0; i < n_msgs; i++) {
+		uint64_t t = now_ns();
+
+		if (send(sv[0], data, size, 0) != (ssize_t)size) {
+			ret = -errno;
+			fprintf(stderr, "error sending: %m\n");
+			break;
+		}
+
+		if (recv(sv[0], reply, sizeof(reply), 0) <= 0) {
+			ret = -errno;
+			fprintf(stderr, "error receiving: %m\n");
+			break;
+		}
+
+		s.ns[s.count++] = now_ns() - t;
+	}
+	s.duration = now_ns() - start;
+
+	/* a server still waiting for a call sees the end of the socket */
+	shutdown(sv[0], SHUT_RDWR);
+	pthread_join(srv.thread, NULL);
+	if (ret == 0 && srv.ret < 0) {
+		fprintf(stderr, "error in server: %s\n", strerror(-srv.ret));
+		ret = srv.ret;
+	}
+
+	snprintf(params, sizeof(params), "size=%7llu",
+		 (unsigned long long)size);
+	samples_report("unix", params, &s);
+
+	close(sv[0]);
+	close(sv[1]);
+	free(data);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * A broadcast which every subscriber matches with one of its rules, the
+ * other rules of the subscribers never match. The latency and the
+ * throughput are the ones of the send, which includes the fan-out to all
+ * subscribers; draining the subscribers after every broadcast is timed
+ * separately.
+ */
+static int bench_broadcast(uint64_t bloom_size, unsigned int n_subs,
+			   unsigned int n_rules, unsigned int n_msgs)
+{
+	unsigned int bits = bloom_size * 8;
+	struct conn *conn_src;
+	struct conn **subs;
+	uint64_t *filter, *mask;
+	struct samples s;
+	uint64_t drain = 0;
+	char params[96];
+	unsigned int i, j;
+	char *bus;
+	int fdc;
+	int ret = 0;
+
+	fdc = make_bus(&bus, bloom_size);
+	if (fdc < 0)
+		return EXIT_FAILURE;
+
+	filter = calloc(1, bloom_size);
+	mask = calloc(1, bloom_size);
+	subs = calloc(n_subs, sizeof(*subs));
+	if (!filter || !mask || !subs)
+		return EXIT_FAILURE;
+
+	bloom_set(filter, 0);
+	for (i = 0; i < 8; i++)
+		bloom_set(filter, rand() % bits);
+
+	conn_src = connect_to_bus(bus);
+	if (!conn_src)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < n_subs; i++) {
+		subs[i] = connect_to_bus(bus);
+		if (!subs[i])
+			return EXIT_FAILURE;
+
+		if (add_match_bloom(subs[i], filter, bloom_size, 1) < 0)
+			return EXIT_FAILURE;
+
+		for (j = 1; j < n_rules; j++) {
+			unsigned int bit;
+
+			memset(mask, 0, bloom_size);
+			bloom_set(mask, 0);
+
+			do {
+				bit = rand() % bits;
+			} while (bloom_test(filter, bit));
+			bloom_set(mask, bit);
+
+			if (add_match_bloom(subs[i], mask, bloom_size, j + 1) < 0)
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (samples_init(&s, n_msgs) < 0)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < n_msgs; i++) {
+		uint64_t t = now_ns();
+
+		ret = send_broadcast(conn_src, filter, bloom_size, i + 1);
+		if (ret < 0) {
+			fprintf(stderr, "error sending broadcast: %s\n",
+				strerror(-ret));
+			break;
+		}
+		s.ns[s.count] = now_ns() - t;
+		s.duration += s.ns[s.count++];
+
+		t = now_ns();
+		for (j = 0; j < n_subs; j++) {
+			ret = recv_release(subs[j]);
+			if (ret < 0) {
+				fprintf(stderr, "error receiving broadcast: %s\n",
+					strerror(-ret));
+				break;
+			}
+		}
+		drain += now_ns() - t;
+		if (ret < 0)
+			break;
+	}
+
+	snprintf(params, sizeof(params),
+		 "subscribers=%5u rules=%4u drain=%lluns",
+		 n_subs, n_rules,
+		 s.count > 0 ? (unsigned long long)(drain / s.count) : 0ULL);
+	samples_report("broadcast", params, &s);
+
+	for (i = 0; i < n_subs; i++)
+		disconnect(subs[i]);
+	disconnect(conn_src);
+	free(subs);
+	free(filter);
+	free(mask);
+	close(fdc);
+	free(bus);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static bool bench_selected(int argc, char *argv[], const char *name)
+{
+	int i;
+
+	for (i = optind; i < argc; i++)
+		if (strcmp(argv[i], name) == 0)
+			return true;
+
+	return false;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [OPTIONS] [wakeup|match|pingpong|names|payload|fds|broadcast|unix]...\n"
+		"  -p N  maximum number of idle pollers (default 256)\n"
+		"  -n N  number of messages per run (default 10000)\n"
+		"  -b N  bloom size in bytes (default 64, 128, 256, 512)\n"
+		"  -c N  number of other connections: non-matching ones, the\n"
+		"        most broadcast subscribers, and other names (default 100)\n"
+		"  -r N  number of match rules per connection (default 300)\n"
+		"  -l N  payload size in bytes (default 4096, 65536, 1048576)\n"
+		"  -s N  pin the sending thread to CPU N\n"
+		"  -d N  pin the receiving thread to CPU N\n",
+		argv0);
+}
+
+static int run_wakeup(unsigned int max_pollers, unsigned int n_msgs)
+{
+	unsigned int n;
+	char *bus;
+	int fdc;
+	int ret = EXIT_SUCCESS;
+
+	fdc = make_bus(&bus, 64);
+	if (fdc < 0)
+		return EXIT_FAILURE;
+
+	/* wakeups per message with a growing number of idle pollers */
+	for (n = 0; n <= max_pollers; n = n ? n * 4 : 1) {
+		ret = bench_wakeup(bus, n, n_msgs);
+		if (ret != EXIT_SUCCESS)
+			break;
+	}
+
+	close(fdc);
+	free(bus);
+	return ret;
+}
+
+static int run_match(uint64_t bloom_size, unsigned int n_conns,
+		     unsigned int n_rules, unsigned int n_msgs)
+{
+	static const uint64_t sizes[] = { 64, 128, 256, 512 };
+	unsigned int i;
+	int ret;
+
+	if (bloom_size > 0)
+		return bench_match(bloom_size, n_conns, n_rules, n_msgs);
+
+	for (i = 0; i < ELEMENTSOF(sizes); i++) {
+		ret = bench_match(sizes[i], n_conns, n_rules, n_msgs);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int run_pingpong(const char *bench, const struct pingpong *pp,
+			unsigned int n, unsigned int n_msgs)
+{
+	char *bus;
+	int fdc;
+	int ret = EXIT_SUCCESS;
+	unsigned int i;
+
+	fdc = make_bus(&bus, 64);
+	if (fdc < 0)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < n; i++) {
+		ret = bench_pingpong(bench, bus, &pp[i], n_msgs);
+		if (ret != EXIT_SUCCESS)
+			break;
+	}
+
+	close(fdc);
+	free(bus);
+	return ret;
+}
+
+static int run_payload(uint64_t payload_size, unsigned int n_msgs)
+{
+	static const uint64_t sizes[] = { 4096, 65536, 1048576 };
+	struct pingpong pp[2 * ELEMENTSOF(sizes)] = {};
+	unsigned int i, n = 0;
+
+	/* the same payload once inline and once as a memfd */
+	for (i = 0; i < ELEMENTSOF(sizes); i++) {
+		uint64_t size = payload_size ? payload_size : sizes[i];
+
+		pp[n++].vec_size = size;
+		pp[n++].memfd_size = size;
+
+		if (payload_size)
+			break;
+	}
+
+	return run_pingpong("payload", pp, n, n_msgs);
+}
+
+static int run_broadcast(unsigned int max_subs, unsigned int n_rules,
+			 unsigned int n_msgs)
+{
+	unsigned int n;
+	int ret = EXIT_SUCCESS;
+
+	/* fan-out with a growing number of subscribers */
+	for (n = 1; n <= max_subs; n *= 10) {
+		ret = bench_broadcast(64, n, 1, n_msgs);
+		if (ret != EXIT_SUCCESS)
+			break;
+
+		if (n_rules > 1) {
+			ret = bench_broadcast(64, n, n_rules, n_msgs);
+			if (ret != EXIT_SUCCESS)
+				break;
+		}
+	}
+
+	return ret;
+}
+
+static int run_unix(uint64_t payload_size, unsigned int n_msgs)
+{
+	static const uint64_t sizes[] = { 8, 4096, 65536 };
+	unsigned int i;
+	int ret;
+
+	if (payload_size > 0)
+		return bench_unix(payload_size, n_msgs);
+
+	for (i = 0; i < ELEMENTSOF(sizes); i++) {
+		ret = bench_unix(sizes[i], n_msgs);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int max_pollers = 256;
+	unsigned int n_msgs = 10000;
+	unsigned int n_conns = 100;
+	unsigned int n_rules = 300;
+	uint64_t bloom_size = 0;
+	uint64_t payload_size = 0;
+	bool all;
+	int ret = EXIT_SUCCESS;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:n:b:c:r:l:s:d:h")) >= 0) {
+		switch (c) {
+		case 'p':
+			max_pollers = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'n':
+			n_msgs = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'b':
+			bloom_size = strtoull(optarg, NULL, 0);
+			break;
+
+		case 'c':
+			n_conns = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'r':
+			n_rules = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'l':
+			payload_size = strtoull(optarg, NULL, 0);
+			break;
+
+		case 's':
+			cpu_send = strtol(optarg, NULL, 0);
+			break;
+
+		case 'd':
+			cpu_recv = strtol(optarg, NULL, 0);
+			break;
+
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	srand(getpid());
+	all = optind >= argc;
+
+	if (sched_getaffinity(0, sizeof(cpus_all), &cpus_all) < 0) {
+		fprintf(stderr, "unable to get the CPUs: %m\n");
+		return EXIT_FAILURE;
+	}
+
+	/* the main thread sends in all runs, all other threads are started
+	 * with their own CPU set */
+	if (pin_cpu(cpu_send) < 0) {
+		fprintf(stderr, "unable to pin to CPU %d\n", cpu_send);
+		return EXIT_FAILURE;
+	}
+
+	if (all || bench_selected(argc, argv, "wakeup"))
+		ret = run_wakeup(max_pollers, n_msgs);
+
+	if (ret == EXIT_SUCCESS && (all || bench_selected(argc, argv, "match")))
+		ret = run_match(bloom_size, n_conns, n_rules, n_msgs);
+
+	if (ret == EXIT_SUCCESS && (all || bench_selected(argc, argv, "pingpong"))) {
+		struct pingpong pp = { .vec_size = 8 };
+
+		ret = run_pingpong("pingpong", &pp, 1, n_msgs);
+	}
+
+	if (ret == EXIT_SUCCESS && (all || bench_selected(argc, argv, "names"))) {
+		struct pingpong pp[] = {
+			{ .vec_size = 8, .dst_name = "org.kdbus.bench", },
+			{ .vec_size = 8, .dst_name = "org.kdbus.bench",
+			  .n_names = n_conns, },
+		};
+
+		ret = run_pingpong("names", pp, ELEMENTSOF(pp), n_msgs);
+	}
+
+	if (ret == EXIT_SUCCESS && (all || bench_selected(argc, argv, "payload")))
+		ret = run_payload(payload_size, n_msgs);
+
+	if (ret == EXIT_SUCCESS && (all || bench_selected(argc, argv, "fds"))) {
+		struct pingpong pp[] = {
+			{ .vec_size = 8, .fds_count = 1, },
+			{ .vec_size = 8, .fds_count = 16, },
+		};
+
+		ret = run_pingpong("fds", pp, ELEMENTSOF(pp), n_msgs);
+	}
+
+	if (ret == EXIT_SUCCESS && (all || bench_selected(argc, argv, "broadcast")))
+		ret = run_broadcast(n_conns, n_rules, n_msgs);
+
+	if (ret == EXIT_SUCCESS && (all || bench_selected(argc, argv, "unix")))
+		ret = run_unix(payload_size, n_msgs);
+
+	return ret;
+}
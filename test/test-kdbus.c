@@ -32,6 +32,49 @@ static void add_match_empty(int fd)
 		fprintf(stderr, "--- error adding conn match: %d (%m)\n", ret);
 }
 
+/* a listing with the generation of the last one only reports a change */
+static int name_list_if_changed(struct conn *conn_a, struct conn *conn_b)
+{
+	struct kdbus_cmd_name_list names;
+	uint64_t generation;
+	int ret;
+
+	/* get the current generation from a listing without names */
+	memset(&names, 0, sizeof(names));
+	names.size = sizeof(names);
+	names.prefix = (uintptr_t)"no.such.name.";
+	ret = ioctl(conn_b->fd, KDBUS_CMD_NAME_LIST_CURSOR, &names);
+	if (ret < 0) {
+		fprintf(stderr, "--- error listing names: %d (%m)\n", ret);
+		return EXIT_FAILURE;
+	}
+	generation = names.generation;
+
+	memset(&names, 0, sizeof(names));
+	names.size = sizeof(names);
+	names.flags = KDBUS_NAME_LIST_IF_CHANGED;
+	names.generation = generation;
+	ret = ioctl(conn_b->fd, KDBUS_CMD_NAME_LIST_CURSOR, &names);
+	if (ret == 0 || errno != EALREADY) {
+		fprintf(stderr, "--- unchanged name list not detected: %d (%m)\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	name_acquire(conn_a, "foo.bar.if.changed", 0);
+
+	names.size = sizeof(names);
+	names.flags = KDBUS_NAME_LIST_IF_CHANGED;
+	names.generation = generation;
+	ret = ioctl(conn_b->fd, KDBUS_CMD_NAME_LIST_CURSOR, &names);
+	name_release(conn_a, "foo.bar.if.changed");
+	if (ret < 0 && errno == EALREADY) {
+		fprintf(stderr, "--- changed name list not detected: %d (%m)\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	struct {
@@ -86,6 +129,9 @@ int main(int argc, char *argv[])
 	name_acquire(conn_b, "foo.bar.baz", KDBUS_NAME_QUEUE);
 	name_list(conn_b);
 
+	if (name_list_if_changed(conn_a, conn_b))
+		return EXIT_FAILURE;
+
 	add_match_empty(conn_a->fd);
 	add_match_empty(conn_b->fd);
 
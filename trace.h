@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2013 Kay Sievers
+ * Copyright (C) 2013 Greg Kroah-Hartman <gregkh@linuxfoundation.org>
+ * Copyright (C) 2013 Linux Foundation
+ *
+ * kdbus is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM kdbus
+
+#if !defined(__KDBUS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __KDBUS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "internal.h"
+#include "message.h"
+
+/*
+ * The latencies are measured from a timestamp the caller took when the
+ * tracepoint was enabled, 0 if it was not.
+ */
+
+/* a message was sent, to one receiver or as a broadcast */
+TRACE_EVENT(kdbus_msg_send,
+	TP_PROTO(const struct kdbus_kmsg *kmsg, int ret, u64 start_ns),
+	TP_ARGS(kmsg, ret, start_ns),
+
+	TP_STRUCT__entry(
+		__field(u64,	src_id)
+		__field(u64,	dst_id)
+		__field(u64,	cookie)
+		__field(u64,	seqnum)
+		__field(u64,	size)
+		__field(int,	ret)
+		__field(u64,	latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->src_id = kmsg->msg.src_id;
+		__entry->dst_id = kmsg->msg.dst_id;
+		__entry->cookie = kmsg->msg.cookie;
+		__entry->seqnum = kmsg->msg.seqnum;
+		__entry->size = kmsg->msg.size + kmsg->vecs_size;
+		__entry->ret = ret;
+		__entry->latency_ns = start_ns ? kdbus_now_ns() - start_ns : 0;
+	),
+
+	TP_printk("src=%llu dst=%llu cookie=%llu seqnum=%llu size=%llu ret=%d latency=%lluns",
+		  __entry->src_id, __entry->dst_id, __entry->cookie,
+		  __entry->seqnum, __entry->size, __entry->ret,
+		  __entry->latency_ns)
+);
+
+/* a message was queued for a receiver, or refused */
+TRACE_EVENT(kdbus_queue_insert,
+	TP_PROTO(u64 conn_id, const struct kdbus_kmsg *kmsg,
+		 unsigned int depth, int ret),
+	TP_ARGS(conn_id, kmsg, depth, ret),
+
+	TP_STRUCT__entry(
+		__field(u64,		conn_id)
+		__field(u64,		src_id)
+		__field(u64,		cookie)
+		__field(s64,		priority)
+		__field(unsigned int,	depth)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->conn_id = conn_id;
+		__entry->src_id = kmsg->msg.src_id;
+		__entry->cookie = kmsg->msg.cookie;
+		__entry->priority = kmsg->msg.priority;
+		__entry->depth = depth;
+		__entry->ret = ret;
+	),
+
+	TP_printk("conn=%llu src=%llu cookie=%llu priority=%lld depth=%u ret=%d",
+		  __entry->conn_id, __entry->src_id, __entry->cookie,
+		  __entry->priority, __entry->depth, __entry->ret)
+);
+
+/* a message was taken off the queue, the latency is the time it was queued */
+TRACE_EVENT(kdbus_msg_recv,
+	TP_PROTO(u64 conn_id, u64 src_id, u64 cookie, size_t size,
+		 unsigned int depth, u64 queued_ns),
+	TP_ARGS(conn_id, src_id, cookie, size, depth, queued_ns),
+
+	TP_STRUCT__entry(
+		__field(u64,		conn_id)
+		__field(u64,		src_id)
+		__field(u64,		cookie)
+		__field(size_t,		size)
+		__field(unsigned int,	depth)
+		__field(u64,		latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->conn_id = conn_id;
+		__entry->src_id = src_id;
+		__entry->cookie = cookie;
+		__entry->size = size;
+		__entry->depth = depth;
+		__entry->latency_ns = queued_ns ? kdbus_now_ns() - queued_ns : 0;
+	),
+
+	TP_printk("conn=%llu src=%llu cookie=%llu size=%zu depth=%u latency=%lluns",
+		  __entry->conn_id, __entry->src_id, __entry->cookie,
+		  __entry->size, __entry->depth, __entry->latency_ns)
+);
+#endif
+
+/* this part must be outside of the header guard */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>